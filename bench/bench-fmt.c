@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <time.h>
+#include "../mish.c"
+
+/* Times the atom formatter against the snprintf calls it replaced,
+ * for exact and inexact numbers of a few magnitudes,
+ * and the number lexer against strtod.
+ */
+
+#define BENCH_ROUNDS 200000
+
+double DOUBLES[] = {0.1, 3.14159, 123.001, 1e6 + 0.5, 2.5e-7, 1e15};
+#define NUM_DOUBLES (sizeof(DOUBLES)/sizeof(DOUBLES[0]))
+
+int64_t INTS[] = {0, 7, -42, 8080, 1000000007, INT64_MIN};
+#define NUM_INTS (sizeof(INTS)/sizeof(INTS[0]))
+
+char buffer[FMT_DOUBLE_SIZE + 1];
+size_t sink_total = 0;
+
+double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+void time_doubles(void) {
+  size_t i, round;
+  double start, with_snprintf, with_fmt;
+  fmt_buffer out;
+
+  start = now_ns();
+  for (round = 0; round < BENCH_ROUNDS; round++) {
+    for (i = 0; i < NUM_DOUBLES; i++) {
+      sink_total += (size_t)snprintf(buffer, sizeof(buffer), "%f", DOUBLES[i]);
+    }
+  }
+  with_snprintf = now_ns() - start;
+
+  start = now_ns();
+  for (round = 0; round < BENCH_ROUNDS; round++) {
+    for (i = 0; i < NUM_DOUBLES; i++) {
+      out = fmt_buffer_new(buffer, sizeof(buffer));
+      sink_total += fmt_double(fmt_buffer_put, &out, DOUBLES[i]);
+    }
+  }
+  with_fmt = now_ns() - start;
+
+  printf("inexact: snprintf %.1f ns, fmt_double %.1f ns\n",
+         with_snprintf / (double)(BENCH_ROUNDS * NUM_DOUBLES),
+         with_fmt / (double)(BENCH_ROUNDS * NUM_DOUBLES));
+}
+
+void time_ints(void) {
+  size_t i, round;
+  double start, with_snprintf, with_fmt;
+
+  start = now_ns();
+  for (round = 0; round < BENCH_ROUNDS; round++) {
+    for (i = 0; i < NUM_INTS; i++) {
+      sink_total += (size_t)snprintf(buffer, sizeof(buffer), "%ld", (long)INTS[i]);
+    }
+  }
+  with_snprintf = now_ns() - start;
+
+  start = now_ns();
+  for (round = 0; round < BENCH_ROUNDS; round++) {
+    for (i = 0; i < NUM_INTS; i++) {
+      sink_total += fmt_i64(buffer, INTS[i]);
+    }
+  }
+  with_fmt = now_ns() - start;
+
+  printf("exact:   snprintf %.1f ns, fmt_i64 %.1f ns\n",
+         with_snprintf / (double)(BENCH_ROUNDS * NUM_INTS),
+         with_fmt / (double)(BENCH_ROUNDS * NUM_INTS));
+}
+
+char* TEXTS[] = {"0.1", "3.14159", "123.001", "1e-6", "6.02214076e23", "0.000123456789012345678"};
+#define NUM_TEXTS (sizeof(TEXTS)/sizeof(TEXTS[0]))
+
+void time_parse(void) {
+  size_t i, round;
+  double start, with_strtod, with_lex;
+  double total = 0;
+  lex l;
+
+  start = now_ns();
+  for (round = 0; round < BENCH_ROUNDS; round++) {
+    for (i = 0; i < NUM_TEXTS; i++) {
+      total += strtod(TEXTS[i], NULL);
+    }
+  }
+  with_strtod = now_ns() - start;
+
+  start = now_ns();
+  for (round = 0; round < BENCH_ROUNDS; round++) {
+    for (i = 0; i < NUM_TEXTS; i++) {
+      l = lex_new(TEXTS[i], strlen(TEXTS[i]));
+      lex_next(&l);
+      total += l.lexeme.value.inexact_num;
+    }
+  }
+  with_lex = now_ns() - start;
+
+  printf("parse:   strtod %.1f ns, lex_next %.1f ns (sum %g)\n",
+         with_strtod / (double)(BENCH_ROUNDS * NUM_TEXTS),
+         with_lex / (double)(BENCH_ROUNDS * NUM_TEXTS), total);
+}
+
+int main(void) {
+  time_doubles();
+  time_ints();
+  time_parse();
+  printf("(%lu bytes formatted)\n", (unsigned long)sink_total);
+  return 0;
+}
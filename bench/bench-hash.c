@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <time.h>
+#include "../mish.c"
+
+/* Compares the environment hash against the byte loop it replaced:
+ * the probe lengths of a linear-probe table are simulated for both,
+ * then map_find is timed on a real map.
+ * Each table gets the slots a MISH_CFG_HASHMAP_BUCKET_ARRAY_SIZE
+ * of RATIOS[i]/MISH_CFG_GRANULARITY would give on a BENCH_MEMORY shell.
+ */
+
+#define BENCH_MEMORY 8192
+#define BENCH_ROUNDS 20000
+#define HIST_SIZE    6
+
+size_t RATIOS[] = {4, 8, 16, 32};
+
+char* NAMES[] = {
+  "def", "echo", "hard_clear", "available_env_memory", "print_env",
+  "i2cscan", "i2cread", "i2cwrite", "spiread", "spiwrite",
+  "gpio_set", "gpio_get", "gpio_mode", "pwm", "adc_read",
+  "uart_baud", "uart_send", "blink", "led", "reset",
+  "reboot", "status", "uptime", "temp", "humidity",
+  "wifi_scan", "wifi_join", "ip", "ping", "help",
+  "port", "cmd", "baud", "pin", "delay",
+  "a", "b", "c", "d", "e", "f", "g", "h", "i", "j", "k", "l", "m",
+  "n", "o", "p", "q", "r", "s", "t", "u", "v", "w", "x", "y", "z"
+};
+#define NUM_NAMES (sizeof(NAMES)/sizeof(NAMES[0]))
+
+uint8_t str_memory[BENCH_MEMORY];
+uint8_t node_memory[BENCH_MEMORY];
+mish_map_slot slot_memory[BENCH_MEMORY];
+uint8_t sim_memory[BENCH_MEMORY];
+
+uint32_t old_str_hash(size_t key) {
+  char* buff = NAMES[key];
+  size_t size = strlen(buff);
+  uint32_t out = 0xCAFEBABE;
+  size_t i;
+  for (i = 0; i < size; i++) {
+    out = out ^ (uint32_t)buff[i] * 0x5bd1e995;
+    out = out ^ (out >> 15);
+  }
+  return out;
+}
+
+uint32_t new_str_hash(size_t key) {
+  return map_murmur_hash(NAMES[key], strlen(NAMES[key]), 0);
+}
+
+/* addresses and masks tend to be multiples of a power of two */
+uint32_t old_num_hash(size_t key) {
+  return (uint32_t)((key * 256) % UINT_MAX);
+}
+
+uint32_t new_num_hash(size_t key) {
+  return map_hash_exact(key * 256, 0);
+}
+
+size_t bench_capacity(size_t ratio) {
+  return util_pow2_floor((BENCH_MEMORY * ratio / MISH_CFG_GRANULARITY) /
+                         sizeof(mish_map_slot));
+}
+
+size_t bench_num_keys(size_t capacity) {
+  size_t max = capacity - capacity/8 - 1;
+  return max < NUM_NAMES ? max : NUM_NAMES;
+}
+
+/* lookups of present keys cost their distance from the home slot plus one */
+void simulate(char* label, uint32_t (*hash)(size_t), size_t capacity) {
+  size_t hist[HIST_SIZE] = {0};
+  size_t mask = capacity - 1;
+  size_t keys = bench_num_keys(capacity);
+  size_t i, index, probes, total = 0, longest = 0;
+
+  memset(sim_memory, 0, capacity);
+  for (i = 0; i < keys; i++) {
+    index = hash(i) & mask;
+    probes = 1;
+    while (sim_memory[index]) {
+      index = (index + 1) & mask;
+      probes++;
+    }
+    sim_memory[index] = 1;
+    total += probes;
+    longest = probes > longest ? probes : longest;
+    hist[probes < HIST_SIZE ? probes - 1 : HIST_SIZE - 1]++;
+  }
+
+  printf("  %-8s keys %3lu  mean %5.2f  max %3lu  probes 1:%lu 2:%lu 3:%lu 4:%lu 5:%lu 6+:%lu\n",
+         label, (unsigned long)keys, (double)total / (double)keys,
+         (unsigned long)longest,
+         (unsigned long)hist[0], (unsigned long)hist[1], (unsigned long)hist[2],
+         (unsigned long)hist[3], (unsigned long)hist[4], (unsigned long)hist[5]);
+}
+
+double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+void time_lookups(size_t capacity) {
+  arena_RES res;
+  mish_map m;
+  mish_atom out;
+  size_t keys = bench_num_keys(capacity);
+  size_t i, round, found = 0;
+  double start, elapsed;
+
+  m.str_arena = arena_new(str_memory, sizeof(str_memory), &res);
+  m.node_arena = arena_new(node_memory, sizeof(node_memory), &res);
+  m.slots = slot_memory;
+  m.capacity = capacity;
+  m.generation = 0;
+  m.seed = 0;
+  map_clear(&m);
+
+  for (i = 0; i < keys; i++) {
+    if (!map_insert(&m, mish_atom_create_str(NAMES[i]), mish_atom_create_num_exact(i))) {
+      printf("  insert failed at %s\n", NAMES[i]);
+      return;
+    }
+  }
+
+  start = now_ns();
+  for (round = 0; round < BENCH_ROUNDS; round++) {
+    for (i = 0; i < keys; i++) {
+      found += map_find(&m, mish_atom_create_str(NAMES[i]), &out);
+    }
+  }
+  elapsed = now_ns() - start;
+
+  printf("  map_find %.1f ns/lookup (%lu hits)\n",
+         elapsed / (double)(BENCH_ROUNDS * keys), (unsigned long)found);
+}
+
+int main(void) {
+  size_t i, capacity;
+
+  for (i = 0; i < sizeof(RATIOS)/sizeof(RATIOS[0]); i++) {
+    capacity = bench_capacity(RATIOS[i]);
+    printf("bucket array %lu/%d: %lu slots\n",
+           (unsigned long)RATIOS[i], MISH_CFG_GRANULARITY, (unsigned long)capacity);
+    simulate("old str", old_str_hash, capacity);
+    simulate("new str", new_str_hash, capacity);
+    simulate("old num", old_num_hash, capacity);
+    simulate("new num", new_num_hash, capacity);
+    time_lookups(capacity);
+  }
+  return 0;
+}
@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <time.h>
+#include "../mish.c"
+
+/* Runs a provisioning-like script line by line with mish_shell_eval,
+ * then in one call with mish_shell_eval_script.
+ */
+
+#define BENCH_MEMORY 16384
+#define BENCH_LINES  256
+#define BENCH_ROUNDS 200
+
+uint8_t shell_memory[BENCH_MEMORY];
+char script[BENCH_LINES * 48];
+size_t script_size = 0;
+
+double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/* half of the lines define a variable, the others print it */
+void build_script(void) {
+  size_t i;
+  for (i = 0; i < BENCH_LINES / 2; i++) {
+    script_size += (size_t)snprintf(script + script_size, sizeof(script) - script_size,
+                                    "def k%lu:%lu.5 v%lu:\"value %lu\"\n",
+                                    (unsigned long)(i % 16), (unsigned long)i,
+                                    (unsigned long)(i % 16), (unsigned long)i);
+    script_size += (size_t)snprintf(script + script_size, sizeof(script) - script_size,
+                                    "echo $k%lu $v%lu\n",
+                                    (unsigned long)(i % 16), (unsigned long)(i % 16));
+  }
+}
+
+void new_shell(mish_shell* s) {
+  if (mish_shell_new(shell_memory, sizeof(shell_memory), s) != mish_error_none ||
+      mish_shell_add_cmd(s, "def", mish_builtin_def) == false ||
+      mish_shell_add_cmd(s, "echo", mish_builtin_echo) == false) {
+    printf("shell setup failed\n");
+    exit(1);
+  }
+}
+
+double time_lines(void) {
+  mish_shell s;
+  size_t round, begin, end;
+  double start;
+
+  new_shell(&s);
+  start = now_ns();
+  for (round = 0; round < BENCH_ROUNDS; round++) {
+    for (begin = 0; begin < script_size; begin = end) {
+      end = begin;
+      while (script[end++] != '\n') {}
+      if (mish_shell_eval(&s, script + begin, end - begin) != mish_error_none) {
+        printf("line failed: %s\n", mish_util_error_str(s.err.code));
+        exit(1);
+      }
+    }
+  }
+  return now_ns() - start;
+}
+
+double time_script(void) {
+  mish_shell s;
+  size_t round;
+  double start;
+
+  new_shell(&s);
+  start = now_ns();
+  for (round = 0; round < BENCH_ROUNDS; round++) {
+    if (mish_shell_eval_script(&s, script, script_size, NULL, NULL) != mish_error_none) {
+      printf("script failed: %s\n", mish_util_error_str(s.err.code));
+      exit(1);
+    }
+  }
+  return now_ns() - start;
+}
+
+int main(void) {
+  double lines, whole;
+  build_script();
+  lines = time_lines();
+  whole = time_script();
+  printf("%d lines, %lu bytes\n", BENCH_LINES, (unsigned long)script_size);
+  printf("  mish_shell_eval per line  %.1f us/script\n", lines / BENCH_ROUNDS / 1e3);
+  printf("  mish_shell_eval_script    %.1f us/script\n", whole / BENCH_ROUNDS / 1e3);
+  return 0;
+}
@@ -0,0 +1,425 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../mish.c"
+
+/* Microbenchmarks of the hot paths, printed as tab separated
+ * name, value and unit, one per line:
+ *
+ *   bench-suite                       > baseline.tsv
+ *   bench-suite -c baseline.tsv [-t 10]
+ *
+ * With -c the results are compared against a saved run instead, and
+ * the exit status is 1 if any of them got worse by more than -t percent.
+ * Units ending in "/s" are better when higher, "ns" when lower.
+ * Every value is the best of BENCH_REPEATS runs of at least
+ * BENCH_MIN_NS each, which keeps them stable across runs.
+ */
+
+#define BENCH_REPEATS   5
+#define BENCH_MIN_NS    2e7
+#define BENCH_CORPUS    65536
+#define BENCH_MEMORY    65536
+#define MAP_SLOTS       1024
+#define MAP_MEMORY      (256 * 1024)
+#define MAX_RESULTS     64
+#define DEFAULT_THRESHOLD 10.0
+
+typedef struct {
+  char name[48];
+  double value;
+  char unit[8];
+} result;
+
+result results[MAX_RESULTS];
+size_t num_results = 0;
+
+double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/* runs fn with more iterations until it lasts BENCH_MIN_NS,
+ * returns the best time for a unit of what fn reports as done
+ */
+double measure(size_t (*fn)(size_t iters)) {
+  size_t iters = 1, units, i;
+  double start, elapsed, best = 0;
+
+  for (;;) {
+    start = now_ns();
+    units = fn(iters);
+    elapsed = now_ns() - start;
+    if (elapsed >= BENCH_MIN_NS) {
+      break;
+    }
+    iters *= 2;
+  }
+  best = elapsed / (double)units;
+  for (i = 1; i < BENCH_REPEATS; i++) {
+    start = now_ns();
+    units = fn(iters);
+    elapsed = (now_ns() - start) / (double)units;
+    best = elapsed < best ? elapsed : best;
+  }
+  return best;
+}
+
+void report(const char* name, double value, const char* unit) {
+  result* r;
+  if (num_results == MAX_RESULTS) {
+    return;
+  }
+  r = &results[num_results++];
+  snprintf(r->name, sizeof(r->name), "%s", name);
+  snprintf(r->unit, sizeof(r->unit), "%s", unit);
+  r->value = value;
+}
+
+/* BEGIN: LEX */
+typedef struct {
+  const char* name;
+  const char* line;
+} corpus_line;
+
+corpus_line corpora[] = {
+  {"lex/commands", "wifi-connect ssid:meuwifi pwd:\"12345678\" | echo $port retries:3\n"},
+  {"lex/numbers",  "set 0xDEAD_BEEF 0b1010_0101 123_456 3.14159 6.02e23 -1e-6 42\n"},
+  {"lex/strings",  "echo \"a quoted \\\"string\\\" with\\tescapes\\n\" 'single \\'one\\'' \"na\xc3\xafve\"\n"},
+  {"lex/ids",      "gpio-mode pin-13 output pull-up drive-strength fast slew-rate <= a*b/c?\n"}
+};
+#define NUM_CORPORA (sizeof(corpora)/sizeof(corpora[0]))
+
+char corpus[BENCH_CORPUS];
+size_t corpus_size;
+
+void fill_corpus(const char* line) {
+  size_t len = strlen(line);
+  corpus_size = 0;
+  while (corpus_size + len <= sizeof(corpus)) {
+    memcpy(corpus + corpus_size, line, len);
+    corpus_size += len;
+  }
+}
+
+/* input is validated once per line by the shell, not while lexing */
+size_t bench_lex(size_t iters) {
+  size_t i;
+  lex l;
+  for (i = 0; i < iters; i++) {
+    l = lex_new(corpus, corpus_size);
+    l.validated = true;
+    while (lex_next(&l) && l.lexeme.kind != lex_kind_eof) {
+    }
+    if (l.err.code != mish_error_none) {
+      printf("lexing failed: %d\n", l.err.code);
+      exit(1);
+    }
+  }
+  return iters * corpus_size; /* bytes */
+}
+/* END: LEX */
+
+uint8_t shell_memory[BENCH_MEMORY];
+mish_shell shell;
+
+/* the default split, with a share for the opt-in command cache */
+mish_error_code bench_new_shell(void) {
+  mish_shell_config c;
+  memset(&c, 0, sizeof(c));
+  c.arg_arena.share = 16;
+  c.str_arena.share = 36;
+  c.node_arena.share = 28;
+  c.out_buffer.share = 24;
+  c.prep_slot.share = 16;
+  c.buckets = BENCH_MEMORY / 256;
+  c.prep_slots = 2;
+  return mish_shell_new_config(shell_memory, BENCH_MEMORY, &c, &shell);
+}
+
+mish_error_code cmd_nop(mish_shell* s, mish_arg_list* list) {
+  if (s == NULL || list == NULL) { /* avoid warning */ }
+  return mish_error_none;
+}
+
+/* BEGIN: PARSE */
+const char* parse_line;
+
+/* lexing and parsing of a single line, as eval does it */
+size_t bench_parse(size_t iters) {
+  size_t i, size = strlen(parse_line);
+  mish_arg_list list;
+  lex l;
+  for (i = 0; i < iters; i++) {
+    arena_free_all(shell.arg_arena);
+    par_init_args(&list, NULL, 0);
+    l = lex_new(parse_line, size);
+    l.validated = true;
+    if (lex_next(&l) == false || par_parse_pairs(&l, &shell, &list) == false) {
+      printf("parsing failed: %d\n", shell.err.code);
+      exit(1);
+    }
+  }
+  return iters;
+}
+/* END: PARSE */
+
+/* BEGIN: MAP */
+uint8_t map_str_memory[MAP_MEMORY];
+uint8_t map_node_memory[MAP_MEMORY];
+mish_map_slot map_slots[MAP_SLOTS];
+mish_map bench_map;
+char keys[MAP_SLOTS][16];
+size_t num_keys;
+
+void map_setup(void) {
+  arena_RES res;
+  size_t i;
+  bench_map.str_arena = arena_new(map_str_memory, sizeof(map_str_memory), &res);
+  bench_map.node_arena = arena_new(map_node_memory, sizeof(map_node_memory), &res);
+  bench_map.slots = map_slots;
+  bench_map.capacity = MAP_SLOTS;
+  bench_map.generation = 0;
+  bench_map.seed = 0x9747b28c;
+  map_clear(&bench_map);
+  for (i = 0; i < MAP_SLOTS; i++) {
+    snprintf(keys[i], sizeof(keys[i]), "key-%lu", (unsigned long)i);
+  }
+}
+
+void map_fill(void) {
+  size_t i;
+  map_clear(&bench_map);
+  for (i = 0; i < num_keys; i++) {
+    if (map_insert(&bench_map, mish_atom_create_str(keys[i]), mish_atom_create_num_exact(i)) == false) {
+      printf("insert failed at %lu\n", (unsigned long)i);
+      exit(1);
+    }
+  }
+}
+
+size_t bench_map_insert(size_t iters) {
+  size_t i;
+  for (i = 0; i < iters; i++) {
+    map_fill();
+  }
+  return iters * num_keys;
+}
+
+size_t bench_map_find(size_t iters) {
+  size_t i, k, found = 0;
+  mish_atom out;
+  for (i = 0; i < iters; i++) {
+    for (k = 0; k < num_keys; k++) {
+      found += map_find(&bench_map, mish_atom_create_str(keys[k]), &out);
+    }
+  }
+  if (found != iters * num_keys) {
+    printf("lookups missed\n");
+    exit(1);
+  }
+  return iters * num_keys;
+}
+
+/* "key-" followed by letters is never inserted */
+size_t bench_map_miss(size_t iters) {
+  char key[16] = "key-";
+  size_t i, k, found = 0;
+  mish_atom out;
+  for (i = 0; i < iters; i++) {
+    for (k = 0; k < num_keys; k++) {
+      key[4] = (char)('a' + k % 26);
+      key[5] = (char)('a' + (k / 26) % 26);
+      found += map_find(&bench_map, mish_atom_create_str(key), &out);
+    }
+  }
+  if (found != 0) {
+    printf("missing keys were found\n");
+    exit(1);
+  }
+  return iters * num_keys;
+}
+/* END: MAP */
+
+/* BEGIN: EVAL */
+char* eval_lines[] = {
+  "echo $port $cmd\n",
+  "def led:1\n",
+  "nop pin:13 mode:output\n",
+  "echo a:1 b:\"two\" 3.5\n",
+  "nop 0xFF 0b1010 baud:115200\n",
+  "echo $led | nop\n",
+  "def cmd:i2cscan port:8080\n",
+  "nop addr:\"192.168.0.1:8080\" rate:20\n"
+};
+#define NUM_EVAL_LINES (sizeof(eval_lines)/sizeof(eval_lines[0]))
+
+char* eval_line;
+
+void eval_check(mish_error_code err) {
+  if (err != mish_error_none) {
+    printf("eval failed: %d\n", err);
+    exit(1);
+  }
+}
+
+/* the same line again, answered from the command cache */
+size_t bench_eval_cached(size_t iters) {
+  size_t i, size = strlen(eval_line);
+  for (i = 0; i < iters; i++) {
+    eval_check(mish_shell_eval(&shell, eval_line, size));
+  }
+  return iters;
+}
+
+/* scripts skip the cache, so every line is lexed and parsed */
+size_t bench_eval_uncached(size_t iters) {
+  size_t i, size = strlen(eval_line);
+  for (i = 0; i < iters; i++) {
+    eval_check(mish_shell_eval_script(&shell, eval_line, size, NULL, NULL));
+  }
+  return iters;
+}
+
+/* more distinct lines than cache slots */
+size_t bench_eval_mix(size_t iters) {
+  size_t i;
+  char* line;
+  for (i = 0; i < iters; i++) {
+    line = eval_lines[i % NUM_EVAL_LINES];
+    eval_check(mish_shell_eval(&shell, line, strlen(line)));
+  }
+  return iters;
+}
+/* END: EVAL */
+
+void run_all(void) {
+  char name[48];
+  size_t load[] = {25, 50, 75, 85};
+  double one, two;
+  size_t i;
+
+  for (i = 0; i < NUM_CORPORA; i++) {
+    fill_corpus(corpora[i].line);
+    report(corpora[i].name, 1e3 / measure(bench_lex), "MB/s");
+  }
+
+  if (bench_new_shell() != mish_error_none ||
+      mish_shell_add_cmd(&shell, "def", mish_builtin_def) == false ||
+      mish_shell_add_cmd(&shell, "echo", mish_builtin_echo) == false ||
+      mish_shell_add_cmd(&shell, "nop", cmd_nop) == false ||
+      mish_shell_add_str(&shell, "port", "8080") == false ||
+      mish_shell_add_str(&shell, "cmd", "i2cscan") == false ||
+      mish_shell_eval(&shell, "def led:1\n", 10) != mish_error_none) {
+    printf("shell setup failed\n");
+    exit(1);
+  }
+
+  parse_line = "wifi-connect ssid:meuwifi pwd:\"12345678\" retries:3 0x1F\n";
+  report("parse/pairs", measure(bench_parse), "ns");
+  parse_line = "echo $port $cmd port:$port\n";
+  report("parse/vars", measure(bench_parse), "ns");
+
+  map_setup();
+  for (i = 0; i < sizeof(load)/sizeof(load[0]); i++) {
+    num_keys = MAP_SLOTS * load[i] / 100;
+    snprintf(name, sizeof(name), "map/insert-%lu%%", (unsigned long)load[i]);
+    report(name, measure(bench_map_insert), "ns");
+    map_fill();
+    snprintf(name, sizeof(name), "map/find-%lu%%", (unsigned long)load[i]);
+    report(name, measure(bench_map_find), "ns");
+    snprintf(name, sizeof(name), "map/miss-%lu%%", (unsigned long)load[i]);
+    report(name, measure(bench_map_miss), "ns");
+  }
+
+  eval_line = "echo a:1 b:\"two\" 3.5\n";
+  report("eval/cached", 1e9 / measure(bench_eval_cached), "ops/s");
+  report("eval/uncached", 1e9 / measure(bench_eval_uncached), "ops/s");
+  report("eval/mix", 1e9 / measure(bench_eval_mix), "ops/s");
+
+  /* the cost of a stage, the same command with and without a pipe */
+  eval_line = "echo a b c\n";
+  one = measure(bench_eval_uncached);
+  eval_line = "echo a b c | nop\n";
+  two = measure(bench_eval_uncached);
+  report("pipe/1-stage", one, "ns");
+  report("pipe/2-stage", two, "ns");
+  /* a difference of two noisy timings, only the timings are compared */
+  fprintf(stderr, "pipe/overhead %.2f ns\n", two - one);
+}
+
+/* BEGIN: COMPARE */
+bool higher_is_better(const char* unit) {
+  size_t len = strlen(unit);
+  return len >= 2 && strcmp(unit + len - 2, "/s") == 0;
+}
+
+/* returns the number of regressions */
+size_t compare(const char* path, double threshold) {
+  char name[48], unit[8];
+  double base, change;
+  size_t i, regressions = 0;
+  bool found;
+  FILE* f = fopen(path, "r");
+
+  if (f == NULL) {
+    perror(path);
+    exit(2);
+  }
+  printf("%-20s %12s %12s %8s\n", "name", "baseline", "current", "change");
+  while (fscanf(f, "%47s %lf %7s", name, &base, unit) == 3) {
+    found = false;
+    for (i = 0; i < num_results && found == false; i++) {
+      if (strcmp(results[i].name, name) != 0) {
+        continue;
+      }
+      found = true;
+      /* positive is worse in both directions */
+      change = (results[i].value - base) / base * 100.0;
+      if (higher_is_better(unit)) {
+        change = -change;
+      }
+      printf("%-20s %12.2f %12.2f %+7.1f%%%s\n", name, base, results[i].value, change,
+             change > threshold ? "  REGRESSION" : "");
+      regressions += change > threshold;
+    }
+    if (found == false) {
+      printf("%-20s %12.2f %12s\n", name, base, "missing");
+    }
+  }
+  fclose(f);
+  return regressions;
+}
+/* END: COMPARE */
+
+int main(int argc, char** argv) {
+  const char* baseline = NULL;
+  double threshold = DEFAULT_THRESHOLD;
+  size_t i, regressions;
+
+  for (i = 1; i < (size_t)argc; i++) {
+    if (strcmp(argv[i], "-c") == 0 && i + 1 < (size_t)argc) {
+      baseline = argv[++i];
+    } else if (strcmp(argv[i], "-t") == 0 && i + 1 < (size_t)argc) {
+      threshold = atof(argv[++i]);
+    } else {
+      fprintf(stderr, "usage: bench-suite [-c baseline.tsv] [-t percent]\n");
+      return 2;
+    }
+  }
+
+  run_all();
+  if (baseline == NULL) {
+    for (i = 0; i < num_results; i++) {
+      printf("%s\t%.2f\t%s\n", results[i].name, results[i].value, results[i].unit);
+    }
+    return 0;
+  }
+  regressions = compare(baseline, threshold);
+  if (regressions > 0) {
+    printf("%lu regressions over %.1f%%\n", (unsigned long)regressions, threshold);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include "../mish.c"
+
+/* Sessions sharing one environment, each on its own thread.
+ * Readers evaluate lines that look variables up, one line in
+ * WRITE_EVERY redefines a variable, and the first thread compacts
+ * the environment every COMPACT_EVERY lines, which stops the others.
+ * Reports lines per second for a growing number of threads.
+ */
+
+#define BENCH_MEMORY   65536
+#define SESSION_MEMORY 8192
+#define MAX_THREADS    16
+#define BENCH_LINES    200000
+#define NUM_VARS       64
+#define WRITE_EVERY    64
+#define COMPACT_EVERY  20000
+
+#ifndef MISH_CFG_THREADS
+#error "build with -DMISH_CFG_THREADS -pthread"
+#endif
+
+uint8_t shell_memory[BENCH_MEMORY];
+uint8_t session_memory[MAX_THREADS][SESSION_MEMORY];
+mish_shell shared;
+
+typedef struct {
+  mish_shell s;
+  size_t id;
+  size_t errors;
+  pthread_t thread;
+} worker;
+
+worker workers[MAX_THREADS];
+
+double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+void* run_worker(void* arg) {
+  worker* w = (worker*)arg;
+  char line[64];
+  size_t i, var, len;
+  mish_error_code err;
+
+  for (i = 0; i < BENCH_LINES; i++) {
+    var = (i * 7 + w->id) % NUM_VARS;
+    if (i % WRITE_EVERY == 0) {
+      len = (size_t)snprintf(line, sizeof(line), "def v%lu:%lu\n",
+                             (unsigned long)var, (unsigned long)i);
+    } else {
+      len = (size_t)snprintf(line, sizeof(line), "echo $v%lu $v%lu\n",
+                             (unsigned long)var, (unsigned long)((var + 1) % NUM_VARS));
+    }
+    err = mish_shell_eval(&w->s, line, len);
+    if (err != mish_error_none) {
+      w->errors++;
+    }
+    if (w->id == 0 && i % COMPACT_EVERY == COMPACT_EVERY - 1) {
+      mish_shell_compact(&w->s);
+    }
+  }
+  return NULL;
+}
+
+void run(size_t threads) {
+  size_t i, errors = 0;
+  double start, elapsed;
+
+  for (i = 0; i < threads; i++) {
+    workers[i].id = i;
+    workers[i].errors = 0;
+    if (mish_shell_new_session(session_memory[i], SESSION_MEMORY, &shared, &workers[i].s)
+        != mish_error_none) {
+      printf("session setup failed\n");
+      exit(1);
+    }
+  }
+
+  start = now_ns();
+  for (i = 0; i < threads; i++) {
+    pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+  }
+  for (i = 0; i < threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    errors += workers[i].errors;
+    mish_shell_close_session(&workers[i].s);
+  }
+  elapsed = now_ns() - start;
+
+  printf("  %2lu threads  %8.0f lines/s  (%lu errors)\n", (unsigned long)threads,
+         (double)(threads * BENCH_LINES) / (elapsed / 1e9), (unsigned long)errors);
+}
+
+int main(void) {
+  char line[32];
+  size_t i, threads;
+
+  if (mish_shell_new(shell_memory, sizeof(shell_memory), &shared) != mish_error_none ||
+      mish_shell_add_cmd(&shared, "def", mish_builtin_def) == false ||
+      mish_shell_add_cmd(&shared, "echo", mish_builtin_echo) == false) {
+    printf("shell setup failed\n");
+    return 1;
+  }
+  for (i = 0; i < NUM_VARS; i++) {
+    snprintf(line, sizeof(line), "def v%lu:0\n", (unsigned long)i);
+    mish_shell_eval(&shared, line, strlen(line));
+  }
+
+  printf("shared environment, %d lines per thread\n", BENCH_LINES);
+  for (threads = 1; threads <= MAX_THREADS; threads *= 2) {
+    run(threads);
+  }
+  return 0;
+}
@@ -0,0 +1,29 @@
+#include <string.h>
+#include <unistd.h>
+
+/* Smallest program that prints an exact and an inexact number,
+ * built once with snprintf and once with the mish formatter
+ * to compare what each adds to a static image.
+ */
+
+#ifdef BENCH_SNPRINTF
+#include <stdio.h>
+#else
+#include "../mish.h"
+#endif
+
+int main(int argc, char** argv) {
+  char buffer[400];
+  size_t len;
+  (void)argv;
+#ifdef BENCH_SNPRINTF
+  len = (size_t)snprintf(buffer, sizeof(buffer), "%ld %f\n", (long)argc, (double)argc / 3);
+#else
+  len = mish_snprint_atom(buffer, sizeof(buffer), mish_atom_create_num_exact((uint64_t)argc));
+  buffer[len++] = ' ';
+  len += mish_snprint_atom(buffer + len, sizeof(buffer) - len,
+                           mish_atom_create_num_inexact((double)argc / 3));
+  buffer[len++] = '\n';
+#endif
+  return write(1, buffer, len) == (ssize_t)len ? 0 : 1;
+}
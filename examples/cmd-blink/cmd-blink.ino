@@ -8,45 +8,32 @@ extern "C" {
 }
 #endif
 
-#define MSG_SIZE 512
-char received_message[MSG_SIZE] = {0};
-
 #define SHELL_MEMORY_SIZE 8196
 uint8_t shell_memory[SHELL_MEMORY_SIZE] = {0};
-int i = 0;
 mish_shell s;
 
-mish_error_code cmd_setgpio(mish_shell* s, mish_arg_list* args) {
-  mish_arg_list* curr;
-  mish_pair p;
-  int64_t gpio;
-  int64_t value;
-
-  if (args == NULL) {
-    return mish_error_internal;
-  }
-
-  if (mish_argval_only_pairs(args) == false) {
-    return mish_error_contract_violation;
-  }
-
-  curr = args->next;
-  while (curr != NULL) {
-    p = curr->arg.contents.pair;
-
-    if (mish_atom_is_exact(p.key) == false ||
-        mish_atom_is_exact(p.value) == false) {
-      return mish_error_contract_violation;
-    }
+/* set-gpio pin:<n> [value:<0 or 1>] */
+typedef struct {
+  uint64_t pin;
+  uint64_t value;
+} gpio_args;
 
-    gpio = p.key.contents.exact_num;
-    value = p.value.contents.exact_num;
+const mish_field gpio_fields[] = {
+  {{(char*)"pin", 3}, mish_fk_exact, offsetof(gpio_args, pin), true},
+  {{(char*)"value", 5}, mish_fk_exact, offsetof(gpio_args, value), false}
+};
+const mish_schema gpio_schema = {gpio_fields, 2};
 
-    pinMode((uint8_t)gpio, OUTPUT);
-    digitalWrite((uint8_t)gpio, (uint8_t) value);
+mish_error_code cmd_setgpio(mish_shell* s, mish_arg_list* args) {
+  gpio_args a = {0, 1}; /* on, unless a value is given */
+  mish_error_code err;
 
-    curr = curr->next;
+  err = mish_args_extract(args, &gpio_schema, &a, NULL);
+  if (err != mish_error_none) {
+    return err;
   }
+  pinMode((uint8_t)a.pin, OUTPUT);
+  digitalWrite((uint8_t)a.pin, (uint8_t)a.value);
   return mish_error_none;
 }
 
@@ -54,10 +41,10 @@ mish_error_code cmd_clear(mish_shell* s, mish_arg_list* list) {
   bool ok = true;
   mish_builtin_hard_clear(s, list);
   
-  ok = ok && mish_shell_new_cmd(s, "def", mish_builtin_def);
-  ok = ok && mish_shell_new_cmd(s, "echo", mish_builtin_echo);
-  ok = ok && mish_shell_new_cmd(s, "clear", cmd_clear);
-  ok = ok && mish_shell_new_cmd(s, "set-gpio", cmd_setgpio);
+  ok = ok && mish_shell_add_cmd(s, "def", mish_builtin_def);
+  ok = ok && mish_shell_add_cmd(s, "echo", mish_builtin_echo);
+  ok = ok && mish_shell_add_cmd(s, "clear", cmd_clear);
+  ok = ok && mish_shell_add_cmd(s, "set-gpio", cmd_setgpio);
   if (ok == false) {
     return mish_error_insert_failed;
   }
@@ -73,6 +60,7 @@ void setup() {
     Serial.printf("mish_shell_new error: %d\n", err);
     abort();
   }
+  mish_shell_set_sink(&s, serial_sink, NULL);
   err = cmd_clear(&s, NULL);
   if (err != mish_error_none) {
     Serial.printf("cmd_clear error: %d\n", err);
@@ -81,31 +69,23 @@ void setup() {
   uint64_t a;
 }
 
-mish_error_code loop_err;
-void loop() {
-  while (Serial.available() && i < MSG_SIZE-2) {
-    char c = Serial.read();
-    if (c == '\n') {
-      received_message[i] = '\n';
-      received_message[i+1] = '\0';
-      Serial.print(received_message);
+/* output is streamed, so replies are not limited by the out buffer */
+void serial_sink(mish_shell* s, const char* data, size_t size, void* user) {
+  Serial.write((const uint8_t*)data, size);
+}
 
-      loop_err = mish_shell_eval(&s, received_message, i+1);
-      if (loop_err != mish_error_none) {
-        Serial.printf("Error: %d\n", loop_err);
-        i = 0;
-        *received_message = '\0';
-        Serial.print(">");
-        continue;
-      }
+void line_done(mish_shell* s, mish_error_code err, void* user) {
+  if (err != mish_error_none) {
+    Serial.printf("Error: %d\n", err);
+  }
+  Serial.print(">");
+}
 
-      Serial.print(s.out_buffer);
-      Serial.print(">");
-      i = 0;
-      *received_message = '\0';
-    } else {
-      received_message[i] = c;
-      i++;
-    }
+/* bytes go straight to the shell, each line runs as soon as its newline arrives */
+void loop() {
+  while (Serial.available()) {
+    char c = Serial.read();
+    Serial.print(c);
+    mish_shell_feed(&s, &c, 1, line_done, NULL);
   }
 }
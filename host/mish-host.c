@@ -0,0 +1,326 @@
+/*
+  Serves mish sessions over TCP or a Unix socket from one epoll loop.
+
+  usage: mish-host [-p port | -u path] [-m max connections]
+
+  Every connection gets a session on one shared environment, so a
+  `def` made by one client is seen by all of them. Bytes are fed to the
+  session as they arrive, and the reply of each line is its output,
+  `error: <code>` if it failed, and the prompt `> `. Replies are queued
+  per connection and written without blocking; a client that doesn't
+  read them stops being read until its queue drains.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "../mish.c"
+
+#define HOST_ENV_MEMORY     (1 << 20)
+#define HOST_SESSION_MEMORY 8192
+#define HOST_READ_SIZE      4096
+#define HOST_MAX_PENDING    (64 * 1024) /* queued reply bytes before reads stop */
+#define HOST_MAX_EVENTS     256
+#define HOST_DEFAULT_PORT   7070
+#define HOST_DEFAULT_MAX    16384
+
+typedef struct {
+  int fd;
+  mish_shell s;
+  uint8_t memory[HOST_SESSION_MEMORY];
+  char* out;
+  size_t out_begin; /* first byte not yet written */
+  size_t out_end;
+  size_t out_cap;
+  bool reading;
+  bool writing;
+  bool failed;      /* out of memory for replies, closed once flushed */
+} host_conn;
+
+uint8_t env_memory[HOST_ENV_MEMORY];
+mish_shell env;
+int epoll_fd;
+size_t num_conns = 0;
+size_t max_conns = HOST_DEFAULT_MAX;
+
+mish_error_code host_clear(mish_shell* s, mish_arg_list* list) {
+  bool ok = true;
+  mish_builtin_hard_clear(s, list);
+
+  ok = ok && mish_shell_add_cmd(s, "def", mish_builtin_def);
+  ok = ok && mish_shell_add_cmd(s, "echo", mish_builtin_echo);
+  ok = ok && mish_shell_add_cmd(s, "compact", mish_builtin_compact);
+  ok = ok && mish_shell_add_cmd(s, "mem", mish_builtin_available_env_memory);
+  ok = ok && mish_shell_add_cmd(s, "env", mish_builtin_print_env);
+  ok = ok && mish_shell_add_cmd(s, "clear", host_clear);
+  if (ok == false) {
+    return mish_error_insert_failed;
+  }
+  return mish_error_none;
+}
+
+/* BEGIN: CONNECTIONS */
+void host_queue(host_conn* c, const char* data, size_t size) {
+  size_t cap;
+  char* out;
+
+  if (c->out_begin == c->out_end) {
+    c->out_begin = c->out_end = 0;
+  }
+  if (c->out_end + size > c->out_cap && c->out_begin > 0) {
+    memmove(c->out, c->out + c->out_begin, c->out_end - c->out_begin);
+    c->out_end -= c->out_begin;
+    c->out_begin = 0;
+  }
+  if (c->out_end + size > c->out_cap) {
+    cap = c->out_cap == 0 ? 256 : c->out_cap;
+    while (cap < c->out_end + size) {
+      cap *= 2;
+    }
+    out = (char*)realloc(c->out, cap);
+    if (out == NULL) {
+      c->failed = true;
+      return;
+    }
+    c->out = out;
+    c->out_cap = cap;
+  }
+  memcpy(c->out + c->out_end, data, size);
+  c->out_end += size;
+}
+
+void host_sink(mish_shell* s, const char* data, size_t size, void* user) {
+  if (s == NULL) { /* avoid warning */ }
+  host_queue((host_conn*)user, data, size);
+}
+
+void host_line_done(mish_shell* s, mish_error_code err, void* user) {
+  host_conn* c = (host_conn*)user;
+  char reply[FMT_INT_SIZE + 16] = "error: ";
+  size_t len;
+
+  if (s == NULL) { /* avoid warning */ }
+  if (err != mish_error_none) {
+    len = 7 + fmt_u64(reply + 7, (uint64_t)err, 10);
+    memcpy(reply + len, "\r\n", 2);
+    host_queue(c, reply, len + 2);
+  }
+  host_queue(c, "> ", 2);
+}
+
+/* only asks epoll for what the connection can do now */
+bool host_watch(host_conn* c) {
+  struct epoll_event ev;
+  bool reading = c->failed == false && c->out_end - c->out_begin < HOST_MAX_PENDING;
+  bool writing = c->out_end > c->out_begin;
+
+  if (reading == c->reading && writing == c->writing) {
+    return true;
+  }
+  c->reading = reading;
+  c->writing = writing;
+  ev.events = (reading ? EPOLLIN : 0) | (writing ? EPOLLOUT : 0);
+  ev.data.ptr = c;
+  return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) == 0;
+}
+
+void host_close(host_conn* c) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  mish_shell_close_session(&c->s);
+  free(c->out);
+  free(c);
+  num_conns--;
+}
+
+/* returns false once the connection should be closed */
+bool host_flush(host_conn* c) {
+  ssize_t n;
+  while (c->out_end > c->out_begin) {
+    n = write(c->fd, c->out + c->out_begin, c->out_end - c->out_begin);
+    if (n < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    c->out_begin += (size_t)n;
+  }
+  return c->failed == false;
+}
+
+bool host_read(host_conn* c) {
+  char buffer[HOST_READ_SIZE];
+  ssize_t n = read(c->fd, buffer, sizeof(buffer));
+  if (n == 0) {
+    return false;
+  }
+  if (n < 0) {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  }
+  mish_shell_feed(&c->s, buffer, (size_t)n, host_line_done, c);
+  return true;
+}
+
+void host_event(host_conn* c, uint32_t events) {
+  bool ok = true;
+  if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+    ok = host_read(c);
+  }
+  /* replies are usually written right away, without waiting for EPOLLOUT */
+  ok = ok && host_flush(c);
+  ok = ok && host_watch(c);
+  if (ok == false) {
+    host_close(c);
+  }
+}
+
+void host_accept(int listen_fd) {
+  struct epoll_event ev;
+  host_conn* c;
+  int fd, one = 1;
+
+  for (;;) {
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("accept");
+      }
+      return;
+    }
+    c = num_conns < max_conns ? (host_conn*)calloc(1, sizeof(host_conn)) : NULL;
+    if (c == NULL ||
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0 ||
+        mish_shell_new_session(c->memory, HOST_SESSION_MEMORY, &env, &c->s) != mish_error_none) {
+      free(c);
+      close(fd);
+      continue;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); /* fails on unix sockets */
+    c->fd = fd;
+    c->reading = true;
+    mish_shell_set_sink(&c->s, host_sink, c);
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      mish_shell_close_session(&c->s);
+      free(c);
+      close(fd);
+      continue;
+    }
+    num_conns++;
+    host_queue(c, "> ", 2);
+    host_event(c, 0);
+  }
+}
+/* END: CONNECTIONS */
+
+/* BEGIN: LISTENING */
+int host_listen_tcp(int port) {
+  struct sockaddr_in addr;
+  int fd, one = 1;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons((uint16_t)port);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int host_listen_unix(const char* path) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    return -1;
+  }
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  unlink(path);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path, strlen(path) + 1);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+/* END: LISTENING */
+
+void usage(void) {
+  fprintf(stderr, "usage: mish-host [-p port | -u path] [-m max connections]\n");
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  struct epoll_event events[HOST_MAX_EVENTS], ev;
+  int port = HOST_DEFAULT_PORT;
+  const char* path = NULL;
+  int listen_fd, n, i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+      port = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc) {
+      path = argv[++i];
+    } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+      max_conns = (size_t)atol(argv[++i]);
+    } else {
+      usage();
+    }
+  }
+
+  if (mish_shell_new(env_memory, HOST_ENV_MEMORY, &env) != mish_error_none ||
+      host_clear(&env, NULL) != mish_error_none) {
+    fprintf(stderr, "shell setup failed\n");
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  listen_fd = path != NULL ? host_listen_unix(path) : host_listen_tcp(port);
+  if (listen_fd < 0 ||
+      fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK) != 0 ||
+      listen(listen_fd, SOMAXCONN) != 0) {
+    perror("listen");
+    return 1;
+  }
+  epoll_fd = epoll_create1(0);
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL; /* the listening socket */
+  if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) != 0) {
+    perror("epoll");
+    return 1;
+  }
+
+  for (;;) {
+    n = epoll_wait(epoll_fd, events, HOST_MAX_EVENTS, -1);
+    if (n < 0 && errno != EINTR) {
+      perror("epoll_wait");
+      return 1;
+    }
+    for (i = 0; i < n; i++) {
+      if (events[i].data.ptr == NULL) {
+        host_accept(listen_fd);
+      } else {
+        host_event((host_conn*)events[i].data.ptr, events[i].events);
+      }
+    }
+  }
+}
@@ -0,0 +1,264 @@
+/*
+  Load generator for mish-host.
+
+  usage: mish-load [-p port | -u path] [-c connections] [-d seconds]
+
+  Opens the connections, waits for their first prompt, and then has
+  each of them send one line and wait for its reply, over and over,
+  for the given time. Reports lines per second and the p50/p99/max
+  latency of a line. Without -c it runs with 1, 100 and 10000
+  connections. The lines it sends print a single line, so a reply
+  is complete once its newline has been read.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define LOAD_MAX_EVENTS  256
+#define LOAD_READ_SIZE   4096
+#define LOAD_DEFAULT_PORT 7070
+#define LOAD_DEFAULT_SECONDS 2.0
+
+const char load_line[] = "echo $n sensor:\"adc\" ch:3\n";
+const char load_setup[] = "def n:42\necho ready\n"; /* one reply line */
+
+typedef struct {
+  int fd;
+  bool ready;    /* the first prompt was read */
+  double sent;   /* when the line waiting for a reply was sent */
+} load_conn;
+
+int port = LOAD_DEFAULT_PORT;
+const char* path = NULL;
+
+uint64_t* samples = NULL; /* latencies in ns */
+size_t num_samples = 0;
+size_t cap_samples = 0;
+size_t errors = 0;
+
+double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+void add_sample(uint64_t ns) {
+  if (num_samples == cap_samples) {
+    cap_samples = cap_samples == 0 ? 65536 : cap_samples * 2;
+    samples = (uint64_t*)realloc(samples, cap_samples * sizeof(uint64_t));
+    if (samples == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+  samples[num_samples++] = ns;
+}
+
+int cmp_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+/* connects blocking, a full backlog makes us wait for the host */
+int load_connect(void) {
+  struct sockaddr_in in;
+  struct sockaddr_un un;
+  int fd, one = 1;
+
+  if (path != NULL) {
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    strncpy(un.sun_path, path, sizeof(un.sun_path) - 1);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&un, sizeof(un)) != 0) {
+      return -1;
+    }
+  } else {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&in, 0, sizeof(in));
+    in.sin_family = AF_INET;
+    in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    in.sin_port = htons((uint16_t)port);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&in, sizeof(in)) != 0) {
+      return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0) {
+    return -1;
+  }
+  return fd;
+}
+
+/* lines are tiny, a short write means the connection is broken */
+bool load_send(load_conn* c, const char* line, size_t size) {
+  c->sent = now_ns();
+  return write(c->fd, line, size) == (ssize_t)size;
+}
+
+/* returns the number of replies read, or -1 on error */
+int load_read(load_conn* c) {
+  char buffer[LOAD_READ_SIZE];
+  ssize_t n, i;
+  int replies = 0;
+
+  n = read(c->fd, buffer, sizeof(buffer));
+  if (n < 0) {
+    return errno == EAGAIN || errno == EINTR ? 0 : -1;
+  }
+  if (n == 0) {
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    if (buffer[i] == '\n') {
+      replies++;
+    } else if (buffer[i] == '>' && c->ready == false) {
+      c->ready = true;
+    }
+  }
+  for (i = 0; i + 6 <= n; i++) {
+    if (memcmp(buffer + i, "error:", 6) == 0) {
+      errors++;
+    }
+  }
+  return replies;
+}
+
+void run(size_t num_conns, double seconds) {
+  struct epoll_event events[LOAD_MAX_EVENTS], ev;
+  load_conn* conns;
+  size_t i, ready = 0;
+  double start, end, t, elapsed;
+  int epoll_fd, n, j, r;
+  load_conn* c;
+
+  conns = (load_conn*)calloc(num_conns, sizeof(load_conn));
+  epoll_fd = epoll_create1(0);
+  if (conns == NULL || epoll_fd < 0) {
+    fprintf(stderr, "setup failed\n");
+    exit(1);
+  }
+  for (i = 0; i < num_conns; i++) {
+    conns[i].fd = load_connect();
+    if (conns[i].fd < 0) {
+      perror("connect");
+      exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = &conns[i];
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+  }
+
+  /* every connection is served before the clock starts */
+  while (ready < num_conns) {
+    n = epoll_wait(epoll_fd, events, LOAD_MAX_EVENTS, 1000);
+    for (j = 0; j < n; j++) {
+      c = (load_conn*)events[j].data.ptr;
+      if (c->ready == false && load_read(c) >= 0 && c->ready) {
+        ready++;
+      }
+    }
+  }
+  if (load_send(&conns[0], load_setup, sizeof(load_setup) - 1) == false) {
+    exit(1);
+  }
+  do {
+    epoll_wait(epoll_fd, events, 1, 1000);
+    r = load_read(&conns[0]);
+  } while (r == 0);
+
+  num_samples = 0;
+  errors = 0;
+  start = now_ns();
+  end = start + seconds * 1e9;
+  for (i = 0; i < num_conns; i++) {
+    if (load_send(&conns[i], load_line, sizeof(load_line) - 1) == false) {
+      perror("write");
+      exit(1);
+    }
+  }
+  for (t = start; t < end; t = now_ns()) {
+    n = epoll_wait(epoll_fd, events, LOAD_MAX_EVENTS, 100);
+    for (j = 0; j < n; j++) {
+      c = (load_conn*)events[j].data.ptr;
+      r = load_read(c);
+      if (r < 0) {
+        fprintf(stderr, "connection lost\n");
+        exit(1);
+      }
+      if (r > 0) {
+        t = now_ns();
+        add_sample((uint64_t)(t - c->sent));
+        if (t < end && load_send(c, load_line, sizeof(load_line) - 1) == false) {
+          perror("write");
+          exit(1);
+        }
+      }
+    }
+  }
+  elapsed = now_ns() - start;
+
+  qsort(samples, num_samples, sizeof(uint64_t), cmp_u64);
+  printf("%6lu conns  %9.0f lines/s  p50 %8.1f us  p99 %8.1f us  max %8.1f us  (%lu errors)\n",
+         (unsigned long)num_conns, (double)num_samples * 1e9 / elapsed,
+         num_samples ? (double)samples[num_samples / 2] / 1e3 : 0.0,
+         num_samples ? (double)samples[(num_samples * 99) / 100] / 1e3 : 0.0,
+         num_samples ? (double)samples[num_samples - 1] / 1e3 : 0.0,
+         (unsigned long)errors);
+
+  for (i = 0; i < num_conns; i++) {
+    close(conns[i].fd);
+  }
+  close(epoll_fd);
+  free(conns);
+}
+
+void usage(void) {
+  fprintf(stderr, "usage: mish-load [-p port | -u path] [-c connections] [-d seconds]\n");
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  size_t num_conns = 0;
+  double seconds = LOAD_DEFAULT_SECONDS;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+      port = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc) {
+      path = argv[++i];
+    } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      num_conns = (size_t)atol(argv[++i]);
+    } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+      seconds = atof(argv[++i]);
+    } else {
+      usage();
+    }
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  if (num_conns > 0) {
+    run(num_conns, seconds);
+  } else {
+    run(1, seconds);
+    run(100, seconds);
+    run(10000, seconds);
+  }
+  free(samples);
+  return 0;
+}
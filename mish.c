@@ -2,7 +2,30 @@
 #include <limits.h>
 #include <strings.h>
 #include <string.h>
+#ifdef MISH_CFG_DEBUG
 #include <stdio.h>
+#endif
+
+#if defined(__SSE2__) && defined(__GNUC__) && !defined(MISH_CFG_NO_SIMD)
+#include <emmintrin.h>
+#define UTIL_USE_SSE2 1
+#else
+#define UTIL_USE_SSE2 0
+#endif
+
+/* Pointers published to other threads are stored with release and
+ * loaded with acquire, so what they point to is always complete.
+ */
+#ifdef MISH_CFG_THREADS
+#include <sched.h>
+#define UTIL_LOAD(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define UTIL_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define UTIL_INC(p)      __atomic_add_fetch((p), 1, __ATOMIC_RELAXED)
+#else
+#define UTIL_LOAD(p)     (*(p))
+#define UTIL_STORE(p, v) (*(p) = (v))
+#define UTIL_INC(p)      (++*(p))
+#endif
 
 /* All public symbols start with "mish",
  * private names will omit this. */
@@ -65,24 +88,35 @@ char* mish_util_error_str(mish_error_code code) {
     return "mish_error_bad_memory_config";
   case mish_error_cmd_failure:
     return "mish_error_cmd_failure";
+  case mish_error_no_prepared_slot:
+    return "mish_error_no_prepared_slot";
+  case mish_error_unregistered_cmd:
+    return "mish_error_unregistered_cmd";
+  case mish_error_snapshot_too_small:
+    return "mish_error_snapshot_too_small";
+  case mish_error_bad_snapshot:
+    return "mish_error_bad_snapshot";
+  case mish_error_missing_arg:
+    return "mish_error_missing_arg";
+  case mish_error_bad_arg_type:
+    return "mish_error_bad_arg_type";
+  case mish_error_unexpected_arg:
+    return "mish_error_unexpected_arg";
   default:
     return "unknown_mish_error";
   }
 }
 
-/* appends b to the end of a, returns a
- */
-mish_arg_list* util_append_list(mish_arg_list* a, mish_arg_list* b) {
-  mish_arg_list* curr;
-  if (a == NULL) {
-    return b;
+/* largest power of two that is not greater than n, 0 if n is 0 */
+size_t util_pow2_floor(size_t n) {
+  size_t out = 1;
+  if (n == 0) {
+    return 0;
   }
-  curr = a;
-  while (curr->next != NULL) {
-    curr = curr->next;
+  while (out <= n/2) {
+    out *= 2;
   }
-  curr->next = b;
-  return a;
+  return out;
 }
 
 /* END: UTIL NAMESPACE */
@@ -169,71 +203,513 @@ bool mish_atom_is_str(mish_atom a) {
 }
 /* END: ATOM NAMESPACE */
 
-/* BEGIN: SNPRINT NAMESPACE */
-size_t mish_snprint_atom(char* buffer, size_t size, mish_atom a) {
-  size_t offset = 0;
-  if (buffer == NULL) {
+/* BEGIN: BIG NAMESPACE */
+/* Small unsigned big integers of fixed size, enough for the exact
+ * decimal expansion of any double and for the exact fallback of
+ * the number parser. Limbs are little endian.
+ */
+#define BIG_LIMBS 40 /* 1280 bits */
+
+typedef struct {
+  uint32_t limbs[BIG_LIMBS];
+  size_t size; /* limbs in use, the top one is never 0 */
+} big;
+
+void big_trim(big* b) {
+  while (b->size > 0 && b->limbs[b->size - 1] == 0) {
+    b->size--;
+  }
+}
+
+void big_set_u64(big* b, uint64_t v) {
+  b->limbs[0] = (uint32_t)v;
+  b->limbs[1] = (uint32_t)(v >> 32);
+  b->size = 2;
+  big_trim(b);
+}
+
+bool big_is_zero(big* b) {
+  return b->size == 0;
+}
+
+/* results that don't fit in BIG_LIMBS are truncated */
+void big_mul_small(big* b, uint32_t m) {
+  uint64_t carry = 0;
+  size_t i;
+  for (i = 0; i < b->size; i++) {
+    carry += (uint64_t)b->limbs[i] * m;
+    b->limbs[i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+  if (carry != 0 && b->size < BIG_LIMBS) {
+    b->limbs[b->size++] = (uint32_t)carry;
+  }
+}
+
+void big_add_small(big* b, uint32_t a) {
+  uint64_t carry = a;
+  size_t i;
+  for (i = 0; i < b->size && carry != 0; i++) {
+    carry += b->limbs[i];
+    b->limbs[i] = (uint32_t)carry;
+    carry >>= 32;
+  }
+  if (carry != 0 && b->size < BIG_LIMBS) {
+    b->limbs[b->size++] = (uint32_t)carry;
+  }
+}
+
+void big_shl(big* b, size_t bits) {
+  size_t words = bits / 32;
+  size_t shift = bits % 32;
+  size_t i;
+
+  if (b->size == 0) {
+    return;
+  }
+  if (b->size + words + 1 > BIG_LIMBS) {
+    words = BIG_LIMBS - b->size - 1;
+  }
+  b->limbs[b->size + words] = 0;
+  for (i = b->size; i-- > 0;) {
+    if (shift != 0) {
+      b->limbs[i + words + 1] |= b->limbs[i] >> (32 - shift);
+    }
+    b->limbs[i + words] = b->limbs[i] << shift;
+  }
+  for (i = 0; i < words; i++) {
+    b->limbs[i] = 0;
+  }
+  b->size += words + 1;
+  big_trim(b);
+}
+
+bool big_bit(big* b, size_t i) {
+  if (i / 32 >= b->size) {
+    return false;
+  }
+  return (b->limbs[i / 32] >> (i % 32)) & 1;
+}
+
+/* true if any of the bits below i is set */
+bool big_any_below(big* b, size_t i) {
+  size_t w;
+  for (w = 0; w < b->size && w < i / 32; w++) {
+    if (b->limbs[w] != 0) {
+      return true;
+    }
+  }
+  if (w < b->size && i % 32 != 0) {
+    return (b->limbs[w] & ((1u << (i % 32)) - 1)) != 0;
+  }
+  return false;
+}
+
+/* shifts right, dropping the bits shifted out */
+void big_shr(big* b, size_t bits) {
+  size_t words = bits / 32;
+  size_t shift = bits % 32;
+  size_t i;
+
+  if (words >= b->size) {
+    b->size = 0;
+    return;
+  }
+  for (i = 0; i + words < b->size; i++) {
+    b->limbs[i] = b->limbs[i + words] >> shift;
+    if (shift != 0 && i + words + 1 < b->size) {
+      b->limbs[i] |= b->limbs[i + words + 1] << (32 - shift);
+    }
+  }
+  b->size -= words;
+  big_trim(b);
+}
+
+/* shifts right rounding to nearest, ties to even */
+void big_shr_round(big* b, size_t bits) {
+  bool half, sticky;
+
+  if (bits == 0) {
+    return;
+  }
+  half = big_bit(b, bits - 1);
+  sticky = big_any_below(b, bits - 1);
+  big_shr(b, bits);
+
+  if (half && (sticky || (b->size > 0 && (b->limbs[0] & 1)))) {
+    big_add_small(b, 1);
+  }
+}
+
+size_t big_bitlen(big* b) {
+  uint32_t top;
+  size_t len;
+  if (b->size == 0) {
     return 0;
   }
+  top = b->limbs[b->size - 1];
+  len = (b->size - 1) * 32;
+  while (top != 0) {
+    len++;
+    top >>= 1;
+  }
+  return len;
+}
+
+int big_cmp(big* a, big* b) {
+  size_t i;
+  if (a->size != b->size) {
+    return a->size < b->size ? -1 : 1;
+  }
+  for (i = a->size; i-- > 0;) {
+    if (a->limbs[i] != b->limbs[i]) {
+      return a->limbs[i] < b->limbs[i] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+/* a -= b, a must not be smaller than b */
+void big_sub(big* a, big* b) {
+  int64_t borrow = 0;
+  size_t i;
+  for (i = 0; i < a->size; i++) {
+    borrow += (int64_t)a->limbs[i] - (i < b->size ? b->limbs[i] : 0);
+    a->limbs[i] = (uint32_t)borrow;
+    borrow = borrow < 0 ? -1 : 0;
+  }
+  big_trim(a);
+}
+
+/* the low 64 bits */
+uint64_t big_to_u64(big* b) {
+  uint64_t out = b->size > 0 ? b->limbs[0] : 0;
+  if (b->size > 1) {
+    out |= (uint64_t)b->limbs[1] << 32;
+  }
+  return out;
+}
+
+void big_mul_pow10(big* b, size_t n) {
+  while (n >= 9) {
+    big_mul_small(b, 1000000000);
+    n -= 9;
+  }
+  while (n-- > 0) {
+    big_mul_small(b, 10);
+  }
+}
+
+void big_pow10(big* b, size_t n) {
+  big_set_u64(b, 1);
+  big_mul_pow10(b, n);
+}
+
+/* divides in place, returns the remainder */
+uint32_t big_divmod_small(big* b, uint32_t d) {
+  uint64_t rem = 0;
+  size_t i;
+  for (i = b->size; i-- > 0;) {
+    rem = (rem << 32) | b->limbs[i];
+    b->limbs[i] = (uint32_t)(rem / d);
+    rem %= d;
+  }
+  big_trim(b);
+  return (uint32_t)rem;
+}
+/* END: BIG NAMESPACE */
+
+/* BEGIN: FMT NAMESPACE */
+/* A small formatter, so that printing atoms doesn't need printf.
+ * Output goes through a put function, which lets the same code
+ * fill a fixed buffer (mish_snprint_*) or the out buffer of the shell.
+ * put returns the amount of bytes it took.
+ */
+typedef size_t (*fmt_put)(void* ctx, const char* data, size_t size);
+
+/* enough for 64 binary digits */
+#define FMT_INT_SIZE 64
+/* the longest "%f" of a double: sign, 309 integer digits, '.', 6 digits */
+#define FMT_DOUBLE_SIZE 317
+
+/* writes v in the given base (2 to 16), returns the length */
+size_t fmt_u64(char* out, uint64_t v, unsigned base) {
+  static const char digits[] = "0123456789abcdef";
+  char tmp[FMT_INT_SIZE];
+  size_t len = 0;
+  size_t i;
+
+  do {
+    tmp[len++] = digits[v % base];
+    v /= base;
+  } while (v != 0);
+  for (i = 0; i < len; i++) {
+    out[i] = tmp[len - 1 - i];
+  }
+  return len;
+}
+
+size_t fmt_i64(char* out, int64_t v) {
+  if (v < 0) {
+    out[0] = '-';
+    /* negating in unsigned also works for INT64_MIN */
+    return 1 + fmt_u64(out + 1, 0 - (uint64_t)v, 10);
+  }
+  return fmt_u64(out, (uint64_t)v, 10);
+}
+
+/* stages the digits of a double so a few puts cover the whole number,
+ * left counts the digits still to come, the '.' goes before the last 6
+ */
+typedef struct {
+  fmt_put put;
+  void* ctx;
+  char buffer[32];
+  size_t length;
+  size_t left;
+  size_t total;
+} fmt_digits;
+
+void fmt_digits_flush(fmt_digits* d) {
+  d->total += d->put(d->ctx, d->buffer, d->length);
+  d->length = 0;
+}
+
+void fmt_digits_add(fmt_digits* d, const char* digits, size_t n) {
+  size_t k;
+  while (n > 0) {
+    if (d->length + n + 1 > sizeof(d->buffer)) {
+      fmt_digits_flush(d);
+    }
+    if (d->left == 6) {
+      d->buffer[d->length++] = '.';
+    }
+    /* up to the '.' or the end */
+    k = d->left > 6 && d->left - 6 < n ? d->left - 6 : n;
+    memcpy(d->buffer + d->length, digits, k);
+    d->length += k;
+    d->left -= k;
+    digits += k;
+    n -= k;
+  }
+}
+
+size_t fmt_double(fmt_put put, void* ctx, double v) {
+  uint64_t bits, mantissa;
+  int exponent;
+  big n;
+  uint32_t chunk;
+  char digits[12];
+  fmt_digits d;
+  size_t num_chunks = 0;
+  size_t num_digits = 0;
+  size_t len, i;
+
+  d.put = put;
+  d.ctx = ctx;
+  d.length = 0;
+  d.total = 0;
+  memcpy(&bits, &v, sizeof(double));
+  if (bits >> 63) {
+    d.buffer[d.length++] = '-';
+  }
+  exponent = (int)((bits >> 52) & 0x7FF);
+  mantissa = bits & ((UINT64_C(1) << 52) - 1);
+  if (exponent == 0x7FF) {
+    memcpy(d.buffer + d.length, mantissa != 0 ? "nan" : "inf", 3);
+    d.length += 3;
+    fmt_digits_flush(&d);
+    return d.total;
+  }
+  if (exponent == 0) {
+    exponent = -1074;
+  } else {
+    mantissa |= UINT64_C(1) << 52;
+    exponent -= 1075;
+  }
+
+  big_set_u64(&n, mantissa);
+  big_mul_small(&n, 1000000);
+  if (exponent >= 0) {
+    big_shl(&n, (size_t)exponent);
+  } else {
+    big_shr_round(&n, (size_t)-exponent);
+  }
+
+  while (big_is_zero(&n) == false) {
+    chunk = big_divmod_small(&n, 1000000000);
+    /* n shrinks by almost a limb per chunk, so the chunks fit in its top
+     * limbs: at most 36 are ever in use for DBL_MAX
+     */
+    n.limbs[BIG_LIMBS - 1 - num_chunks++] = chunk;
+  }
+  if (num_chunks > 0) {
+    len = fmt_u64(digits, n.limbs[BIG_LIMBS - num_chunks], 10);
+    num_digits = 9 * (num_chunks - 1) + len;
+  }
+
+  /* at least one integer digit */
+  d.left = num_digits < 7 ? 7 : num_digits;
+  if (d.left > num_digits) {
+    fmt_digits_add(&d, "0000000", d.left - num_digits);
+  }
+  for (i = num_chunks; i-- > 0;) {
+    if (i + 1 == num_chunks) {
+      fmt_digits_add(&d, digits, len);
+    } else {
+      /* the leading 1 keeps the zeros */
+      fmt_u64(digits, n.limbs[BIG_LIMBS - 1 - i] + UINT64_C(1000000000), 10);
+      fmt_digits_add(&d, digits + 1, 9);
+    }
+  }
+  fmt_digits_flush(&d);
+  return d.total;
+}
+
+/* quotes s, escaping what the lexer would take as the end of
+ * the string, so the output can be parsed back
+ */
+size_t fmt_str_quoted(fmt_put put, void* ctx, mish_str s) {
+  size_t total = put(ctx, "\"", 1);
+  size_t start = 0;
+  size_t i;
+  char esc[2];
+
+  esc[0] = '\\';
+  for (i = 0; i < s.length; i++) {
+    switch (s.buffer[i]) {
+      case '"':  esc[1] = '"';  break;
+      case '\\': esc[1] = '\\'; break;
+      case '\n': esc[1] = 'n';  break;
+      case '\r': esc[1] = 'r';  break;
+      case '\t': esc[1] = 't';  break;
+      default:
+        continue;
+    }
+    total += put(ctx, s.buffer + start, i - start);
+    total += put(ctx, esc, 2);
+    start = i + 1;
+  }
+  total += put(ctx, s.buffer + start, s.length - start);
+  return total + put(ctx, "\"", 1);
+}
+
+size_t fmt_atom(fmt_put put, void* ctx, mish_atom a) {
+  char num[FMT_INT_SIZE + 2];
+  size_t len;
+
   switch (a.kind) {
     case mish_atk_string:
-      offset = snprintf(buffer, size, "\"%.*s\"",
-                        (int)a.contents.string.length,
-                        a.contents.string.buffer);
-      break;
+      return fmt_str_quoted(put, ctx, a.contents.string);
     case mish_atk_exact_num:
-      offset = snprintf(buffer, size, "%ld", (long int)a.contents.exact_num);
-      break;
+      len = fmt_i64(num, (int64_t)a.contents.exact_num);
+      return put(ctx, num, len);
     case mish_atk_inexact_num:
-      offset = snprintf(buffer, size, "%f", a.contents.inexact_num);
-      break;
+      return fmt_double(put, ctx, a.contents.inexact_num);
     case mish_atk_command:
-      offset = snprintf(buffer, size, "<%lu>", (unsigned long int)a.contents.cmd);
-      break;
+      num[0] = '<';
+      len = 1 + fmt_u64(num + 1, (uint64_t)(uintptr_t)a.contents.cmd, 10);
+      num[len++] = '>';
+      return put(ctx, num, len);
     default:
       /* should be unreachable */
-      offset = snprintf(buffer, size, "Unknown atom kind (%d)", (int)a.kind);
-      break;
+      return put(ctx, "Unknown atom kind", 17);
   }
-  return offset;
 }
 
-size_t mish_snprint_pair(char* buffer, size_t size, mish_pair p) {
-  size_t offset = 0;
-  offset += mish_snprint_atom(buffer+offset, size-offset, p.key);
-  offset += snprintf(buffer+offset, size-offset, ":");
-  offset += mish_snprint_atom(buffer+offset, size-offset, p.value);
-  return offset;
+size_t fmt_pair(fmt_put put, void* ctx, mish_pair p) {
+  size_t len = fmt_atom(put, ctx, p.key);
+  len += put(ctx, ":", 1);
+  return len + fmt_atom(put, ctx, p.value);
 }
 
-size_t mish_snprint_arg(char* buffer, size_t size, mish_argument a) {
+size_t fmt_arg(fmt_put put, void* ctx, mish_argument a) {
   switch (a.kind) {
   case mish_ark_pair:
-    return mish_snprint_pair(buffer, size, a.contents.pair);
+    return fmt_pair(put, ctx, a.contents.pair);
   case mish_ark_atom:
-    return mish_snprint_atom(buffer, size, a.contents.atom);
+    return fmt_atom(put, ctx, a.contents.atom);
   }
   return 0;
 }
 
+/* fills a buffer like snprintf: the output is truncated and
+ * null-terminated, but the full length is counted
+ */
+typedef struct {
+  char* buffer;
+  size_t size;
+  size_t length;
+} fmt_buffer;
+
+size_t fmt_buffer_put(void* ctx, const char* data, size_t size) {
+  fmt_buffer* b = (fmt_buffer*)ctx;
+  size_t n = 0;
+  if (b->length + 1 < b->size) {
+    n = b->size - 1 - b->length;
+    if (n > size) {
+      n = size;
+    }
+    memcpy(b->buffer + b->length, data, n);
+  }
+  b->length += size;
+  return size;
+}
+
+fmt_buffer fmt_buffer_new(char* buffer, size_t size) {
+  fmt_buffer b;
+  b.buffer = buffer;
+  b.size = size;
+  b.length = 0;
+  return b;
+}
+
+size_t fmt_buffer_end(fmt_buffer* b) {
+  if (b->size > 0) {
+    b->buffer[b->length < b->size ? b->length : b->size - 1] = '\0';
+  }
+  return b->length;
+}
+/* END: FMT NAMESPACE */
+
+/* BEGIN: SNPRINT NAMESPACE */
+size_t mish_snprint_atom(char* buffer, size_t size, mish_atom a) {
+  fmt_buffer b;
+  if (buffer == NULL) {
+    return 0;
+  }
+  b = fmt_buffer_new(buffer, size);
+  fmt_atom(fmt_buffer_put, &b, a);
+  return fmt_buffer_end(&b);
+}
+
+size_t mish_snprint_pair(char* buffer, size_t size, mish_pair p) {
+  fmt_buffer b = fmt_buffer_new(buffer, size);
+  fmt_pair(fmt_buffer_put, &b, p);
+  return fmt_buffer_end(&b);
+}
+
+size_t mish_snprint_arg(char* buffer, size_t size, mish_argument a) {
+  fmt_buffer b = fmt_buffer_new(buffer, size);
+  fmt_arg(fmt_buffer_put, &b, a);
+  return fmt_buffer_end(&b);
+}
+
 size_t mish_snprint_arg_list(char* buffer, size_t size, mish_arg_list* list) {
-  size_t offset = 0;
-  mish_arg_list* curr;
+  fmt_buffer b = fmt_buffer_new(buffer, size);
+  size_t i;
   if (list == NULL) {
-    return snprintf(buffer, size, "NULL");
+    fmt_buffer_put(&b, "NULL", 4);
+    return fmt_buffer_end(&b);
   }
 
-  curr = list;
-  while (curr != NULL) {
-    mish_argument arg = curr->arg;
-    offset += mish_snprint_arg(buffer+offset, size-offset, arg);
-
-    if (curr->next != NULL) {
-      offset += snprintf(buffer+offset, size-offset, ", ");
+  for (i = 0; i < list->argc; i++) {
+    fmt_arg(fmt_buffer_put, &b, list->argv[i]);
+    if (i + 1 < list->argc) {
+      fmt_buffer_put(&b, ", ", 2);
     }
-    curr = curr->next;
   }
-  return offset;
+  return fmt_buffer_end(&b);
 }
 /* END: SNPRINT NAMESPACE */
 
@@ -251,6 +727,8 @@ mish_arena* arena_new(uint8_t* buffer, size_t size, arena_RES* res);
 
 /* returns NULL if it fails to allocate */
 void* arena_alloc(mish_arena* a, size_t size);
+void* arena_alloc_top(mish_arena* a, size_t size);
+void arena_note_peak(mish_arena* a);
 
 /* frees the entire arena */
 void arena_free_all(mish_arena* a);
@@ -267,6 +745,9 @@ bool arena_empty(mish_arena* a);
 /* returns the head of the arena */
 void* arena_head(mish_arena* a);
 
+/* returns true if p points into the buffer of the arena */
+bool arena_owns(mish_arena* a, const void* p);
+
 mish_error_code arena_map_res(arena_RES res) {
   switch(res){
     case arena_OK:
@@ -306,7 +787,11 @@ mish_arena* arena_new(uint8_t* buffer, size_t size, arena_RES* res) {
   out = (mish_arena*)buffer;
   out->buffer = buffer + sizeof(mish_arena);
   out->buffsize = size - sizeof(mish_arena);
+  /* so that what is allocated from the top is aligned as well */
+  out->buffsize -= out->buffsize & (sizeof(void*) - 1);
   out->allocated = 0;
+  out->top = 0;
+  out->peak = 0;
   *res = arena_OK;
 
   return out;
@@ -317,6 +802,13 @@ void* arena_head(mish_arena* a) {
   return (void*)(a->buffer + a->allocated);
 }
 
+/* for code that sets allocated by itself */
+void arena_note_peak(mish_arena* a) {
+  if (a->allocated + a->top > a->peak) {
+    a->peak = a->allocated + a->top;
+  }
+}
+
 void* arena_alloc(mish_arena* a, size_t size) {
   void* out;
 
@@ -328,18 +820,37 @@ void* arena_alloc(mish_arena* a, size_t size) {
    */
   size += util_compute_padding(size);
   
-  if (a->allocated+size >= a->buffsize) {
+  if (a->allocated+a->top+size >= a->buffsize) {
     return NULL;
   }
 
   out = arena_head(a);
   a->allocated += size;
+  arena_note_peak(a);
   return out;
 }
 
+/* Allocates from the end of the buffer downwards,
+ * so what is allocated from the head stays contiguous
+ * (ie: the arguments of a command, while their strings go here).
+ */
+void* arena_alloc_top(mish_arena* a, size_t size) {
+  if (a == NULL || size == 0) return NULL;
+
+  size += util_compute_padding(size);
+  if (a->allocated+a->top+size >= a->buffsize) {
+    return NULL;
+  }
+
+  a->top += size;
+  arena_note_peak(a);
+  return (void*)(a->buffer + a->buffsize - a->top);
+}
+
 void arena_free_all(mish_arena* a) {
   if (a == NULL) return;
   a->allocated = 0;
+  a->top = 0;
   /* If you need to uncomment this line because of a bug,
    * you're doing something wrong.
    * However, if sensitive data is being transmitted through the
@@ -350,17 +861,22 @@ void arena_free_all(mish_arena* a) {
 
 size_t arena_available(mish_arena* a) {
   if (a == NULL) return 0;
-  return a->buffsize - a->allocated;
+  return a->buffsize - a->allocated - a->top;
 }
 
 size_t arena_used(mish_arena* a) {
   if (a == NULL) return 0;
-  return a->allocated;
+  return a->allocated + a->top;
 }
 
 bool arena_empty(mish_arena* a) {
   if (a == NULL) return true;
-  return a->allocated == 0;
+  return a->allocated == 0 && a->top == 0;
+}
+
+bool arena_owns(mish_arena* a, const void* p) {
+  if (a == NULL) return false;
+  return (const uint8_t*)p >= a->buffer && (const uint8_t*)p < a->buffer + a->buffsize;
 }
 /* END: ARENA ALLOCATOR*/
 
@@ -372,12 +888,18 @@ typedef int32_t utf8_rune;
 
 #define utf8_EoF (utf8_rune)0
 
-/* Assumes valid UTF-8 input and does not handle:
- *   Overlong encodings
- *   Surrogate pairs
- *   Code points beyond U+10FFFF
+/* test builds may define this before including mish.c
+ * to count how many times runes are decoded
+ */
+#ifndef UTF8_DECODE_HOOK
+#define UTF8_DECODE_HOOK()
+#endif
+
+/* Rejects overlong encodings, surrogates
+ * and code points beyond U+10FFFF.
  */
 size_t utf8_decode(const char* buffer, size_t buff_size, utf8_rune* r) {
+  UTF8_DECODE_HOOK();
   if (buff_size > 0 && (buffer[0] & TOP_BITS(1)) == 0) { /* ASCII */
     *r = (utf8_rune)buffer[0];
     return 1;
@@ -391,6 +913,10 @@ size_t utf8_decode(const char* buffer, size_t buff_size, utf8_rune* r) {
     }
     *r = (utf8_rune)(buffer[0] & LOW_BITS(5)) << 6 |
          (utf8_rune)(buffer[1] & LOW_BITS(6));
+    if (*r < 0x80) { /* overlong */
+      *r = -1;
+      return 0;
+    }
     return 2;
   }
 
@@ -404,6 +930,10 @@ size_t utf8_decode(const char* buffer, size_t buff_size, utf8_rune* r) {
     *r = (utf8_rune)(buffer[0] & LOW_BITS(4)) << 12 |
          (utf8_rune)(buffer[1] & LOW_BITS(6)) << 6 |
          (utf8_rune)(buffer[2] & LOW_BITS(6));
+    if (*r < 0x800 || (*r >= 0xD800 && *r <= 0xDFFF)) { /* overlong or surrogate */
+      *r = -1;
+      return 0;
+    }
     return 3;
   }
 
@@ -419,6 +949,10 @@ size_t utf8_decode(const char* buffer, size_t buff_size, utf8_rune* r) {
          (utf8_rune)(buffer[1] & LOW_BITS(6)) << 12 |
          (utf8_rune)(buffer[2] & LOW_BITS(6)) << 6 |
          (utf8_rune)(buffer[3] & LOW_BITS(6));
+    if (*r < 0x10000 || *r > 0x10FFFF) { /* overlong or out of range */
+      *r = -1;
+      return 0;
+    }
     return 4;
   }
 
@@ -426,58 +960,213 @@ size_t utf8_decode(const char* buffer, size_t buff_size, utf8_rune* r) {
   *r = -1;
   return 0;
 }
+
+/* the size of the rune that starts with lead, 0 if no rune does */
+size_t utf8_lead_size(char lead) {
+  if ((lead & TOP_BITS(1)) == 0) {
+    return 1;
+  }
+  if ((lead & TOP_BITS(3)) == TOP_BITS(2)) {
+    return 2;
+  }
+  if ((lead & TOP_BITS(4)) == TOP_BITS(3)) {
+    return 3;
+  }
+  if ((lead & TOP_BITS(5)) == TOP_BITS(4)) {
+    return 4;
+  }
+  return 0;
+}
+
+#define UTF8_WORD_HIGHS (((size_t)-1 / 0xFF) * 0x80)
+
+/* Validates the whole buffer, most input is ASCII so we
+ * skip 16 (SSE2) or sizeof(size_t) bytes at a time while
+ * no byte has the high bit set, and only decode the rest.
+ * On failure, the range of the bad sequence is stored in bad.
+ */
+bool utf8_validate(const char* buffer, size_t buff_size, mish_range* bad) {
+  const uint8_t* input = (const uint8_t*)buffer;
+  size_t pos = 0;
+  size_t word;
+  size_t size;
+  utf8_rune r;
+
+  while (pos < buff_size) {
+#if UTIL_USE_SSE2
+    while (pos + 16 <= buff_size &&
+           _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(input + pos))) == 0) {
+      pos += 16;
+    }
+#endif
+    while (pos + sizeof(size_t) <= buff_size) {
+      memcpy(&word, input + pos, sizeof(size_t));
+      if ((word & UTF8_WORD_HIGHS) != 0) {
+        break;
+      }
+      pos += sizeof(size_t);
+    }
+    while (pos < buff_size && input[pos] < 0x80) {
+      pos++;
+    }
+    if (pos >= buff_size) {
+      break;
+    }
+
+    size = utf8_decode(buffer + pos, buff_size - pos, &r);
+    if (size == 0) {
+      bad->begin = pos;
+      bad->end = pos + 1;
+      return false;
+    }
+    pos += size;
+  }
+  return true;
+}
 /* END: UTF8 NAMESPACE */
 
 /* BEGIN: MAP NAMESPACE */
-/* implements a simple hashmap on top of a linked list
- * and a linear allocator. Because of the allocation strategy
- * used, "update" and "remove" procedures do not exist.
- * Just like the linear(arena) allocator, things can only
- * be removed from the map all at once.
+/* implements a simple hashmap on top of an open addressing table
+ * (linear probing) and a linear allocator. Because of the allocation strategy
+ * used, entries are never changed in place: map_set appends the new pair
+ * and marks the entry it replaces dead, and map_compact slides the live
+ * entries down to reclaim the dead ones. Otherwise, just like the
+ * linear(arena) allocator, things are removed from the map all at once.
  * I'd call this a "linear map" just to piss off mathematicians,
  * but it's better to call it a "linear hashmap".
  */
-uint32_t map_murmur_hash(char* buff, size_t size) {
-  uint32_t out = 0xCAFEBABE;
+/* MurmurHash3 (x86, 32 bits), it reads 4 bytes at a time
+ * and only needs 32 bit multiplications, which is cheap on small cores.
+ * The seed is per map, so that keys can't be picked to collide
+ * when the shell is exposed to the network.
+ */
+#define MAP_ROTL32(x, r) (((x) << (r)) | ((x) >> (32 - (r))))
+
+uint32_t map_mix_block(uint32_t h, uint32_t k) {
+  k *= 0xcc9e2d51;
+  k = MAP_ROTL32(k, 15);
+  k *= 0x1b873593;
+  h ^= k;
+  h = MAP_ROTL32(h, 13);
+  return h * 5 + 0xe6546b64;
+}
+
+uint32_t map_finalize(uint32_t h, size_t size) {
+  h ^= (uint32_t)size;
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+uint32_t map_murmur_hash(const char* buff, size_t size, uint32_t seed) {
+  const uint8_t* bytes = (const uint8_t*)buff;
+  uint32_t h = seed;
+  uint32_t k;
   size_t i;
-  for (i = 0; i < size; i++) {
-    out = out ^ (uint32_t)buff[i] * 0x5bd1e995;
-    out = out ^ (out >> 15);
+  size_t blocks = size / 4;
+
+  for (i = 0; i < blocks; i++) {
+    memcpy(&k, bytes + i*4, 4);
+    h = map_mix_block(h, k);
   }
-  return out;
+
+  k = 0;
+  bytes += blocks*4;
+  switch (size & 3) {
+    case 3:
+      k ^= (uint32_t)bytes[2] << 16;
+      /* fall through */
+    case 2:
+      k ^= (uint32_t)bytes[1] << 8;
+      /* fall through */
+    case 1:
+      k ^= (uint32_t)bytes[0];
+      k *= 0xcc9e2d51;
+      k = MAP_ROTL32(k, 15);
+      k *= 0x1b873593;
+      h ^= k;
+      break;
+    default:
+      break;
+  }
+  return map_finalize(h, size);
+}
+
+/* hashes num as two blocks, low half first, without going through
+ * memory. on little-endian hosts this matches hashing its 8 bytes,
+ * big-endian ones differ, which is fine since hashes never leave a host
+ */
+uint32_t map_hash_u64(uint64_t num, uint32_t seed) {
+  uint32_t h = seed;
+  h = map_mix_block(h, (uint32_t)num);
+  h = map_mix_block(h, (uint32_t)(num >> 32));
+  return map_finalize(h, 8);
 }
 
-uint32_t map_hash_str(mish_str s) {
-  return map_murmur_hash(s.buffer, s.length);
+uint32_t map_hash_str(mish_str s, uint32_t seed) {
+  return map_murmur_hash(s.buffer, s.length, seed);
 }
 
-uint32_t map_hash_exact(uint64_t num) {
-  return (uint32_t)(num % UINT_MAX);
+uint32_t map_hash_exact(uint64_t num, uint32_t seed) {
+  return map_hash_u64(num, seed);
 }
 
-uint32_t map_hash_inexact(double num) {
-  return map_murmur_hash((char*)&num, sizeof(double));
+uint32_t map_hash_inexact(double num, uint32_t seed) {
+  uint64_t bits;
+  if (num == 0) {
+    num = 0; /* -0.0 == 0.0, so they must hash the same */
+  }
+  memcpy(&bits, &num, sizeof(double));
+  return map_hash_u64(bits, seed);
 }
 
-uint32_t map_hash_cmd(mish_command cmd) {
-  return (uint32_t)((uintptr_t)cmd % UINT_MAX);
+uint32_t map_hash_cmd(mish_command cmd, uint32_t seed) {
+  return map_hash_u64((uint64_t)(uintptr_t)cmd, seed);
 }
 
-uint32_t map_hash(mish_atom a) {
+uint32_t map_hash(mish_map* m, mish_atom a) {
   switch (a.kind) {
   case mish_atk_string:
-    return map_hash_str(a.contents.string);
+    return map_hash_str(a.contents.string, m->seed);
   case mish_atk_exact_num:
-    return map_hash_exact(a.contents.exact_num);
+    return map_hash_exact(a.contents.exact_num, m->seed);
   case mish_atk_inexact_num:
-    return map_hash_inexact(a.contents.inexact_num);
+    return map_hash_inexact(a.contents.inexact_num, m->seed);
   case mish_atk_command:
-    return map_hash_cmd(a.contents.cmd);
+    return map_hash_cmd(a.contents.cmd, m->seed);
   default:
     return 0;
   }
 }
 
+/* second level of the static command table, spreads
+ * the keys of a bucket with its displacement.
+ * size is a power of two
+ */
+uint32_t map_static_slot(uint32_t hash, uint32_t disp, uint32_t size) {
+  return map_finalize(hash ^ disp, 0) & (size - 1);
+}
+
+/* one string hash and one compare, returns NULL if name is not in the table */
+const mish_named_cmd* map_static_find(const mish_static_table* t, mish_str name) {
+  uint32_t hash;
+  const mish_named_cmd* c;
+
+  if (t == NULL || t->size == 0) {
+    return NULL;
+  }
+  hash = map_murmur_hash(name.buffer, name.length, t->seed);
+  c = &t->cmds[map_static_slot(hash, t->disps[hash & (t->num_buckets - 1)], t->size)];
+  if (c->cmd == NULL || c->name.length != name.length ||
+      memcmp(c->name.buffer, name.buffer, name.length) != 0) {
+    return NULL;
+  }
+  return c;
+}
+
 /* we need to copy the string to the internal buffer 
  * so it can live beyond the lifetime of command execution
  */
@@ -512,85 +1201,264 @@ bool map_copy_atom(mish_map* m, mish_atom* dest, mish_atom* source) {
 }
 
 
-/*
- * Inserts a key-value pair into the map.
- * 
- * If the key already exists, insertion is aborted (no update is allowed).
- * This implementation uses a linked list for collision resolution
- *
- * Modifying anything in the environment means lifetimes are not linear
- * ie: replacing a string would not clear the space occupied by
- * the previous one, this is impossible since we only use arena allocators.
- * For this reason, we disallow updates.
+/* a few slots are always left empty so that probing stays short
+ * and failed lookups are guaranteed to hit an empty slot
  */
-bool map_insert(mish_map* m, mish_atom key, mish_atom value) {
-  int index = map_hash(key) % m->num_buckets;
-  mish_atom_list* list = &(m->buckets[index]);
-  mish_list_node* n = list->head;
-  while (n != NULL) {
-    if (mish_atom_equals(key, n->key)) {
-      return false; 
+size_t map_max_count(mish_map* m) {
+  return m->capacity - m->capacity/8 - 1;
+}
+
+size_t map_entry_stride(void) {
+  return sizeof(mish_map_entry) + util_compute_padding(sizeof(mish_map_entry));
+}
+
+/* the entry a slot refers to, NULL for an empty slot */
+mish_map_entry* map_slot_entry(mish_map* m, mish_map_slot* slot) {
+  uint32_t index = UTIL_LOAD(&slot->entry);
+  if (index == 0) {
+    return NULL;
+  }
+  return (mish_map_entry*)(m->node_arena->buffer + (index - 1) * map_entry_stride());
+}
+
+uint32_t map_entry_index(mish_map* m, mish_map_entry* n) {
+  return (uint32_t)(((uint8_t*)n - m->node_arena->buffer) / map_entry_stride() + 1);
+}
+
+/* returns the slot holding key, or the empty slot where it would go */
+mish_map_slot* map_probe(mish_map* m, mish_atom key, uint32_t hash) {
+  size_t mask = m->capacity - 1;
+  size_t index = hash & mask;
+  mish_map_slot* slot = &m->slots[index];
+  mish_map_entry* entry;
+  /* the hash is written before the entry is published */
+  while ((entry = map_slot_entry(m, slot)) != NULL) {
+    if (slot->hash == hash && mish_atom_equals(key, entry->key)) {
+      return slot;
     }
-    n = n->next;
+    index = (index + 1) & mask;
+    slot = &m->slots[index];
+  }
+  return slot;
+}
+
+size_t map_atom_size(mish_atom* a) {
+  size_t length;
+  if (a->kind != mish_atk_string) {
+    return 0;
   }
+  length = a->contents.string.length;
+  return length + util_compute_padding(length);
+}
+
+/* memory held by an entry in both arenas */
+size_t map_entry_size(mish_map_entry* n) {
+  return map_entry_stride() + map_atom_size(&n->key) + map_atom_size(&n->value);
+}
 
-  n = arena_alloc(m->node_arena, sizeof(mish_list_node));
+/* allocates an entry holding a copy of the pair,
+ * entries and their strings are allocated in the same order
+ * in both arenas, which is what compaction relies on
+ */
+mish_map_entry* map_new_entry(mish_map* m, mish_atom key, mish_atom value) {
+  mish_map_entry* n;
+  size_t node_mark, str_mark;
+
+  node_mark = m->node_arena->allocated;
+  str_mark = m->str_arena->allocated;
+  n = arena_alloc(m->node_arena, sizeof(mish_map_entry));
   if (n == NULL) {
-    return false;
+    return NULL;
   }
-  n->next = NULL;
   if (map_copy_atom(m, &(n->key), &key)     == false ||
       map_copy_atom(m, &(n->value), &value) == false) {
+    /* roll back, the node arena must only hold live entries */
+    m->node_arena->allocated = node_mark;
+    m->str_arena->allocated = str_mark;
+    return NULL;
+  }
+  n->dead = false;
+  return n;
+}
+
+/*
+ * Inserts a key-value pair into the map.
+ * 
+ * If the key already exists, insertion is aborted (no update is allowed).
+ * Use map_set to overwrite keys.
+ */
+bool map_insert(mish_map* m, mish_atom key, mish_atom value) {
+  uint32_t hash;
+  mish_map_slot* slot;
+  mish_map_entry* n;
+
+  if (m->capacity == 0) {
+    return false;
+  }
+  hash = map_hash(m, key);
+  slot = map_probe(m, key, hash);
+  if (slot->entry != 0 || m->count >= map_max_count(m)) {
     return false;
   }
 
-  if (list->head == NULL) {
-    list->head = n;
-    list->tail = n;
-    return true;
+  n = map_new_entry(m, key, value);
+  if (n == NULL) {
+    return false;
+  }
+
+  slot->hash = hash;
+  UTIL_STORE(&slot->entry, map_entry_index(m, n));
+  m->count++;
+  if (m->count > m->peak_count) {
+    m->peak_count = m->count;
+  }
+  return true;
+}
+
+/*
+ * Inserts or overwrites a key-value pair.
+ *
+ * Arenas can't free a single entry, so the new pair is appended
+ * and the old entry is marked dead, its memory is only
+ * reclaimed by map_compact.
+ */
+bool map_set(mish_map* m, mish_atom key, mish_atom value) {
+  uint32_t hash;
+  mish_map_slot* slot;
+  mish_map_entry* n;
+  mish_map_entry* old;
+
+  if (m->capacity == 0) {
+    return false;
+  }
+  hash = map_hash(m, key);
+  slot = map_probe(m, key, hash);
+  if (slot->entry == 0) {
+    return map_insert(m, key, value);
   }
 
-  list->tail->next = n;
-  list->tail = n;
+  n = map_new_entry(m, key, value);
+  if (n == NULL) {
+    return false;
+  }
+  /* lookups running now may still get the old entry */
+  old = map_slot_entry(m, slot);
+  old->dead = true;
+  m->dead_bytes += map_entry_size(old);
+  UTIL_STORE(&slot->entry, map_entry_index(m, n));
+  UTIL_INC(&m->generation);
   return true;
 }
 
 bool map_find(mish_map* m, mish_atom key, mish_atom* out) {
-  int index = map_hash(key) % m->num_buckets;
-  mish_atom_list list = m->buckets[index];
-  mish_list_node* n = list.head;
-  while (n != NULL) {
-    if (mish_atom_equals(key, n->key)) {
-      *out = n->value;
-      return true;
-    }
-    n = n->next;
+  mish_map_entry* entry;
+  if (m->capacity == 0) {
+    return false;
   }
-  return false;
+  entry = map_slot_entry(m, map_probe(m, key, map_hash(m, key)));
+  if (entry == NULL) {
+    return false;
+  }
+  *out = entry->value;
+  return true;
 }
 
+/* the generation changes whenever a key may now map
+ * to a different value, so cached lookups can be invalidated
+ */
 void map_clear(mish_map* m) {
-  size_t i;
-  mish_atom_list* item;
-  for (i = 0; i < m->num_buckets; i++) {
-    item = &(m->buckets[i]);
-    item->head = NULL;
-    item->tail = NULL;
-  }
+  UTIL_INC(&m->generation);
+  m->dead_bytes = 0;
+  memset(m->slots, 0, m->capacity * sizeof(mish_map_slot));
+  m->count = 0;
   arena_free_all(m->str_arena);
   arena_free_all(m->node_arena);
 }
 
-bool map_is_empty(mish_map* m) {
-  size_t i;
-  mish_atom_list item;
-  for (i = 0; i < m->num_buckets; i++) {
-    item = m->buckets[i];
-    if (item.head != NULL || item.tail != NULL) {
-      return false;
+/* every entry lives in the node arena, packed in insertion order,
+ * so the slots can be rebuilt without any extra memory
+ */
+void map_rehash(mish_map* m) {
+  size_t stride = map_entry_stride();
+  size_t offset;
+  mish_map_entry* n;
+  mish_map_slot* slot;
+  uint32_t hash;
+
+  memset(m->slots, 0, m->capacity * sizeof(mish_map_slot));
+  for (offset = 0; offset < m->node_arena->allocated; offset += stride) {
+    n = (mish_map_entry*)(m->node_arena->buffer + offset);
+    if (n->dead) {
+      continue;
+    }
+    hash = map_hash(m, n->key);
+    slot = map_probe(m, n->key, hash);
+    slot->hash = hash;
+    slot->entry = map_entry_index(m, n);
+  }
+}
+
+void map_set_seed(mish_map* m, uint32_t seed) {
+  m->seed = seed;
+  if (m->capacity != 0) {
+    map_rehash(m);
+  }
+}
+
+void map_move_str(uint8_t** dest, mish_atom* a) {
+  if (a->kind != mish_atk_string) {
+    return;
+  }
+  memmove(*dest, a->contents.string.buffer, a->contents.string.length);
+  a->contents.string.buffer = (char*)*dest;
+  *dest += map_atom_size(a);
+}
+
+/*
+ * Slides live entries and their strings to the start of their arenas,
+ * dropping dead entries, then rebuilds the slots.
+ * Both arenas are walked in allocation order so every move goes
+ * to a lower address and can be done in place.
+ *
+ * Atoms taken from the environment before this call are invalidated,
+ * the shell only compacts between lines.
+ *
+ * Returns the amount of memory reclaimed.
+ */
+size_t map_compact(mish_map* m) {
+  size_t stride = map_entry_stride();
+  size_t offset;
+  size_t before;
+  uint8_t* node_dest = m->node_arena->buffer;
+  uint8_t* str_dest = m->str_arena->buffer;
+  mish_map_entry* n;
+
+  if (m->dead_bytes == 0) {
+    return 0;
+  }
+  before = m->node_arena->allocated + m->str_arena->allocated;
+  for (offset = 0; offset < m->node_arena->allocated; offset += stride) {
+    n = (mish_map_entry*)(m->node_arena->buffer + offset);
+    if (n->dead) {
+      continue;
+    }
+    map_move_str(&str_dest, &n->key);
+    map_move_str(&str_dest, &n->value);
+    if ((uint8_t*)n != node_dest) {
+      memmove(node_dest, n, sizeof(mish_map_entry));
     }
+    node_dest += stride;
   }
-  return arena_empty(m->str_arena) &&
+  m->node_arena->allocated = (size_t)(node_dest - m->node_arena->buffer);
+  m->str_arena->allocated = (size_t)(str_dest - m->str_arena->buffer);
+  m->dead_bytes = 0;
+  map_rehash(m);
+  return before - m->node_arena->allocated - m->str_arena->allocated;
+}
+
+bool map_is_empty(mish_map* m) {
+  return m->count == 0 &&
+         arena_empty(m->str_arena) &&
          arena_empty(m->node_arena);
 }
 /* END: MAP NAMESPACE */
@@ -615,7 +1483,8 @@ typedef enum {
 typedef enum {
   lex_valkind_none,
   lex_valkind_exact_num,
-  lex_valkind_inexact_num
+  lex_valkind_inexact_num,
+  lex_valkind_escaped_str
 } lex_valkind;
 
 typedef union {
@@ -643,11 +1512,25 @@ char* lex_lexeme_str(const char* input, lex_lexeme l) {
   return (char*)(input + l.begin);
 }
 
+/* the rune at rune_pos is decoded only once,
+ * so peeking and then advancing costs a single decode
+ */
+#define LEX_NO_RUNE ((size_t)-1)
+
 typedef struct {
   const char* input;
   size_t input_size;
   lex_lexeme lexeme;
   mish_error err;
+
+  utf8_rune rune;
+  size_t rune_size;
+  size_t rune_pos;
+
+  /* set when the input already went through utf8_validate,
+   * then runes never need to be decoded and the lexer works on bytes
+   */
+  bool validated;
 } lex;
 
 lex lex_new(const char* input, size_t size) {
@@ -659,9 +1542,14 @@ lex lex_new(const char* input, size_t size) {
   l.lexeme.vkind = lex_valkind_none;
   l.lexeme.kind = lex_kind_bad;
   l.err.code = mish_error_none;
+  l.rune = utf8_EoF;
+  l.rune_size = 0;
+  l.rune_pos = LEX_NO_RUNE;
+  l.validated = false;
   return l;
 }
 
+#ifdef MISH_CFG_DEBUG
 void lex_print_lexeme(lex* l) {
   printf("{begin: %ld, end: %ld, kind: %d, text: \"%.*s\"}\n",
          (long int)l->lexeme.begin,
@@ -670,6 +1558,7 @@ void lex_print_lexeme(lex* l) {
          lex_lexeme_len(l->lexeme),
          lex_lexeme_str(l->input, l->lexeme));
 }
+#endif
 
 mish_error lex_base_err(lex* l) {
   mish_error err;
@@ -691,44 +1580,38 @@ mish_error lex_err_internal(lex* l) {
   return err;
 }
 
-utf8_rune lex_next_rune(lex* l) {
+utf8_rune lex_peek_rune(lex* l) {
   utf8_rune r;
   size_t size;
   const char* decode_start;
   size_t remaining_buffer;
-
   if (l->lexeme.end >= l->input_size) {
     return utf8_EoF;
   }
-  
+  if (l->rune_pos == l->lexeme.end) {
+    return l->rune;
+  }
+
   decode_start = l->input + l->lexeme.end;
   remaining_buffer = l->input_size - l->lexeme.end;
   size = utf8_decode(decode_start, remaining_buffer, &r);
+
   if (size == 0 || r == -1) {
     l->err = lex_err(l, mish_error_bad_rune);
     return -1;
   }
-  l->lexeme.end += size;
+  l->rune = r;
+  l->rune_size = size;
+  l->rune_pos = l->lexeme.end;
   return r;
 }
 
-utf8_rune lex_peek_rune(lex* l) {
-  utf8_rune r;
-  size_t size;
-  const char* decode_start;
-  size_t remaining_buffer;
-  if (l->lexeme.end >= l->input_size) {
-    return utf8_EoF;
-  }
-
-  decode_start = l->input + l->lexeme.end;
-  remaining_buffer = l->input_size - l->lexeme.end;
-  size = utf8_decode(decode_start, remaining_buffer, &r);
-  
-  if (size == 0 || r == -1) {
-    l->err = lex_err(l, mish_error_bad_rune);
-    return -1;
+utf8_rune lex_next_rune(lex* l) {
+  utf8_rune r = lex_peek_rune(l);
+  if (r < 0 || l->lexeme.end >= l->input_size) {
+    return r;
   }
+  l->lexeme.end += l->rune_size;
   return r;
 }
 
@@ -737,144 +1620,121 @@ void lex_ignore(lex* l) {
   l->lexeme.kind = lex_kind_bad;
 }
 
-typedef bool (*lex_validator)(utf8_rune);
-
-bool lex_is_decdigit(utf8_rune r) {
-  return (r >= '0' && r <= '9') ||
-         (r == '_');
-}
-
-bool lex_is_hexdigit(utf8_rune r) {
-  return (r >= '0' && r <= '9') ||
-         (r >= 'a' && r <= 'f') ||
-         (r >= 'A' && r <= 'F') ||
-         (r == '_');
-}
-
-bool lex_is_bindigit(utf8_rune r) {
-  return (r == '0') ||
-         (r == '1') ||
-         (r == '_');
-}
-
-bool lex_is_idchar(utf8_rune r) {
-  return (r >= 'a' && r <= 'z') ||
-         (r >= 'A' && r <= 'Z') ||
-         (r == '~') || (r == '+') ||
-         (r == '-') || (r == '_') ||
-         (r == '*') || (r == '/') ||
-         (r == '?') || (r == '=') ||
-         (r == '&') || 
-         (r == '%') || (r == '<') ||
-         (r == '>') || (r == '!');
-}
-
-bool lex_is_idcharnum(utf8_rune r) {
-  return (r >= '0' && r <= '9') ||
-         (r >= 'a' && r <= 'z') ||
-         (r >= 'A' && r <= 'Z') ||
-         (r == '~') || (r == '+') ||
-         (r == '-') || (r == '_') ||
-         (r == '*') || (r == '/') ||
-         (r == '?') || (r == '=') ||
-         (r == '&') || 
-         (r == '%') || (r == '<') ||
-         (r == '>') || (r == '!');
-}
-
-bool lex_is_whitespace(utf8_rune r) {
-  return (r == ' ') || (r == '\r') || (r == '\t');
-}
-
-bool lex_is_special_dq_str_char(utf8_rune r) {
-  return (r == '\\') || (r == '"');
-}
-
-bool lex_is_special_sq_str_char(utf8_rune r) {
-  return (r == '\\') || (r == '\'');
-}
-
-bool lex_accept_run(lex* l, lex_validator v) {
-  utf8_rune r = lex_peek_rune(l);
-  if (r < 0) {
-    return false;
-  }
-  while (v(r)) {
-    lex_next_rune(l);
-    r = lex_peek_rune(l);
-    if (r < 0) {
-      return false;
+/* String literals are scanned a word at a time, only the bytes
+ * that need attention stop the scan: the delimiter, a backslash,
+ * '\0' (EOF) and the first byte of a non-ASCII rune.
+ * Escapes are only validated here, the parser decodes them
+ * while copying the string into the arena.
+ */
+typedef size_t lex_word;
+
+#define LEX_WORD_ONES  ((lex_word)-1 / 0xFF)
+#define LEX_WORD_HIGHS (LEX_WORD_ONES * 0x80)
+
+/* non-zero if any byte of w is zero */
+#define LEX_WORD_HAS_ZERO(w) (((w) - LEX_WORD_ONES) & ~(w) & LEX_WORD_HIGHS)
+
+size_t lex_scan_str(lex* l, size_t pos, char delim) {
+  const uint8_t* input = (const uint8_t*)l->input;
+  size_t size = l->input_size;
+  lex_word w;
+  lex_word delims = LEX_WORD_ONES * (uint8_t)delim;
+  lex_word slashes = LEX_WORD_ONES * (uint8_t)'\\';
+  lex_word highs = l->validated ? 0 : LEX_WORD_HIGHS;
+  uint8_t c;
+
+#if UTIL_USE_SSE2
+  __m128i v;
+  __m128i d = _mm_set1_epi8(delim);
+  __m128i b = _mm_set1_epi8('\\');
+  __m128i z = _mm_setzero_si128();
+  int mask;
+  while (pos + 16 <= size) {
+    v = _mm_loadu_si128((const __m128i*)(input + pos));
+    mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, d),
+                                                       _mm_cmpeq_epi8(v, b)),
+                                          _mm_cmpeq_epi8(v, z)));
+    if (l->validated == false) {
+      mask |= _mm_movemask_epi8(v); /* high bit set: non-ASCII */
     }
-  }
-
-  return true;
-}
-
-bool lex_accept_until(lex* l, lex_validator v) {
-  utf8_rune r = lex_peek_rune(l);
-  int i = 0;
-  if (r < 0) {
-    return false;
-  }
-  if (r == utf8_EoF) {
-    l->err = lex_err(l, mish_error_unexpected_EOF);
-    return false;
-  }
-  while (!v(r)) {
-    lex_next_rune(l);
-    r = lex_peek_rune(l);
-    if (r < 0) {
-      return false;
+    if (mask != 0) {
+      return pos + __builtin_ctz(mask);
     }
-    if (r == utf8_EoF) {
-      l->err = lex_err(l, mish_error_unexpected_EOF);
-      return false;
+    pos += 16;
+  }
+#endif
+
+  while (pos + sizeof(lex_word) <= size) {
+    memcpy(&w, input + pos, sizeof(lex_word));
+    if (LEX_WORD_HAS_ZERO(w ^ delims) ||
+        LEX_WORD_HAS_ZERO(w ^ slashes) ||
+        LEX_WORD_HAS_ZERO(w) ||
+        (w & highs)) {
+      break;
     }
-    i++;
+    pos += sizeof(lex_word);
   }
 
-  if (r == utf8_EoF) {
-    l->err.code = mish_error_unexpected_EOF;
-    return false;
+  while (pos < size) {
+    c = input[pos];
+    if (c == (uint8_t)delim || c == '\\' || c == '\0' ||
+        (c >= 0x80 && l->validated == false)) {
+      return pos;
+    }
+    pos++;
   }
+  return pos;
+}
 
-  return true;
+bool lex_is_escape(char c, char delim) {
+  return c == delim || c == '\\' ||
+         c == 'n' || c == 'r' || c == 't';
 }
 
 bool lex_read_strlit(lex* l, char delim) {
-  utf8_rune r = lex_peek_rune(l);
-  bool ok;
-  lex_validator val;
-  if (r != delim) {
+  size_t pos = l->lexeme.end;
+  char c;
+  if (pos >= l->input_size || l->input[pos] != delim) {
     l->err = lex_err(l, mish_error_internal_lexer);
     return false;
   }
-  lex_next_rune(l);
-
-  val = lex_is_special_dq_str_char;
-  if (delim == '\'') {
-    val = lex_is_special_sq_str_char;
-  }
+  pos++;
 
   while (true) {
-    ok = lex_accept_until(l, val);
-    if (ok == false) {
+    pos = lex_scan_str(l, pos, delim);
+    l->lexeme.end = pos;
+    if (pos >= l->input_size || l->input[pos] == '\0') {
+      l->err = lex_err(l, mish_error_unexpected_EOF);
       return false;
     }
 
-    if (r == delim) {
-      lex_next_rune(l);
+    c = l->input[pos];
+    if (c == delim) {
+      l->lexeme.end = pos + 1;
       l->lexeme.kind = lex_kind_str;
       return true;
     }
 
-    if (r == '\\') {
-      lex_next_rune(l);
-      ok = lex_next_rune(l);
-      if (ok == false) {
+    if (c == '\\') {
+      if (pos + 1 >= l->input_size || l->input[pos+1] == '\0') {
+        l->err = lex_err(l, mish_error_unexpected_EOF);
+        return false;
+      }
+      if (lex_is_escape(l->input[pos+1], delim) == false) {
+        l->lexeme.end = pos + 2;
+        l->err = lex_err(l, mish_error_invalid_syntax);
         return false;
       }
+      l->lexeme.vkind = lex_valkind_escaped_str;
+      pos += 2;
+      continue;
     }
+
+    /* non-ASCII, must be a valid rune */
+    if (lex_next_rune(l) < 0) {
+      return false;
+    }
+    pos = l->lexeme.end;
   }
 }
 
@@ -956,192 +1816,843 @@ bool lex_conv_dec(lex* l, uint64_t* value) {
   return true;
 }
 
-bool lex_conv_inexact(lex* l, double* value) {
-  char* begin = (char*)l->input + l->lexeme.begin;
-  char* end = (char*)l->input + l->lexeme.end;
-  char c;
-  bool fractional = false;
-  double divisor = 10;
-  double output = 0;
-  while (begin < end) {
-    c = *begin;
-    if (c == '_') {
-      begin++;
-      continue;
-    }
-    if (c == '.') {
-      fractional = true;
-      begin++;
-      continue;
-    }
+/* Significant digits kept by the number parser, they fit a uint64_t.
+ * When more digits follow, the number is first rounded as if it was
+ * a bit above the kept ones, then lex_decimal_round_tail compares the
+ * whole text with the tie above that double.
+ */
+#define LEX_MAX_DIGITS 19
 
-    if (c >= '0' && c <= '9' && fractional == false) {
-      output *= 10;
-      output += (c - '0');
-    } else if (c >= '0' && c <= '9' && fractional == true) {
-      output += (double)(c - '0') / divisor;
-      divisor *= 10;
-    } else {
-      l->err = lex_err(l, mish_error_internal_lexer);
-      return false;
-    }
-    begin++;
-  }
-  *value = output;
-  return true;
-}
+/* powers of ten that are exact doubles */
+static const double lex_pow10[] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
 
-bool lex_read_number(lex* l) {
-  utf8_rune r = lex_peek_rune(l);
-  bool ok;
-  uint64_t exact_value;
-  double inexact_value;
-  if (r < 0) {
-    return false;
+/* the decimal number mantissa * 10^exp10, plus more digits if truncated */
+typedef struct {
+  uint64_t mantissa;
+  size_t num_digits; /* in mantissa */
+  int exp10;
+  bool truncated; /* non-zero digits follow the kept ones */
+  const char* text; /* every digit, up to the exponent */
+  const char* text_end;
+} lex_decimal;
+
+/* builds the double nearest to (q + t) * 2^-k, where 0 <= t < 1
+ * and t is non-zero only if sticky is set. q has at most 63 bits.
+ */
+double lex_make_double(uint64_t q, int k, bool sticky) {
+  uint64_t m, bits, rest;
+  int len = 0, drop, exponent;
+  bool half;
+  double out;
+
+  while (len < 64 && (q >> len) != 0) {
+    len++;
   }
-  if (r == '0') {
-    lex_next_rune(l);
-    r = lex_peek_rune(l);
-    switch (r) {
-      case 'x':
-        lex_next_rune(l);
-        ok = lex_accept_run(l, lex_is_hexdigit);
-        if (ok == false) {
-          return false;
-        }
-        ok = lex_conv_hex(l, &exact_value);
-        if (ok == false) {
-          return false;
-        }
-        l->lexeme.value.exact_num = exact_value;
-        l->lexeme.vkind = lex_valkind_exact_num;
-        l->lexeme.kind = lex_kind_num;
-        return true;
-      case 'b':
-        lex_next_rune(l);
-        ok = lex_accept_run(l, lex_is_bindigit);
-        if (ok == false) {
-          return false;
-        }
-        ok = lex_conv_bin(l, &exact_value);
-        if (ok == false) {
-          return false;
-        }
-        l->lexeme.value.exact_num = exact_value;
-        l->lexeme.vkind = lex_valkind_exact_num;
-        l->lexeme.kind = lex_kind_num;
-        return true;
-    }
+  if (len == 0) {
+    return 0.0;
   }
-  ok = lex_accept_run(l, lex_is_decdigit);
-  if (ok == false) {
-    return false;
+
+  /* keep 53 bits, or less if the number is subnormal */
+  drop = len - 53;
+  if (k - 1074 > drop) {
+    drop = k - 1074;
   }
-  r = lex_peek_rune(l);
-  if (r == '.') {
-    lex_next_rune(l);
-    ok = lex_accept_run(l, lex_is_decdigit);
-    if (ok == false) {
-      return false;
-    }
-    ok = lex_conv_inexact(l, &inexact_value);
-    if (ok == false) {
-      return false;
-    }
-    l->lexeme.value.inexact_num = inexact_value;
-    l->lexeme.vkind = lex_valkind_inexact_num;
-    l->lexeme.kind = lex_kind_num;
+
+  if (drop <= 0) {
+    m = q << -drop;
+  } else if (drop > len) {
+    m = 0;
   } else {
-    ok = lex_conv_dec(l, &exact_value);
-    if (ok == false) {
-      return false;
+    m = q >> drop;
+    half = (q >> (drop - 1)) & 1;
+    rest = q & ((UINT64_C(1) << (drop - 1)) - 1);
+    if (half && (rest != 0 || sticky || (m & 1))) {
+      m++;
     }
-    l->lexeme.value.exact_num = exact_value;
-    l->lexeme.vkind = lex_valkind_exact_num;
-    l->lexeme.kind = lex_kind_num;
   }
-  return true;
-}
+  exponent = drop - k;
+  if (m == UINT64_C(1) << 53) {
+    m >>= 1;
+    exponent++;
+  }
 
-bool lex_read_identifier(lex* l) {
-  utf8_rune r = lex_peek_rune(l);
-  bool ok;
-  if (lex_is_idchar(r) == false){
-    l->err = lex_err(l, mish_error_internal_lexer);
-    return false;
+  if (m == 0) {
+    return 0.0;
   }
-  l->lexeme.kind = lex_kind_id;
-  ok = lex_accept_run(l, lex_is_idcharnum);
-  if (ok == false) {
-    return false;
+  if (m < UINT64_C(1) << 52) {
+    bits = m; /* subnormal */
+  } else if (exponent + 1075 >= 2047) {
+    bits = UINT64_C(0x7FF) << 52;
+  } else {
+    bits = ((uint64_t)(exponent + 1075) << 52) | (m & ((UINT64_C(1) << 52) - 1));
   }
-  return true;
+  memcpy(&out, &bits, sizeof(double));
+  return out;
 }
 
-bool lex_ignore_whitespace(lex* l) {
-  utf8_rune r = lex_peek_rune(l);
-  if (r < 0) {
-    return false;
+/* the exact fallback: the mantissa is turned into a big integer,
+ * then scaled and divided until 55 bits of the result are known,
+ * the remainder and the truncated digits only decide ties.
+ */
+double lex_decimal_exact(lex_decimal* d) {
+  big num, den;
+  uint64_t q = 0;
+  size_t i;
+  int k;
+  bool sticky;
+
+  /* below 10^-324, under half of the smallest subnormal,
+   * or above the largest double
+   */
+  if ((int)d->num_digits + d->exp10 < -323) {
+    return 0.0;
+  }
+  if ((int)d->num_digits + d->exp10 > 310) {
+    return lex_make_double(1, -1024, false);
   }
-  while (true) {
-    if (lex_is_whitespace(r)) {
-      lex_next_rune(l);
-    } else {
-      break;
-    }
 
-    r = lex_peek_rune(l);
-    if (r < 0) {
-      return false;
+  big_set_u64(&num, d->mantissa);
+  if (d->exp10 >= 0) {
+    big_mul_pow10(&num, (size_t)d->exp10);
+    k = 55 - (int)big_bitlen(&num);
+    if (k >= 0) {
+      return lex_make_double(big_to_u64(&num), 0, d->truncated);
     }
+    sticky = big_any_below(&num, (size_t)-k) || d->truncated;
+    big_shr(&num, (size_t)-k);
+    return lex_make_double(big_to_u64(&num), k, sticky);
   }
-  lex_ignore(l);
-  return true;
-}
 
-bool lex_read_any(lex* l) {
-  utf8_rune r;
-  bool ok = lex_ignore_whitespace(l);
-  if (ok == false) {
-    return false;
+  big_pow10(&den, (size_t)-d->exp10);
+  k = 55 + (int)big_bitlen(&den) - (int)big_bitlen(&num);
+  if (k >= 0) {
+    big_shl(&num, (size_t)k);
+  } else {
+    big_shl(&den, (size_t)-k);
   }
 
-  r = lex_peek_rune(l);
-  if (lex_is_decdigit(r)) {
-    return lex_read_number(l);
+  /* binary long division, the quotient has 55 or 56 bits,
+   * num is left with the remainder
+   */
+  big_shl(&den, 56);
+  for (i = 57; i-- > 0;) {
+    if (big_cmp(&num, &den) >= 0) {
+      big_sub(&num, &den);
+      q |= UINT64_C(1) << i;
+    }
+    big_shr(&den, 1);
   }
-  if (lex_is_idchar(r)){
-    return lex_read_identifier(l);
+  return lex_make_double(q, k, big_is_zero(&num) == false || d->truncated);
+}
+
+/* out is the truncated number rounded as if it was a bit above the
+ * kept digits, so the whole number rounds to out or to the double
+ * after it. The text is compared digit by digit with the tie between
+ * the two: num / den is what is left of the tie at each digit.
+ */
+double lex_decimal_round_tail(lex_decimal* d, double out) {
+  big num, den;
+  uint64_t bits, m;
+  int e, p;
+  int cmp = 0;
+  uint32_t digit;
+  const char* c;
+  bool leading = true;
+
+  p = (int)d->num_digits + d->exp10;
+  memcpy(&bits, &out, sizeof(double));
+  e = (int)(bits >> 52);
+  if (e == 0x7FF || p < -323) {
+    return out;
   }
-  switch (r) {
-    case '"':
-      return lex_read_strlit(l, '"');
-    case '\'':
-      return lex_read_strlit(l, '\'');
-    case ':':
-      lex_next_rune(l);
-      l->lexeme.kind = lex_kind_colon;
+  m = bits & ((UINT64_C(1) << 52) - 1);
+  if (e == 0) {
+    e = 1; /* subnormal */
+  } else {
+    m |= UINT64_C(1) << 52;
+  }
+
+  /* the tie is (2m + 1) * 2^(e - 1076), the text is 0.digits * 10^p */
+  big_set_u64(&num, 2 * m + 1);
+  big_set_u64(&den, 1);
+  if (e >= 1076) {
+    big_shl(&num, (size_t)(e - 1076));
+  } else {
+    big_shl(&den, (size_t)(1076 - e));
+  }
+  if (p >= 0) {
+    big_mul_pow10(&den, (size_t)p);
+  } else {
+    big_mul_pow10(&num, (size_t)-p);
+  }
+
+  for (c = d->text; c < d->text_end && cmp == 0; c++) {
+    if (*c < '0' || *c > '9' || (leading && *c == '0')) {
+      continue;
+    }
+    leading = false;
+    big_mul_small(&num, 10);
+    digit = 0;
+    while (big_cmp(&num, &den) >= 0) {
+      big_sub(&num, &den);
+      digit++;
+    }
+    if ((uint32_t)(*c - '0') != digit) {
+      cmp = (uint32_t)(*c - '0') < digit ? -1 : 1;
+    }
+  }
+  if (cmp == 0 && big_is_zero(&num) == false) {
+    cmp = -1;
+  }
+
+  /* above the tie, or on it and out is odd */
+  if (cmp > 0 || (cmp == 0 && (m & 1))) {
+    bits++;
+    memcpy(&out, &bits, sizeof(double));
+  }
+  return out;
+}
+
+#ifndef MISH_CFG_NO_FAST_FLOAT
+/* Eisel-Lemire: the digits are multiplied by a 128 bit approximation
+ * of 5^q, which gives the correctly rounded double unless the product
+ * is too close to a tie, then the exact fallback decides.
+ * The full table covers 5^-342 to 5^308 in 10KB, this one only the
+ * powers that numbers typed in a shell tend to need.
+ * Entries are the top 128 bits of 5^q for q >= 0, and of
+ * 2^b / 5^-q + 1 for q < 0 (b = z + 127 if q >= -27, else 2z + 128,
+ * where 2^z is the smallest power of two not below 5^-q).
+ */
+#define LEX_POW5_MIN -64
+#define LEX_POW5_MAX 32
+
+static const uint64_t lex_pow5[LEX_POW5_MAX - LEX_POW5_MIN + 1][2] = {
+  {UINT64_C(0xA87FEA27A539E9A5), UINT64_C(0x3F2398D747B36224)}, /* 5^-64 */
+  {UINT64_C(0xD29FE4B18E88640E), UINT64_C(0x8EEC7F0D19A03AAD)}, /* 5^-63 */
+  {UINT64_C(0x83A3EEEEF9153E89), UINT64_C(0x1953CF68300424AC)}, /* 5^-62 */
+  {UINT64_C(0xA48CEAAAB75A8E2B), UINT64_C(0x5FA8C3423C052DD7)}, /* 5^-61 */
+  {UINT64_C(0xCDB02555653131B6), UINT64_C(0x3792F412CB06794D)}, /* 5^-60 */
+  {UINT64_C(0x808E17555F3EBF11), UINT64_C(0xE2BBD88BBEE40BD0)}, /* 5^-59 */
+  {UINT64_C(0xA0B19D2AB70E6ED6), UINT64_C(0x5B6ACEAEAE9D0EC4)}, /* 5^-58 */
+  {UINT64_C(0xC8DE047564D20A8B), UINT64_C(0xF245825A5A445275)}, /* 5^-57 */
+  {UINT64_C(0xFB158592BE068D2E), UINT64_C(0xEED6E2F0F0D56712)}, /* 5^-56 */
+  {UINT64_C(0x9CED737BB6C4183D), UINT64_C(0x55464DD69685606B)}, /* 5^-55 */
+  {UINT64_C(0xC428D05AA4751E4C), UINT64_C(0xAA97E14C3C26B886)}, /* 5^-54 */
+  {UINT64_C(0xF53304714D9265DF), UINT64_C(0xD53DD99F4B3066A8)}, /* 5^-53 */
+  {UINT64_C(0x993FE2C6D07B7FAB), UINT64_C(0xE546A8038EFE4029)}, /* 5^-52 */
+  {UINT64_C(0xBF8FDB78849A5F96), UINT64_C(0xDE98520472BDD033)}, /* 5^-51 */
+  {UINT64_C(0xEF73D256A5C0F77C), UINT64_C(0x963E66858F6D4440)}, /* 5^-50 */
+  {UINT64_C(0x95A8637627989AAD), UINT64_C(0xDDE7001379A44AA8)}, /* 5^-49 */
+  {UINT64_C(0xBB127C53B17EC159), UINT64_C(0x5560C018580D5D52)}, /* 5^-48 */
+  {UINT64_C(0xE9D71B689DDE71AF), UINT64_C(0xAAB8F01E6E10B4A6)}, /* 5^-47 */
+  {UINT64_C(0x9226712162AB070D), UINT64_C(0xCAB3961304CA70E8)}, /* 5^-46 */
+  {UINT64_C(0xB6B00D69BB55C8D1), UINT64_C(0x3D607B97C5FD0D22)}, /* 5^-45 */
+  {UINT64_C(0xE45C10C42A2B3B05), UINT64_C(0x8CB89A7DB77C506A)}, /* 5^-44 */
+  {UINT64_C(0x8EB98A7A9A5B04E3), UINT64_C(0x77F3608E92ADB242)}, /* 5^-43 */
+  {UINT64_C(0xB267ED1940F1C61C), UINT64_C(0x55F038B237591ED3)}, /* 5^-42 */
+  {UINT64_C(0xDF01E85F912E37A3), UINT64_C(0x6B6C46DEC52F6688)}, /* 5^-41 */
+  {UINT64_C(0x8B61313BBABCE2C6), UINT64_C(0x2323AC4B3B3DA015)}, /* 5^-40 */
+  {UINT64_C(0xAE397D8AA96C1B77), UINT64_C(0xABEC975E0A0D081A)}, /* 5^-39 */
+  {UINT64_C(0xD9C7DCED53C72255), UINT64_C(0x96E7BD358C904A21)}, /* 5^-38 */
+  {UINT64_C(0x881CEA14545C7575), UINT64_C(0x7E50D64177DA2E54)}, /* 5^-37 */
+  {UINT64_C(0xAA242499697392D2), UINT64_C(0xDDE50BD1D5D0B9E9)}, /* 5^-36 */
+  {UINT64_C(0xD4AD2DBFC3D07787), UINT64_C(0x955E4EC64B44E864)}, /* 5^-35 */
+  {UINT64_C(0x84EC3C97DA624AB4), UINT64_C(0xBD5AF13BEF0B113E)}, /* 5^-34 */
+  {UINT64_C(0xA6274BBDD0FADD61), UINT64_C(0xECB1AD8AEACDD58E)}, /* 5^-33 */
+  {UINT64_C(0xCFB11EAD453994BA), UINT64_C(0x67DE18EDA5814AF2)}, /* 5^-32 */
+  {UINT64_C(0x81CEB32C4B43FCF4), UINT64_C(0x80EACF948770CED7)}, /* 5^-31 */
+  {UINT64_C(0xA2425FF75E14FC31), UINT64_C(0xA1258379A94D028D)}, /* 5^-30 */
+  {UINT64_C(0xCAD2F7F5359A3B3E), UINT64_C(0x096EE45813A04330)}, /* 5^-29 */
+  {UINT64_C(0xFD87B5F28300CA0D), UINT64_C(0x8BCA9D6E188853FC)}, /* 5^-28 */
+  {UINT64_C(0x9E74D1B791E07E48), UINT64_C(0x775EA264CF55347E)}, /* 5^-27 */
+  {UINT64_C(0xC612062576589DDA), UINT64_C(0x95364AFE032A819E)}, /* 5^-26 */
+  {UINT64_C(0xF79687AED3EEC551), UINT64_C(0x3A83DDBD83F52205)}, /* 5^-25 */
+  {UINT64_C(0x9ABE14CD44753B52), UINT64_C(0xC4926A9672793543)}, /* 5^-24 */
+  {UINT64_C(0xC16D9A0095928A27), UINT64_C(0x75B7053C0F178294)}, /* 5^-23 */
+  {UINT64_C(0xF1C90080BAF72CB1), UINT64_C(0x5324C68B12DD6339)}, /* 5^-22 */
+  {UINT64_C(0x971DA05074DA7BEE), UINT64_C(0xD3F6FC16EBCA5E04)}, /* 5^-21 */
+  {UINT64_C(0xBCE5086492111AEA), UINT64_C(0x88F4BB1CA6BCF585)}, /* 5^-20 */
+  {UINT64_C(0xEC1E4A7DB69561A5), UINT64_C(0x2B31E9E3D06C32E6)}, /* 5^-19 */
+  {UINT64_C(0x9392EE8E921D5D07), UINT64_C(0x3AFF322E62439FD0)}, /* 5^-18 */
+  {UINT64_C(0xB877AA3236A4B449), UINT64_C(0x09BEFEB9FAD487C3)}, /* 5^-17 */
+  {UINT64_C(0xE69594BEC44DE15B), UINT64_C(0x4C2EBE687989A9B4)}, /* 5^-16 */
+  {UINT64_C(0x901D7CF73AB0ACD9), UINT64_C(0x0F9D37014BF60A11)}, /* 5^-15 */
+  {UINT64_C(0xB424DC35095CD80F), UINT64_C(0x538484C19EF38C95)}, /* 5^-14 */
+  {UINT64_C(0xE12E13424BB40E13), UINT64_C(0x2865A5F206B06FBA)}, /* 5^-13 */
+  {UINT64_C(0x8CBCCC096F5088CB), UINT64_C(0xF93F87B7442E45D4)}, /* 5^-12 */
+  {UINT64_C(0xAFEBFF0BCB24AAFE), UINT64_C(0xF78F69A51539D749)}, /* 5^-11 */
+  {UINT64_C(0xDBE6FECEBDEDD5BE), UINT64_C(0xB573440E5A884D1C)}, /* 5^-10 */
+  {UINT64_C(0x89705F4136B4A597), UINT64_C(0x31680A88F8953031)}, /* 5^-9 */
+  {UINT64_C(0xABCC77118461CEFC), UINT64_C(0xFDC20D2B36BA7C3E)}, /* 5^-8 */
+  {UINT64_C(0xD6BF94D5E57A42BC), UINT64_C(0x3D32907604691B4D)}, /* 5^-7 */
+  {UINT64_C(0x8637BD05AF6C69B5), UINT64_C(0xA63F9A49C2C1B110)}, /* 5^-6 */
+  {UINT64_C(0xA7C5AC471B478423), UINT64_C(0x0FCF80DC33721D54)}, /* 5^-5 */
+  {UINT64_C(0xD1B71758E219652B), UINT64_C(0xD3C36113404EA4A9)}, /* 5^-4 */
+  {UINT64_C(0x83126E978D4FDF3B), UINT64_C(0x645A1CAC083126EA)}, /* 5^-3 */
+  {UINT64_C(0xA3D70A3D70A3D70A), UINT64_C(0x3D70A3D70A3D70A4)}, /* 5^-2 */
+  {UINT64_C(0xCCCCCCCCCCCCCCCC), UINT64_C(0xCCCCCCCCCCCCCCCD)}, /* 5^-1 */
+  {UINT64_C(0x8000000000000000), UINT64_C(0x0000000000000000)}, /* 5^0 */
+  {UINT64_C(0xA000000000000000), UINT64_C(0x0000000000000000)}, /* 5^1 */
+  {UINT64_C(0xC800000000000000), UINT64_C(0x0000000000000000)}, /* 5^2 */
+  {UINT64_C(0xFA00000000000000), UINT64_C(0x0000000000000000)}, /* 5^3 */
+  {UINT64_C(0x9C40000000000000), UINT64_C(0x0000000000000000)}, /* 5^4 */
+  {UINT64_C(0xC350000000000000), UINT64_C(0x0000000000000000)}, /* 5^5 */
+  {UINT64_C(0xF424000000000000), UINT64_C(0x0000000000000000)}, /* 5^6 */
+  {UINT64_C(0x9896800000000000), UINT64_C(0x0000000000000000)}, /* 5^7 */
+  {UINT64_C(0xBEBC200000000000), UINT64_C(0x0000000000000000)}, /* 5^8 */
+  {UINT64_C(0xEE6B280000000000), UINT64_C(0x0000000000000000)}, /* 5^9 */
+  {UINT64_C(0x9502F90000000000), UINT64_C(0x0000000000000000)}, /* 5^10 */
+  {UINT64_C(0xBA43B74000000000), UINT64_C(0x0000000000000000)}, /* 5^11 */
+  {UINT64_C(0xE8D4A51000000000), UINT64_C(0x0000000000000000)}, /* 5^12 */
+  {UINT64_C(0x9184E72A00000000), UINT64_C(0x0000000000000000)}, /* 5^13 */
+  {UINT64_C(0xB5E620F480000000), UINT64_C(0x0000000000000000)}, /* 5^14 */
+  {UINT64_C(0xE35FA931A0000000), UINT64_C(0x0000000000000000)}, /* 5^15 */
+  {UINT64_C(0x8E1BC9BF04000000), UINT64_C(0x0000000000000000)}, /* 5^16 */
+  {UINT64_C(0xB1A2BC2EC5000000), UINT64_C(0x0000000000000000)}, /* 5^17 */
+  {UINT64_C(0xDE0B6B3A76400000), UINT64_C(0x0000000000000000)}, /* 5^18 */
+  {UINT64_C(0x8AC7230489E80000), UINT64_C(0x0000000000000000)}, /* 5^19 */
+  {UINT64_C(0xAD78EBC5AC620000), UINT64_C(0x0000000000000000)}, /* 5^20 */
+  {UINT64_C(0xD8D726B7177A8000), UINT64_C(0x0000000000000000)}, /* 5^21 */
+  {UINT64_C(0x878678326EAC9000), UINT64_C(0x0000000000000000)}, /* 5^22 */
+  {UINT64_C(0xA968163F0A57B400), UINT64_C(0x0000000000000000)}, /* 5^23 */
+  {UINT64_C(0xD3C21BCECCEDA100), UINT64_C(0x0000000000000000)}, /* 5^24 */
+  {UINT64_C(0x84595161401484A0), UINT64_C(0x0000000000000000)}, /* 5^25 */
+  {UINT64_C(0xA56FA5B99019A5C8), UINT64_C(0x0000000000000000)}, /* 5^26 */
+  {UINT64_C(0xCECB8F27F4200F3A), UINT64_C(0x0000000000000000)}, /* 5^27 */
+  {UINT64_C(0x813F3978F8940984), UINT64_C(0x4000000000000000)}, /* 5^28 */
+  {UINT64_C(0xA18F07D736B90BE5), UINT64_C(0x5000000000000000)}, /* 5^29 */
+  {UINT64_C(0xC9F2C9CD04674EDE), UINT64_C(0xA400000000000000)}, /* 5^30 */
+  {UINT64_C(0xFC6F7C4045812296), UINT64_C(0x4D00000000000000)}, /* 5^31 */
+  {UINT64_C(0x9DC5ADA82B70B59D), UINT64_C(0xF020000000000000)}, /* 5^32 */
+};
+
+void lex_mul_128(uint64_t a, uint64_t b, uint64_t* high, uint64_t* low) {
+  uint64_t a_lo = (uint32_t)a, a_hi = a >> 32;
+  uint64_t b_lo = (uint32_t)b, b_hi = b >> 32;
+  uint64_t ll = a_lo * b_lo, lh = a_lo * b_hi;
+  uint64_t hl = a_hi * b_lo, hh = a_hi * b_hi;
+  uint64_t mid = (ll >> 32) + (uint32_t)lh + (uint32_t)hl;
+  *low = (mid << 32) | (uint32_t)ll;
+  *high = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+}
+
+/* floor(q * log2(10)) + 63, without relying on >> of negatives */
+int lex_pow10_exp2(int q) {
+  int32_t x = (int32_t)q * (152170 + 65536);
+  return (x >= 0 ? x >> 16 : -((-x + 65535) >> 16)) + 63;
+}
+
+/* w * 10^q, w is not 0. returns false if it can't decide */
+bool lex_eisel_lemire(uint64_t w, int q, double* out) {
+  uint64_t high, low, high2, low2, mantissa, bits;
+  int lz = 0, upperbit, power2;
+
+  if (q < LEX_POW5_MIN || q > LEX_POW5_MAX) {
+    return false;
+  }
+  while ((w << lz) >> 63 == 0) {
+    lz++;
+  }
+  w <<= lz;
+
+  lex_mul_128(w, lex_pow5[q - LEX_POW5_MIN][0], &high, &low);
+  /* the 55 bits we need may still change, use the low half of 5^q */
+  if ((high & 0x1FF) == 0x1FF) {
+    lex_mul_128(w, lex_pow5[q - LEX_POW5_MIN][1], &high2, &low2);
+    low += high2;
+    if (high2 > low) {
+      high++;
+    }
+  }
+  if (low == UINT64_MAX && (q < -27 || q > 55)) {
+    return false;
+  }
+
+  upperbit = (int)(high >> 63);
+  mantissa = high >> (upperbit + 9); /* 54 bits, one to round */
+  power2 = lex_pow10_exp2(q) + upperbit - lz + 1023;
+  if (power2 <= 0 || power2 >= 0x7FF) {
+    /* can't happen within the table, but the fallback handles it */
+    return false;
+  }
+
+  /* an exact tie only happens for small powers, round it to even */
+  if (low <= 1 && q >= -4 && q <= 23 && (mantissa & 3) == 1 &&
+      (mantissa << (upperbit + 9)) == high) {
+    mantissa &= ~(uint64_t)1;
+  }
+  mantissa += mantissa & 1;
+  mantissa >>= 1;
+  if (mantissa >= UINT64_C(1) << 53) {
+    mantissa = UINT64_C(1) << 52;
+    power2++;
+  }
+  if (power2 >= 0x7FF) {
+    return false;
+  }
+
+  bits = ((uint64_t)power2 << 52) | (mantissa & ((UINT64_C(1) << 52) - 1));
+  memcpy(out, &bits, sizeof(double));
+  return true;
+}
+#endif
+
+/* Clinger's fast path: when the digits and the power of ten are both
+ * exact doubles, a single multiplication or division rounds correctly.
+ * Otherwise Eisel-Lemire is tried before the exact fallback.
+ */
+double lex_decimal_to_double(lex_decimal* d) {
+  double out;
+  int exp10 = d->exp10;
+  uint64_t m = d->mantissa;
+#ifndef MISH_CFG_NO_FAST_FLOAT
+  double upper;
+#endif
+
+  if (d->truncated == false && m <= (UINT64_C(1) << 53)) {
+    if (exp10 >= -22 && exp10 <= 22) {
+      out = (double)m;
+      return exp10 >= 0 ? out * lex_pow10[exp10] : out / lex_pow10[-exp10];
+    }
+    /* 1.5e30 is 15 * 10^7 * 10^22, still exact */
+    if (exp10 > 22 && exp10 <= 22 + 15) {
+      while (exp10 > 22 && m <= (UINT64_C(1) << 53) / 10) {
+        m *= 10;
+        exp10--;
+      }
+      if (exp10 == 22) {
+        return (double)m * lex_pow10[22];
+      }
+    }
+  }
+
+#ifndef MISH_CFG_NO_FAST_FLOAT
+  if (d->truncated == false) {
+    if (lex_eisel_lemire(d->mantissa, d->exp10, &out)) {
+      return out;
+    }
+  } else {
+    /* the value is between the kept digits and the next number up */
+    if (lex_eisel_lemire(d->mantissa, d->exp10, &out) &&
+        lex_eisel_lemire(d->mantissa + 1, d->exp10, &upper) &&
+        out == upper) {
+      return out;
+    }
+  }
+#endif
+  out = lex_decimal_exact(d);
+  if (d->truncated) {
+    out = lex_decimal_round_tail(d, out);
+  }
+  return out;
+}
+
+bool lex_conv_inexact(lex* l, double* value) {
+  char* begin = (char*)l->input + l->lexeme.begin;
+  char* end = (char*)l->input + l->lexeme.end;
+  char c;
+  bool fractional = false;
+  bool negative_exp = false;
+  int exp_value = 0;
+  lex_decimal d;
+
+  d.num_digits = 0;
+  d.exp10 = 0;
+  d.mantissa = 0;
+  d.truncated = false;
+  d.text = begin;
+  d.text_end = end;
+
+  while (begin < end) {
+    c = *begin;
+    begin++;
+    if (c == '_') {
+      continue;
+    }
+    if (c == '.') {
+      fractional = true;
+      continue;
+    }
+    if (c == 'e' || c == 'E') {
+      d.text_end = begin - 1;
       break;
-    case '$':
-      lex_next_rune(l);
-      l->lexeme.kind = lex_kind_dollar;
+    }
+    if (c < '0' || c > '9') {
+      l->err = lex_err(l, mish_error_internal_lexer);
+      return false;
+    }
+
+    if (d.num_digits == 0 && c == '0') {
+      /* leading zeros only move the point */
+      d.exp10 -= fractional;
+    } else if (d.num_digits < LEX_MAX_DIGITS) {
+      d.mantissa = d.mantissa * 10 + (uint64_t)(c - '0');
+      d.num_digits++;
+      d.exp10 -= fractional;
+    } else {
+      d.truncated |= c != '0';
+      d.exp10 += !fractional;
+    }
+  }
+
+  /* the DFA already checked the exponent has digits */
+  if (begin < end && (*begin == '+' || *begin == '-')) {
+    negative_exp = *begin == '-';
+    begin++;
+  }
+  while (begin < end) {
+    c = *begin;
+    begin++;
+    if (c >= '0' && c <= '9' && exp_value < 100000) {
+      exp_value = exp_value * 10 + (c - '0');
+    }
+  }
+  d.exp10 += negative_exp ? -exp_value : exp_value;
+
+  if (d.num_digits == 0) {
+    *value = 0.0;
+    return true;
+  }
+  *value = lex_decimal_to_double(&d);
+  return true;
+}
+
+/* The scanner for numbers, identifiers and punctuation is a DFA,
+ * every byte is mapped to a character class and the token grammar
+ * is a transition table indexed by [state][class].
+ * A token ends when the transition leads to lex_state_done,
+ * the final state tells what was read.
+ * Strings are scanned separately since they accept UTF-8.
+ */
+typedef enum {
+  lex_class_other,
+  lex_class_eof,
+  lex_class_space,
+  lex_class_newline,
+  lex_class_zero,
+  lex_class_one,
+  lex_class_digit,
+  lex_class_underscore,
+  lex_class_hexletter,
+  lex_class_b,
+  lex_class_x,
+  lex_class_e,
+  lex_class_sign,
+  lex_class_idchar,
+  lex_class_dot,
+  lex_class_dquote,
+  lex_class_squote,
+  lex_class_colon,
+  lex_class_dollar,
+  lex_class_pipe,
+  lex_class_utf8,
+  lex_class_count
+} lex_class;
+
+typedef enum {
+  lex_state_done,
+  lex_state_start,
+  lex_state_zero,
+  lex_state_hex,
+  lex_state_bin,
+  lex_state_dec,
+  lex_state_frac,
+  lex_state_exp_mark, /* after the 'e' */
+  lex_state_exp_sign,
+  lex_state_exp,
+  lex_state_id,
+  lex_state_colon,
+  lex_state_dollar,
+  lex_state_pipe,
+  lex_state_newline,
+  lex_state_count
+} lex_state;
+
+#define LC_OT lex_class_other
+#define LC_EF lex_class_eof
+#define LC_SP lex_class_space
+#define LC_NL lex_class_newline
+#define LC_Z0 lex_class_zero
+#define LC_O1 lex_class_one
+#define LC_DG lex_class_digit
+#define LC_US lex_class_underscore
+#define LC_HX lex_class_hexletter
+#define LC_LB lex_class_b
+#define LC_LX lex_class_x
+#define LC_LE lex_class_e
+#define LC_SG lex_class_sign
+#define LC_ID lex_class_idchar
+#define LC_DT lex_class_dot
+#define LC_DQ lex_class_dquote
+#define LC_SQ lex_class_squote
+#define LC_CL lex_class_colon
+#define LC_DL lex_class_dollar
+#define LC_PP lex_class_pipe
+#define LC_U8 lex_class_utf8
+
+/* '\0' is treated as EOF, just like utf8_EoF */
+static const uint8_t lex_char_class[256] = {
+  /* 00 */ LC_EF, LC_OT, LC_OT, LC_OT, LC_OT, LC_OT, LC_OT, LC_OT, LC_OT, LC_SP, LC_NL, LC_OT, LC_OT, LC_SP, LC_OT, LC_OT,
+  /* 10 */ LC_OT, LC_OT, LC_OT, LC_OT, LC_OT, LC_OT, LC_OT, LC_OT, LC_OT, LC_OT, LC_OT, LC_OT, LC_OT, LC_OT, LC_OT, LC_OT,
+  /* 20 */ LC_SP, LC_ID, LC_DQ, LC_OT, LC_DL, LC_ID, LC_ID, LC_SQ, LC_OT, LC_OT, LC_ID, LC_SG, LC_OT, LC_SG, LC_DT, LC_ID,
+  /* 30 */ LC_Z0, LC_O1, LC_DG, LC_DG, LC_DG, LC_DG, LC_DG, LC_DG, LC_DG, LC_DG, LC_CL, LC_OT, LC_ID, LC_ID, LC_ID, LC_ID,
+  /* 40 */ LC_OT, LC_HX, LC_HX, LC_HX, LC_HX, LC_LE, LC_HX, LC_ID, LC_ID, LC_ID, LC_ID, LC_ID, LC_ID, LC_ID, LC_ID, LC_ID,
+  /* 50 */ LC_ID, LC_ID, LC_ID, LC_ID, LC_ID, LC_ID, LC_ID, LC_ID, LC_ID, LC_ID, LC_ID, LC_OT, LC_OT, LC_OT, LC_OT, LC_US,
+  /* 60 */ LC_OT, LC_HX, LC_LB, LC_HX, LC_HX, LC_LE, LC_HX, LC_ID, LC_ID, LC_ID, LC_ID, LC_ID, LC_ID, LC_ID, LC_ID, LC_ID,
+  /* 70 */ LC_ID, LC_ID, LC_ID, LC_ID, LC_ID, LC_ID, LC_ID, LC_ID, LC_LX, LC_ID, LC_ID, LC_OT, LC_PP, LC_OT, LC_ID, LC_OT,
+  /* 80 */ LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8,
+  /* 90 */ LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8,
+  /* A0 */ LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8,
+  /* B0 */ LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8,
+  /* C0 */ LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8,
+  /* D0 */ LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8,
+  /* E0 */ LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8,
+  /* F0 */ LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8, LC_U8,
+};
+
+#undef LC_OT
+#undef LC_EF
+#undef LC_SP
+#undef LC_NL
+#undef LC_Z0
+#undef LC_O1
+#undef LC_DG
+#undef LC_US
+#undef LC_HX
+#undef LC_LB
+#undef LC_LX
+#undef LC_LE
+#undef LC_SG
+#undef LC_ID
+#undef LC_DT
+#undef LC_DQ
+#undef LC_SQ
+#undef LC_CL
+#undef LC_DL
+#undef LC_PP
+#undef LC_U8
+
+/* missing entries are zero, that is, lex_state_done */
+static const uint8_t lex_transition[lex_state_count][lex_class_count] = {
+  [lex_state_start] = {
+    [lex_class_zero]       = lex_state_zero,
+    [lex_class_one]        = lex_state_dec,
+    [lex_class_digit]      = lex_state_dec,
+    [lex_class_underscore] = lex_state_dec,
+    [lex_class_hexletter]  = lex_state_id,
+    [lex_class_b]          = lex_state_id,
+    [lex_class_x]          = lex_state_id,
+    [lex_class_e]          = lex_state_id,
+    [lex_class_sign]       = lex_state_id,
+    [lex_class_idchar]     = lex_state_id,
+    [lex_class_colon]      = lex_state_colon,
+    [lex_class_dollar]     = lex_state_dollar,
+    [lex_class_pipe]       = lex_state_pipe,
+    [lex_class_newline]    = lex_state_newline,
+  },
+  [lex_state_zero] = {
+    [lex_class_x]          = lex_state_hex,
+    [lex_class_b]          = lex_state_bin,
+    [lex_class_zero]       = lex_state_dec,
+    [lex_class_one]        = lex_state_dec,
+    [lex_class_digit]      = lex_state_dec,
+    [lex_class_underscore] = lex_state_dec,
+    [lex_class_dot]        = lex_state_frac,
+    [lex_class_e]          = lex_state_exp_mark,
+  },
+  [lex_state_hex] = {
+    [lex_class_zero]       = lex_state_hex,
+    [lex_class_one]        = lex_state_hex,
+    [lex_class_digit]      = lex_state_hex,
+    [lex_class_underscore] = lex_state_hex,
+    [lex_class_hexletter]  = lex_state_hex,
+    [lex_class_b]          = lex_state_hex,
+    [lex_class_e]          = lex_state_hex,
+  },
+  [lex_state_bin] = {
+    [lex_class_zero]       = lex_state_bin,
+    [lex_class_one]        = lex_state_bin,
+    [lex_class_underscore] = lex_state_bin,
+  },
+  [lex_state_dec] = {
+    [lex_class_zero]       = lex_state_dec,
+    [lex_class_one]        = lex_state_dec,
+    [lex_class_digit]      = lex_state_dec,
+    [lex_class_underscore] = lex_state_dec,
+    [lex_class_dot]        = lex_state_frac,
+    [lex_class_e]          = lex_state_exp_mark,
+  },
+  [lex_state_frac] = {
+    [lex_class_zero]       = lex_state_frac,
+    [lex_class_one]        = lex_state_frac,
+    [lex_class_digit]      = lex_state_frac,
+    [lex_class_underscore] = lex_state_frac,
+    [lex_class_e]          = lex_state_exp_mark,
+  },
+  [lex_state_exp_mark] = {
+    [lex_class_zero]       = lex_state_exp,
+    [lex_class_one]        = lex_state_exp,
+    [lex_class_digit]      = lex_state_exp,
+    [lex_class_sign]       = lex_state_exp_sign,
+  },
+  [lex_state_exp_sign] = {
+    [lex_class_zero]       = lex_state_exp,
+    [lex_class_one]        = lex_state_exp,
+    [lex_class_digit]      = lex_state_exp,
+  },
+  [lex_state_exp] = {
+    [lex_class_zero]       = lex_state_exp,
+    [lex_class_one]        = lex_state_exp,
+    [lex_class_digit]      = lex_state_exp,
+    [lex_class_underscore] = lex_state_exp,
+  },
+  [lex_state_id] = {
+    [lex_class_zero]       = lex_state_id,
+    [lex_class_one]        = lex_state_id,
+    [lex_class_digit]      = lex_state_id,
+    [lex_class_underscore] = lex_state_id,
+    [lex_class_hexletter]  = lex_state_id,
+    [lex_class_b]          = lex_state_id,
+    [lex_class_x]          = lex_state_id,
+    [lex_class_e]          = lex_state_id,
+    [lex_class_sign]       = lex_state_id,
+    [lex_class_idchar]     = lex_state_id,
+  },
+  /* single rune tokens have no transitions */
+};
+
+lex_class lex_class_at(lex* l, size_t pos) {
+  if (pos >= l->input_size) {
+    return lex_class_eof;
+  }
+  return (lex_class)lex_char_class[(uint8_t)l->input[pos]];
+}
+
+bool lex_conv_number(lex* l, lex_state final) {
+  uint64_t exact_value;
+  double inexact_value;
+  bool ok;
+
+  switch (final) {
+    case lex_state_hex:
+      ok = lex_conv_hex(l, &exact_value);
       break;
-    case '|':
-      lex_next_rune(l);
-      l->lexeme.kind = lex_kind_pipe;
+    case lex_state_bin:
+      ok = lex_conv_bin(l, &exact_value);
       break;
-    case '\n':
-      lex_next_rune(l);
-      l->lexeme.kind = lex_kind_newline;
+    case lex_state_zero:
+    case lex_state_dec:
+      ok = lex_conv_dec(l, &exact_value);
       break;
-    case utf8_EoF:
-      l->lexeme.kind = lex_kind_eof;
+    case lex_state_exp_mark:
+    case lex_state_exp_sign:
+      /* an exponent without digits */
+      l->err = lex_err(l, mish_error_invalid_syntax);
+      return false;
+    case lex_state_frac:
+    case lex_state_exp:
+      ok = lex_conv_inexact(l, &inexact_value);
+      if (ok == false) {
+        return false;
+      }
+      l->lexeme.value.inexact_num = inexact_value;
+      l->lexeme.vkind = lex_valkind_inexact_num;
+      l->lexeme.kind = lex_kind_num;
+      return true;
+    default:
+      l->err = lex_err_internal(l);
+      return false;
+  }
+  if (ok == false) {
+    return false;
+  }
+  l->lexeme.value.exact_num = exact_value;
+  l->lexeme.vkind = lex_valkind_exact_num;
+  l->lexeme.kind = lex_kind_num;
+  return true;
+}
+
+/* a non-ASCII byte can't extend a token, but we still have to
+ * report it if it doesn't start a valid rune
+ */
+bool lex_check_rune(lex* l) {
+  if (l->validated ||
+      lex_class_at(l, l->lexeme.end) != lex_class_utf8) {
+    return true;
+  }
+  return lex_peek_rune(l) >= 0;
+}
+
+bool lex_read_any(lex* l) {
+  lex_state state = lex_state_start;
+  lex_state next;
+  size_t end = l->lexeme.end;
+
+  while (lex_class_at(l, end) == lex_class_space) {
+    end++;
+  }
+  l->lexeme.begin = end;
+  l->lexeme.end = end;
+  l->lexeme.kind = lex_kind_bad;
+  l->lexeme.vkind = lex_valkind_none;
+
+  while (true) {
+    next = (lex_state)lex_transition[state][lex_class_at(l, end)];
+    if (next == lex_state_done) {
+      break;
+    }
+    state = next;
+    end++;
+  }
+  l->lexeme.end = end;
+
+  switch (state) {
+    case lex_state_start:
       break;
+    case lex_state_id:
+      l->lexeme.kind = lex_kind_id;
+      return lex_check_rune(l);
+    case lex_state_colon:
+      l->lexeme.kind = lex_kind_colon;
+      return true;
+    case lex_state_dollar:
+      l->lexeme.kind = lex_kind_dollar;
+      return true;
+    case lex_state_pipe:
+      l->lexeme.kind = lex_kind_pipe;
+      return true;
+    case lex_state_newline:
+      l->lexeme.kind = lex_kind_newline;
+      return true;
+    default:
+      return lex_check_rune(l) && lex_conv_number(l, state);
+  }
+
+  /* nothing was consumed */
+  switch (lex_class_at(l, end)) {
+    case lex_class_dquote:
+      return lex_read_strlit(l, '"');
+    case lex_class_squote:
+      return lex_read_strlit(l, '\'');
+    case lex_class_eof:
+      l->lexeme.kind = lex_kind_eof;
+      return true;
+    case lex_class_utf8:
+      if (lex_peek_rune(l) < 0) {
+        return false;
+      }
+      /* the error covers the rune */
+      l->err = lex_err(l, mish_error_unrecognized_rune);
+      l->err.range.end += (int)l->rune_size;
+      return false;
     default:
       l->err = lex_err(l, mish_error_unrecognized_rune);
+      l->err.range.end++;
       return false;
   }
-  return true;
 }
 
 /*
@@ -1155,6 +2666,155 @@ bool lex_next(lex* l) {
 }
 /* END: LEX NAMESPACE */
 
+/* BEGIN: STATS NAMESPACE */
+/* With MISH_CFG_STATS and a clock, the lexing and parsing of each
+ * stage, the dispatch of its command and the command itself are timed.
+ * Without them every function here does nothing.
+ */
+#ifdef MISH_CFG_STATS
+uint32_t stats_now(mish_shell* s) {
+  return s->stats.clock != NULL ? s->stats.clock() : 0;
+}
+
+void stats_add(mish_stat* st, uint32_t ticks) {
+  size_t bucket = 0;
+  uint32_t t = ticks;
+  while (t != 0 && bucket < MISH_CFG_STATS_BUCKETS - 1) {
+    t >>= 1;
+    bucket++;
+  }
+  st->calls++;
+  st->total += ticks;
+  st->max = ticks > st->max ? ticks : st->max;
+  st->hist[bucket]++;
+}
+
+mish_stat* stats_find_cmd(mish_shell* s, mish_command cmd) {
+  mish_stats* st = &s->stats;
+  size_t i;
+  for (i = 0; i < st->num_cmds; i++) {
+    if (st->cmds[i].cmd == cmd) {
+      return &st->cmds[i].stat;
+    }
+  }
+  if (st->num_cmds == MISH_CFG_STATS_CMDS) {
+    return NULL;
+  }
+  st->cmds[st->num_cmds].cmd = cmd;
+  return &st->cmds[st->num_cmds++].stat;
+}
+
+/* the name a command was registered with, for printing */
+bool stats_cmd_name(mish_shell* s, mish_command cmd, mish_atom* name) {
+  mish_map_entry* entry;
+  size_t i;
+  if (s->static_cmds != NULL) {
+    for (i = 0; i < s->static_cmds->size; i++) {
+      if (s->static_cmds->cmds[i].cmd == cmd) {
+        name->kind = mish_atk_string;
+        name->contents.string = s->static_cmds->cmds[i].name;
+        return true;
+      }
+    }
+  }
+  for (i = 0; i < s->env->capacity; i++) {
+    entry = map_slot_entry(s->env, &s->env->slots[i]);
+    if (entry != NULL && entry->value.kind == mish_atk_command &&
+        entry->value.contents.cmd == cmd) {
+      *name = entry->key;
+      return true;
+    }
+  }
+  return false;
+}
+#endif
+
+bool stats_lex_next(mish_shell* s, lex* l) {
+#ifdef MISH_CFG_STATS
+  uint32_t start = stats_now(s);
+  bool ok = lex_next(l);
+  s->stats.lex_ticks += stats_now(s) - start;
+  return ok;
+#else
+  if (s == NULL) { /* avoid warning */ }
+  return lex_next(l);
+#endif
+}
+
+/* the first lexeme of a stage may be lexed before it starts, start
+ * is moved back by the lex ticks counted so far so that parse only
+ * loses the lexing done since
+ */
+uint32_t stats_start(mish_shell* s) {
+#ifdef MISH_CFG_STATS
+  return stats_now(s) - s->stats.lex_ticks;
+#else
+  if (s == NULL) { /* avoid warning */ }
+  return 0;
+#endif
+}
+
+/* a stage was parsed, its command is dispatched from here */
+void stats_parsed(mish_shell* s, uint32_t start) {
+#ifdef MISH_CFG_STATS
+  mish_stats* st = &s->stats;
+  uint32_t now;
+  if (st->clock == NULL) {
+    return;
+  }
+  now = st->clock();
+  stats_add(&st->lex, st->lex_ticks);
+  stats_add(&st->parse, now - start - st->lex_ticks);
+  st->lex_ticks = 0;
+  st->mark = st->clock();
+#else
+  if (s == NULL || start == 0) { /* avoid warning */ }
+#endif
+}
+
+/* a prepared stage is dispatched without parsing */
+void stats_mark(mish_shell* s) {
+#ifdef MISH_CFG_STATS
+  s->stats.mark = stats_now(s);
+#else
+  if (s == NULL) { /* avoid warning */ }
+#endif
+}
+
+/* returns when the command starts */
+uint32_t stats_dispatched(mish_shell* s) {
+#ifdef MISH_CFG_STATS
+  uint32_t now;
+  if (s->stats.clock == NULL) {
+    return 0;
+  }
+  now = s->stats.clock();
+  stats_add(&s->stats.dispatch, now - s->stats.mark);
+  return s->stats.clock();
+#else
+  if (s == NULL) { /* avoid warning */ }
+  return 0;
+#endif
+}
+
+void stats_ran(mish_shell* s, mish_command cmd, uint32_t start) {
+#ifdef MISH_CFG_STATS
+  uint32_t now;
+  mish_stat* st;
+  if (s->stats.clock == NULL) {
+    return;
+  }
+  now = s->stats.clock();
+  st = stats_find_cmd(s, cmd);
+  if (st != NULL) {
+    stats_add(st, now - start);
+  }
+#else
+  if (s == NULL || cmd == NULL || start == 0) { /* avoid warning */ }
+#endif
+}
+/* END: STATS NAMESPACE */
+
 
 /* BEGIN: PAR NAMESPACE */
 /* parser is technically recursive descent, but without
@@ -1164,22 +2824,77 @@ bool lex_next(lex* l) {
  * the environment, so that it's not only parsing, but
  * also name resolution
  */
-mish_str par_create_string(mish_shell* ctx, lex* l) {
+/* copies len bytes from source to dest decoding escapes,
+ * returns the decoded length. Plain runs are moved as a whole,
+ * and since decoding never grows the string, dest may alias source.
+ */
+size_t par_unescape(char* dest, const char* source, size_t len) {
+  const char* end = source + len;
+  const char* slash;
+  size_t out = 0;
+  size_t run;
+
+  while (source < end) {
+    slash = memchr(source, '\\', end - source);
+    if (slash == NULL) {
+      slash = end;
+    }
+    run = slash - source;
+    memmove(dest + out, source, run);
+    out += run;
+    source = slash;
+    if (source + 1 >= end) {
+      break;
+    }
+
+    switch (source[1]) {
+      case 'n':
+        dest[out] = '\n';
+        break;
+      case 'r':
+        dest[out] = '\r';
+        break;
+      case 't':
+        dest[out] = '\t';
+        break;
+      default: /* delimiter or backslash */
+        dest[out] = source[1];
+        break;
+    }
+    out++;
+    source += 2;
+  }
+  return out;
+}
+
+/* returns a string with a NULL buffer if the arena is full,
+ * the lexeme may be at the head of the arena itself (see FEED)
+ */
+mish_str par_create_string(mish_arena* arena, lex* l) {
   mish_str s;
   char* source_buff = NULL;
+  size_t raw_length;
 
-  s.length = lex_lexeme_len(l->lexeme) -2; /* minus delimiters */
+  raw_length = lex_lexeme_len(l->lexeme) -2; /* minus delimiters */
   source_buff = lex_lexeme_str(l->input, l->lexeme) + 1; /* jump first delimiter */
 
-  /* alloc, copy and null-terminate */
-  s.buffer = (char*) arena_alloc(ctx->arg_arena, s.length+1);
-  memcpy(s.buffer, source_buff, s.length);
+  /* alloc, copy (decoding escapes) and null-terminate */
+  s.length = raw_length;
+  s.buffer = (char*) arena_alloc_top(arena, raw_length+1);
+  if (s.buffer == NULL) {
+    return s;
+  }
+  if (l->lexeme.vkind == lex_valkind_escaped_str) {
+    s.length = par_unescape(s.buffer, source_buff, raw_length);
+  } else {
+    memmove(s.buffer, source_buff, raw_length);
+  }
   s.buffer[s.length] = '\0';
 
   return s;
 }
 
-mish_str par_create_string_from_id(mish_shell* ctx, lex* l) {
+mish_str par_create_string_from_id(mish_arena* arena, lex* l) {
   mish_str s;
   char* source_buff = NULL;
 
@@ -1187,23 +2902,37 @@ mish_str par_create_string_from_id(mish_shell* ctx, lex* l) {
   source_buff = lex_lexeme_str(l->input, l->lexeme);
 
   /* alloc, copy and null-terminate */
-  s.buffer = (char*) arena_alloc(ctx->arg_arena, s.length+1);
-  memcpy(s.buffer, source_buff, s.length);
+  s.buffer = (char*) arena_alloc_top(arena, s.length+1);
+  if (s.buffer == NULL) {
+    return s;
+  }
+  memmove(s.buffer, source_buff, s.length);
   s.buffer[s.length] = '\0';
   return s;
 }
 
-bool par_create_atom(lex* l, mish_shell* ctx, mish_atom* a) {
+/* strings are allocated at the top of the given arena, which is the
+ * arg arena for commands that are evaluated right away
+ */
+bool par_create_atom(lex* l, mish_shell* ctx, mish_arena* arena, mish_atom* a) {
   bool ok;
 
   switch (l->lexeme.kind) {
     case lex_kind_str:
       a->kind = mish_atk_string;
-      a->contents.string = par_create_string(ctx, l);
+      a->contents.string = par_create_string(arena, l);
+      if (a->contents.string.buffer == NULL) {
+        ctx->err = lex_err(l, mish_error_parser_out_of_memory);
+        return false;
+      }
       break;
     case lex_kind_id:
       a->kind = mish_atk_string;
-      a->contents.string = par_create_string_from_id(ctx, l);
+      a->contents.string = par_create_string_from_id(arena, l);
+      if (a->contents.string.buffer == NULL) {
+        ctx->err = lex_err(l, mish_error_parser_out_of_memory);
+        return false;
+      }
       break;
     case lex_kind_num:
       switch (l->lexeme.vkind) {
@@ -1222,7 +2951,7 @@ bool par_create_atom(lex* l, mish_shell* ctx, mish_atom* a) {
     default:
       return false;
   }
-  ok = lex_next(l);
+  ok = stats_lex_next(ctx, l);
   if (!ok) {
     ctx->err = l->err;
     return false;
@@ -1231,13 +2960,24 @@ bool par_create_atom(lex* l, mish_shell* ctx, mish_atom* a) {
 }
 
 bool par_eval_variable(mish_shell* ctx, mish_atom* a) {
-  return map_find(&ctx->map, *a, a);
+  const mish_named_cmd* c;
+  if (a->kind == mish_atk_string) {
+    c = map_static_find(ctx->static_cmds, a->contents.string);
+    if (c != NULL) {
+      *a = mish_atom_create_cmd(c->cmd);
+      return true;
+    }
+  }
+  return map_find(ctx->env, *a, a);
 }
 
-/* Atom = ['$'] (id | num | str). */
-bool par_parse_atom(lex* l, mish_atom* a, mish_shell* ctx) {
-  bool is_var = false;
+/* Atom = ['$'] (id | num | str).
+ * variables are not resolved here, is_var tells if
+ * the atom was preceded by '$'
+ */
+bool par_parse_atom(lex* l, mish_atom* a, bool* is_var, mish_shell* ctx, mish_arena* arena) {
   bool ok;
+  *is_var = false;
 
   switch (l->lexeme.kind) {
     case lex_kind_newline:
@@ -1249,52 +2989,60 @@ bool par_parse_atom(lex* l, mish_atom* a, mish_shell* ctx) {
   }
 
   if (l->lexeme.kind == lex_kind_dollar) {
-    is_var = true;
+    *is_var = true;
 
-    ok = lex_next(l);
+    ok = stats_lex_next(ctx, l);
     if (!ok) {
       ctx->err = l->err;
       return false;
     }
   }
 
-  if (par_create_atom(l, ctx, a) == false) {
-    ctx->err = lex_err(l, mish_error_internal_parser);
-    return false;
-  }
-
-  if (is_var) {
-    ok = par_eval_variable(ctx, a);
-    if (!ok) {
-      ctx->err.code = mish_error_variable_not_found;
-      return false;
+  if (par_create_atom(l, ctx, arena, a) == false) {
+    if (ctx->err.code == mish_error_none) {
+      ctx->err = lex_err(l, mish_error_internal_parser);
     }
+    return false;
   }
-
   return true;
 }
 
-/* Pair = Atom [':' Atom]. */
-bool par_parse_arg(lex* l, mish_shell* ctx, mish_argument* arg) {
+/* Pair = Atom [':' Atom].
+ * vars is a combination of MISH_PREP_VAR_KEY and MISH_PREP_VAR_VALUE,
+ * plain atoms use MISH_PREP_VAR_KEY.
+ */
+bool par_parse_arg(lex* l, mish_shell* ctx, mish_arena* arena, mish_argument* arg, uint8_t* vars) {
   mish_atom at1;
   mish_atom at2;
   mish_pair p;
+  bool is_var;
   bool ok;
+  *vars = 0;
 
-  if (par_parse_atom(l, &at1, ctx) == false) {
+  if (par_parse_atom(l, &at1, &is_var, ctx, arena) == false) {
     return false;
   }
+  if (is_var) {
+    *vars |= MISH_PREP_VAR_KEY;
+  }
 
   if (l->lexeme.kind == lex_kind_colon) {
-    ok = lex_next(l);
+    ok = stats_lex_next(ctx, l);
     if (!ok) {
       ctx->err = l->err;
       return false;
     }
 
-    if (par_parse_atom(l, &at2, ctx) == false) {
+    if (par_parse_atom(l, &at2, &is_var, ctx, arena) == false) {
+      /* a ':' at the end of the stage needs a value */
+      if (ctx->err.code == mish_error_none) {
+        ctx->err = lex_err(l, mish_error_invalid_syntax);
+      }
       return false;
     }
+    if (is_var) {
+      *vars |= MISH_PREP_VAR_VALUE;
+    }
 
     p.key = at1;
     p.value = at2;
@@ -1307,238 +3055,2222 @@ bool par_parse_arg(lex* l, mish_shell* ctx, mish_argument* arg) {
   return true;
 }
 
-/* Pairs = {Pair}. */
-mish_arg_list* par_parse_pairs(lex* l, mish_shell* ctx) {
-  mish_arg_list* root = NULL;
-  mish_arg_list* curr = NULL;
-  mish_arg_list* prev = NULL;
-  mish_argument arg;
+/* replaces the atoms marked in vars by their value in the environment */
+bool par_resolve_arg(mish_shell* ctx, mish_argument* arg, uint8_t vars) {
+  mish_atom* key = &arg->contents.atom;
+  if (arg->kind == mish_ark_pair) {
+    key = &arg->contents.pair.key;
+  }
+
+  if ((vars & MISH_PREP_VAR_KEY) && par_eval_variable(ctx, key) == false) {
+    ctx->err.code = mish_error_variable_not_found;
+    return false;
+  }
+  if ((vars & MISH_PREP_VAR_VALUE) &&
+      par_eval_variable(ctx, &arg->contents.pair.value) == false) {
+    ctx->err.code = mish_error_variable_not_found;
+    return false;
+  }
+  return true;
+}
+
+/* see par_index_args */
+struct mish__args_index {
+  mish_arena* arena;
+  uint16_t* slots; /* NULL when the arguments are scanned */
+  size_t mask;
+  bool built;
+};
+
+void par_init_args(mish_arg_list* list, mish_argument* argv, size_t argc) {
+  list->argv = argv;
+  list->argc = argc;
+  list->index = NULL;
+}
+
+/* Appends the arguments of src to list with a single copy.
+ * A list stays where it is while it is the last thing allocated
+ * from the head of the arena, otherwise it is moved there first
+ * (ie: results that are a view of the arguments of a command).
+ */
+bool par_append_args(mish_arena* arena, mish_arg_list* list, mish_arg_list* src) {
+  mish_argument* dest;
+  size_t moved = 0;
+
+  if (src->argc == 0) {
+    return true;
+  }
+  if (list->index != NULL) {
+    list->index->built = false; /* it would miss the new pairs */
+  }
+  if (list->argc > 0 && (void*)(list->argv + list->argc) != arena_head(arena)) {
+    moved = list->argc;
+  }
+  dest = (mish_argument*) arena_alloc(arena, (moved + src->argc) * sizeof(mish_argument));
+  if (dest == NULL) {
+    return false;
+  }
+  if (moved > 0) {
+    memcpy(dest, list->argv, moved * sizeof(mish_argument));
+  }
+  if (list->argc == 0 || moved > 0) {
+    list->argv = dest;
+  }
+  memcpy(list->argv + list->argc, src->argv, src->argc * sizeof(mish_argument));
+  list->argc += src->argc;
+  return true;
+}
+
+bool par_push_arg(mish_arena* arena, mish_arg_list* list, mish_argument arg) {
+  mish_arg_list one;
+  par_init_args(&one, &arg, 1);
+  return par_append_args(arena, list, &one);
+}
+
+uint32_t par_hash_key(const char* key, size_t length) {
+  return map_murmur_hash(key, length, 0);
+}
+
+bool par_is_key(mish_argument* arg, const char* key, size_t length) {
+  mish_atom k;
+  if (arg->kind != mish_ark_pair) {
+    return false;
+  }
+  k = arg->contents.pair.key;
+  return k.kind == mish_atk_string &&
+         k.contents.string.length == length &&
+         memcmp(k.contents.string.buffer, key, length) == 0;
+}
+
+/* Commands with more than MISH_CFG_ARGS_INDEX_PAIRS pairs get an open
+ * addressing table of their string keys, taken from the top of the
+ * arena by the first mish_args_get of the command, so commands that
+ * don't look up keys don't pay for it. A slot holds the position of
+ * the first pair with its key, 0 is a free slot since argv[0] is the
+ * command. Without memory for it, mish_args_get just scans the arguments.
+ */
+void par_index_args(mish_arg_list* list) {
+  struct mish__args_index* idx = list->index;
+  size_t i, slot, pairs = 0, size = 4;
+  uint16_t* index;
+  mish_str key;
+
+  idx->built = true;
+  idx->slots = NULL;
+  idx->mask = 0;
+  for (i = 1; i < list->argc; i++) {
+    if (list->argv[i].kind == mish_ark_pair) {
+      pairs++;
+    }
+  }
+  if (pairs <= MISH_CFG_ARGS_INDEX_PAIRS || list->argc > UINT16_MAX) {
+    return;
+  }
+  while (size < pairs * 2) {
+    size *= 2;
+  }
+  index = (uint16_t*) arena_alloc_top(idx->arena, size * sizeof(uint16_t));
+  if (index == NULL) {
+    return;
+  }
+  memset(index, 0, size * sizeof(uint16_t));
+
+  for (i = 1; i < list->argc; i++) {
+    if (list->argv[i].kind != mish_ark_pair ||
+        list->argv[i].contents.pair.key.kind != mish_atk_string) {
+      continue;
+    }
+    key = list->argv[i].contents.pair.key.contents.string;
+    slot = par_hash_key(key.buffer, key.length) & (size - 1);
+    while (index[slot] != 0 && par_is_key(&list->argv[index[slot]], key.buffer, key.length) == false) {
+      slot = (slot + 1) & (size - 1);
+    }
+    if (index[slot] == 0) {
+      index[slot] = (uint16_t)i;
+    }
+  }
+  idx->slots = index;
+  idx->mask = size - 1;
+}
+
+/* Pairs = {Pair}.
+ * the arguments are appended to list, false if the stage is not valid
+ */
+bool par_parse_pairs(lex* l, mish_shell* ctx, mish_arg_list* list) {
+  mish_argument arg;
+  uint8_t vars;
   ctx->err.code = mish_error_none;
 
-  while (par_parse_arg(l, ctx, &arg)) {
-    curr = (mish_arg_list*) arena_alloc(ctx->arg_arena, sizeof(mish_arg_list));
-    if (curr == NULL) {
+  while (par_parse_arg(l, ctx, ctx->arg_arena, &arg, &vars)) {
+    if (vars != 0 && par_resolve_arg(ctx, &arg, vars) == false) {
+      return false;
+    }
+    if (par_push_arg(ctx->arg_arena, list, arg) == false) {
       ctx->err = lex_err(l, mish_error_parser_out_of_memory);
-      return NULL;
+      return false;
+    }
+  }
+  return ctx->err.code == mish_error_none;
+}
+/* END: PAR NAMESPACE */
+
+/* BEGIN: PREP NAMESPACE */
+/* Prepared commands are lines that were lexed and parsed once,
+ * the result is kept in a slot of the prepared command cache, which
+ * is split evenly in n arenas (MISH_CFG_PREP_CACHE_SLOTS, unless
+ * the shell was made with a mish_shell_config).
+ * Everything lives in the slot arena: a copy of the line (used as key),
+ * the stages of the pipeline and their arguments.
+ * Variables are kept unresolved since the environment may change
+ * between executions, command procedures are cached together with
+ * the generation of the environment they were resolved in.
+ *
+ * Slots are either pinned (created by mish_shell_prepare, released
+ * by the user) or used by mish_shell_eval as a LRU cache keyed by the
+ * hash of the line.
+ */
+void prep_init(mish_shell* s, uint8_t* buffer, size_t size, size_t n) {
+  size_t slot_size;
+  size_t i;
+  arena_RES res;
+  mish_prepared* p;
+
+  s->prep_slots = NULL;
+  s->num_prep_slots = 0;
+  s->prep_clock = 0;
+  if (n == 0 || size < n * sizeof(mish_prepared)) {
+    return;
+  }
+
+  s->prep_slots = (mish_prepared*)buffer;
+  buffer += n * sizeof(mish_prepared);
+  slot_size = util_align_trim_down((size - n * sizeof(mish_prepared)) / n);
+
+  for (i = 0; i < n; i++) {
+    p = &s->prep_slots[i];
+    p->arena = arena_new(buffer, slot_size, &res);
+    if (res != arena_OK) {
+      s->prep_slots = NULL;
+      return;
     }
-    if (root == NULL) {
-      root = curr;
+    p->stages = NULL;
+    p->line = NULL;
+    p->line_size = 0;
+    p->hash = 0;
+    p->last_used = 0;
+    p->used = false;
+    p->pinned = false;
+    buffer += slot_size;
+  }
+  s->num_prep_slots = n;
+}
+
+uint32_t prep_hash(char* cmd, size_t cmd_size) {
+  return map_murmur_hash(cmd, cmd_size, 0);
+}
+
+/* pinned slots are never returned, they belong to the user */
+mish_prepared* prep_find(mish_shell* s, char* cmd, size_t cmd_size) {
+  uint32_t hash = prep_hash(cmd, cmd_size);
+  mish_prepared* p;
+  size_t i;
+  for (i = 0; i < s->num_prep_slots; i++) {
+    p = &s->prep_slots[i];
+    if (p->used && !p->pinned &&
+        p->hash == hash &&
+        p->line_size == cmd_size &&
+        memcmp(p->line, cmd, cmd_size) == 0) {
+      return p;
+    }
+  }
+  return NULL;
+}
+
+/* returns a free slot or the least recently used one,
+ * NULL if all slots are pinned
+ */
+mish_prepared* prep_victim(mish_shell* s) {
+  mish_prepared* out = NULL;
+  mish_prepared* p;
+  size_t i;
+  for (i = 0; i < s->num_prep_slots; i++) {
+    p = &s->prep_slots[i];
+    if (p->used == false) {
+      return p;
     }
-    if (prev != NULL) {
-      prev->next = curr;
+    if (p->pinned) {
+      continue;
+    }
+    if (out == NULL || p->last_used < out->last_used) {
+      out = p;
     }
-    curr->arg = arg;
-    prev = curr;
   }
+  return out;
+}
+
+/* on failure the stages before the one that failed are kept,
+ * and rest is left on the first lexeme of that stage so that
+ * it can be evaluated from the text (p->line is NULL if the
+ * line itself didn't fit)
+ */
+mish_error_code prep_compile(mish_shell* s, mish_prepared* p, char* cmd, size_t cmd_size, lex* rest) {
+  mish_prep_stage** stage_tail;
+  mish_prep_stage* stage;
+  mish_prep_arg** arg_tail;
+  mish_prep_arg* node;
+  mish_argument arg;
+  uint8_t vars;
+  uint32_t start;
+  lex l;
+
+  arena_free_all(p->arena);
+  p->used = false;
+  p->pinned = false;
+  p->stages = NULL;
+  p->line = arena_alloc(p->arena, cmd_size);
+  if (p->line == NULL) {
+    return mish_error_parser_out_of_memory;
+  }
+  memcpy(p->line, cmd, cmd_size);
+  p->line_size = cmd_size;
+  p->hash = prep_hash(cmd, cmd_size);
 
-  if (ctx->err.code != mish_error_none) {
-    return NULL;
+  l = lex_new(p->line, cmd_size);
+  *rest = l;
+  l.validated = true;
+  s->err.code = mish_error_none;
+  stage_tail = &p->stages;
+
+  do {
+    start = stats_start(s);
+    if (stats_lex_next(s, &l) == false) {
+      s->err = l.err;
+      return l.err.code;
+    }
+    *rest = l;
+
+    stage = arena_alloc(p->arena, sizeof(mish_prep_stage));
+    if (stage == NULL) {
+      return mish_error_parser_out_of_memory;
+    }
+    stage->args = NULL;
+    stage->cmd = NULL;
+    stage->generation = 0;
+    stage->next = NULL;
+    arg_tail = &stage->args;
+
+    while (par_parse_arg(&l, s, p->arena, &arg, &vars)) {
+      node = arena_alloc(p->arena, sizeof(mish_prep_arg));
+      if (node == NULL) {
+        return mish_error_parser_out_of_memory;
+      }
+      node->arg = arg;
+      node->vars = vars;
+      node->next = NULL;
+      *arg_tail = node;
+      arg_tail = &node->next;
+    }
+    if (s->err.code != mish_error_none) {
+      return s->err.code;
+    }
+    if (stage->args == NULL) {
+      s->err = lex_err(&l, mish_error_expected_command);
+      return s->err.code;
+    }
+
+    *stage_tail = stage;
+    stage_tail = &stage->next;
+    stats_parsed(s, start);
+  } while (l.lexeme.kind == lex_kind_pipe);
+
+  p->used = true;
+  return mish_error_none;
+}
+
+/* copies the arguments of a stage to the arg arena,
+ * resolving variables on the way
+ */
+bool prep_build_args(mish_shell* s, mish_prep_stage* stage, mish_arg_list* list) {
+  mish_prep_arg* node;
+  mish_argument arg;
+  s->err.code = mish_error_none;
+
+  for (node = stage->args; node != NULL; node = node->next) {
+    arg = node->arg;
+    if (node->vars != 0 && par_resolve_arg(s, &arg, node->vars) == false) {
+      return false;
+    }
+    if (par_push_arg(s->arg_arena, list, arg) == false) {
+      s->err.code = mish_error_parser_out_of_memory;
+      return false;
+    }
   }
-  if (curr != NULL) {
-    curr->next = NULL;
+  return true;
+}
+/* END: PREP NAMESPACE */
+
+/* BEGIN: SNAP NAMESPACE */
+/* Snapshots are images of the environment that can be kept in flash
+ * and restored without lexing or hashing anything:
+ *
+ *   header | slots | node arena | string arena
+ *
+ * Pointers are stored as offsets, entries as their index plus one
+ * (so empty slots stay 0), and commands as indices into the table
+ * given to mish_shell_register_cmds.
+ * Images are only valid for builds with the same layout of entries,
+ * which the header records.
+ */
+#define SNAP_MAGIC 0x4853494D /* "MISH" */
+
+typedef struct {
+  uint32_t magic;
+  uint32_t layout;
+  uint32_t checksum; /* of everything after the header */
+  uint32_t capacity;
+  uint32_t count;
+  uint32_t seed;
+  uint32_t dead_bytes;
+  uint32_t node_bytes;
+  uint32_t str_bytes;
+} snap_header;
+
+uint32_t snap_layout(void) {
+  return (uint32_t)(sizeof(mish_map_entry) | (sizeof(mish_map_slot) << 16));
+}
+
+bool snap_find_cmd(mish_shell* s, mish_command cmd, uint64_t* index) {
+  size_t i;
+  for (i = 0; i < s->cmd_table_size; i++) {
+    if (s->cmd_table[i].cmd == cmd) {
+      *index = i;
+      return true;
+    }
   }
-  return root;
+  return false;
 }
-/* END: PAR NAMESPACE */
+
+bool snap_pack_atom(mish_shell* s, mish_atom* a) {
+  uint64_t index;
+  switch (a->kind) {
+    case mish_atk_string:
+      a->contents.string.buffer = (char*)(uintptr_t)
+        ((uint8_t*)a->contents.string.buffer - s->env->str_arena->buffer);
+      return true;
+    case mish_atk_command:
+      if (snap_find_cmd(s, a->contents.cmd, &index) == false) {
+        return false;
+      }
+      a->contents.exact_num = index;
+      return true;
+    default:
+      return true;
+  }
+}
+
+bool snap_unpack_atom(mish_shell* s, mish_atom* a, size_t str_bytes) {
+  uintptr_t offset;
+  uint64_t index;
+  switch (a->kind) {
+    case mish_atk_string:
+      offset = (uintptr_t)a->contents.string.buffer;
+      if (offset > str_bytes || a->contents.string.length > str_bytes - offset) {
+        return false;
+      }
+      a->contents.string.buffer = (char*)(s->env->str_arena->buffer + offset);
+      return true;
+    case mish_atk_command:
+      index = a->contents.exact_num;
+      if (index >= s->cmd_table_size) {
+        return false;
+      }
+      a->contents.cmd = s->cmd_table[index].cmd;
+      return true;
+    case mish_atk_exact_num:
+    case mish_atk_inexact_num:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/* the image buffer may be unaligned (ie: flash), so everything
+ * goes through memcpy
+ */
+mish_error_code snap_write(mish_shell* s, uint8_t* buffer, size_t size, size_t* written) {
+  mish_map* m = s->env;
+  size_t stride = map_entry_stride();
+  size_t slots_bytes = m->capacity * sizeof(mish_map_slot);
+  size_t needed;
+  size_t offset;
+  snap_header h;
+  mish_map_entry n;
+  uint8_t* out;
+
+  needed = sizeof(snap_header) + slots_bytes +
+           m->node_arena->allocated + m->str_arena->allocated;
+  *written = needed;
+  if (size < needed) {
+    return mish_error_snapshot_too_small;
+  }
+
+  /* slots refer to entries by number, so they are copied as they are */
+  out = buffer + sizeof(snap_header);
+  memcpy(out, m->slots, slots_bytes);
+  out += slots_bytes;
+
+  /* padding is zeroed so equal environments give equal images */
+  for (offset = 0; offset < m->node_arena->allocated; offset += stride) {
+    memset(&n, 0, sizeof(mish_map_entry));
+    memcpy(&n, m->node_arena->buffer + offset, sizeof(mish_map_entry));
+    if (snap_pack_atom(s, &n.key) == false ||
+        snap_pack_atom(s, &n.value) == false) {
+      return mish_error_unregistered_cmd;
+    }
+    memset(out, 0, stride);
+    memcpy(out, &n, sizeof(mish_map_entry));
+    out += stride;
+  }
+
+  memcpy(out, m->str_arena->buffer, m->str_arena->allocated);
+
+  h.magic = SNAP_MAGIC;
+  h.layout = snap_layout();
+  h.capacity = (uint32_t)m->capacity;
+  h.count = (uint32_t)m->count;
+  h.seed = m->seed;
+  h.dead_bytes = (uint32_t)m->dead_bytes;
+  h.node_bytes = (uint32_t)m->node_arena->allocated;
+  h.str_bytes = (uint32_t)m->str_arena->allocated;
+  h.checksum = map_murmur_hash((char*)buffer + sizeof(snap_header),
+                               needed - sizeof(snap_header), 0);
+  memcpy(buffer, &h, sizeof(snap_header));
+  return mish_error_none;
+}
+
+mish_error_code snap_fixup(mish_shell* s, const uint8_t* slots, snap_header* h) {
+  mish_map* m = s->env;
+  size_t stride = map_entry_stride();
+  size_t num_nodes = h->node_bytes / stride;
+  size_t offset, i;
+  mish_map_entry* n;
+
+  for (offset = 0; offset < h->node_bytes; offset += stride) {
+    n = (mish_map_entry*)(m->node_arena->buffer + offset);
+    if (snap_unpack_atom(s, &n->key, h->str_bytes) == false ||
+        snap_unpack_atom(s, &n->value, h->str_bytes) == false) {
+      return mish_error_bad_snapshot;
+    }
+  }
+
+  /* a shell with a different bucket array or seed can still
+   * use the image, it just has to hash everything again
+   */
+  if (h->capacity != m->capacity || h->seed != m->seed) {
+    map_rehash(m);
+    return mish_error_none;
+  }
+  memcpy(m->slots, slots, m->capacity * sizeof(mish_map_slot));
+  for (i = 0; i < m->capacity; i++) {
+    if (m->slots[i].entry > num_nodes) {
+      return mish_error_bad_snapshot;
+    }
+  }
+  return mish_error_none;
+}
+
+mish_error_code snap_read(mish_shell* s, const uint8_t* buffer, size_t size) {
+  mish_map* m = s->env;
+  snap_header h;
+  const uint8_t* slots;
+  const uint8_t* nodes;
+  size_t slots_bytes;
+  mish_error_code err;
+
+  if (size < sizeof(snap_header)) {
+    return mish_error_bad_snapshot;
+  }
+  memcpy(&h, buffer, sizeof(snap_header));
+  slots_bytes = (size_t)h.capacity * sizeof(mish_map_slot);
+  if (h.magic != SNAP_MAGIC || h.layout != snap_layout() ||
+      size != sizeof(snap_header) + slots_bytes + h.node_bytes + h.str_bytes ||
+      h.node_bytes % map_entry_stride() != 0 ||
+      h.checksum != map_murmur_hash((char*)buffer + sizeof(snap_header),
+                                    size - sizeof(snap_header), 0)) {
+    return mish_error_bad_snapshot;
+  }
+  if (h.node_bytes >= m->node_arena->buffsize ||
+      h.str_bytes >= m->str_arena->buffsize ||
+      h.count > map_max_count(m)) {
+    return mish_error_arena_too_small;
+  }
+
+  slots = buffer + sizeof(snap_header);
+  nodes = slots + slots_bytes;
+  memcpy(m->node_arena->buffer, nodes, h.node_bytes);
+  memcpy(m->str_arena->buffer, nodes + h.node_bytes, h.str_bytes);
+  m->node_arena->allocated = h.node_bytes;
+  m->str_arena->allocated = h.str_bytes;
+  m->count = h.count;
+  arena_note_peak(m->node_arena);
+  arena_note_peak(m->str_arena);
+  if (m->count > m->peak_count) {
+    m->peak_count = m->count;
+  }
+  /* the seed stays the shell's own, devices restored
+   * from one image must not share it
+   */
+  m->dead_bytes = h.dead_bytes;
+  UTIL_INC(&m->generation);
+
+  err = snap_fixup(s, slots, &h);
+  if (err != mish_error_none) {
+    map_clear(m);
+  }
+  return err;
+}
+/* END: SNAP NAMESPACE */
 
 /* BEGIN: SHELL NAMESPACE */
-size_t mish_shell_write_atom(mish_shell* s, mish_atom a) {
-  size_t offset = mish_snprint_atom(s->out_buffer + s->written, s->buff_size - s->written, a);
-  s->written += offset;
-  return offset;
+/* defined in FEED, lines given as a whole drop any partially fed line */
+void feed_reset(mish_feed* f);
+
+/* Sessions share the environment of the shell they were made from.
+ * Lookups never lock: entries are complete before a slot publishes them,
+ * and overwritten entries stay readable until compaction.
+ * Inserts are serialized by the lock of the environment.
+ * Clearing, compacting and rehashing move or free entries, so they
+ * stop the world: they wait until no other session runs a line,
+ * and lines don't start until they are done.
+ */
+bool shell_arena_low(mish_arena* a) {
+  return arena_available(a) < (a->buffsize * MISH_CFG_COMPACT_THRESHOLD) / MISH_CFG_GRANULARITY;
 }
 
-size_t mish_shell_write_pair(mish_shell* s, mish_pair p) {
-  size_t offset = mish_snprint_pair(s->out_buffer + s->written, s->buff_size - s->written, p);
-  s->written += offset;
-  return offset;
+bool shell_compact_wanted(mish_map* m) {
+  return m->dead_bytes > 0 &&
+         (shell_arena_low(m->node_arena) || shell_arena_low(m->str_arena));
 }
 
-size_t mish_shell_write_arg(mish_shell* s, mish_argument a) {
-  size_t offset = mish_snprint_arg(s->out_buffer + s->written, s->buff_size - s->written, a);
-  s->written += offset;
-  return offset;
+#ifdef MISH_CFG_THREADS
+void shell_lock(mish_shell* s) {
+  pthread_mutex_lock(&s->env->lock);
 }
 
-size_t mish_shell_write_strlit(mish_shell* s, char* string) {
-  size_t offset = snprintf(s->out_buffer + s->written, s->buff_size - s->written, "%s", string);
-  s->written += offset;
-  return offset;
+/* the arenas only change under the lock, so this is where
+ * sessions are told to compact without reading them
+ */
+void shell_unlock(mish_shell* s) {
+  __atomic_store_n(&s->env->compact_wanted, shell_compact_wanted(s->env), __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&s->env->lock);
 }
 
-size_t mish_shell_write_char(mish_shell* s, char c) {
-  if (s->written >= s->buff_size) {
-    return 0;
+void shell_enter_line(mish_shell* s) {
+  int* stopping = &s->env->stopping;
+  if (s->active) {
+    return; /* already running a line */
+  }
+  while (true) {
+    __atomic_store_n(&s->active, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(stopping, __ATOMIC_SEQ_CST) == 0) {
+      return;
+    }
+    __atomic_store_n(&s->active, 0, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(stopping, __ATOMIC_SEQ_CST) != 0) {
+      sched_yield();
+    }
   }
-  s->out_buffer[s->written] = c;
-  s->written ++;
-  return 1;
 }
 
-size_t mish_shell_available_env_memory(mish_shell* s) {
-	return arena_available(s->map.node_arena) +
-		   arena_available(s->map.str_arena);
+void shell_leave_line(mish_shell* s) {
+  __atomic_store_n(&s->active, 0, __ATOMIC_RELEASE);
 }
 
-bool mish_shell_add_cmd(mish_shell* s, char* name, mish_command cmd) {
-  return mish_shell_add_atom_cmd(s, mish_atom_create_str(name), cmd);
+/* returns whether s was running a line, commands that clear
+ * the environment must not use atoms taken from it before
+ */
+bool shell_stop_world(mish_shell* s) {
+  bool was_active = s->active != 0;
+  int expected;
+  mish_shell* other;
+
+  shell_leave_line(s);
+  while (true) {
+    expected = 0;
+    if (__atomic_compare_exchange_n(&s->env->stopping, &expected, 1, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      break;
+    }
+    sched_yield();
+  }
+  for (other = UTIL_LOAD(&s->env->sessions); other != NULL; other = other->next_session) {
+    while (other != s && __atomic_load_n(&other->active, __ATOMIC_SEQ_CST) != 0) {
+      sched_yield();
+    }
+  }
+  shell_lock(s);
+  return was_active;
 }
 
-bool mish_shell_add_atom_cmd(mish_shell* s, mish_atom a, mish_command cmd) {
-  return map_insert(&s->map, a, mish_atom_create_cmd(cmd));
+void shell_resume_world(mish_shell* s, bool was_active) {
+  shell_unlock(s);
+  __atomic_store_n(&s->env->stopping, 0, __ATOMIC_SEQ_CST);
+  if (was_active) {
+    shell_enter_line(s);
+  }
+}
+
+void shell_add_session(mish_shell* s) {
+  shell_lock(s);
+  s->next_session = s->env->sessions;
+  UTIL_STORE(&s->env->sessions, s);
+  shell_unlock(s);
+}
+
+void shell_remove_session(mish_shell* s) {
+  mish_shell** link;
+  bool was_active = shell_stop_world(s);
+  for (link = &s->env->sessions; *link != NULL; link = &(*link)->next_session) {
+    if (*link == s) {
+      *link = s->next_session;
+      break;
+    }
+  }
+  shell_resume_world(s, was_active);
+}
+#else
+/* a single thread never waits */
+void shell_lock(mish_shell* s) {
+  if (s == NULL) {
+    /* avoid warning */
+  }
+}
+
+void shell_unlock(mish_shell* s) {
+  if (s == NULL) {
+    /* avoid warning */
+  }
+}
+
+void shell_enter_line(mish_shell* s) {
+  if (s == NULL) {
+    /* avoid warning */
+  }
+}
+
+void shell_leave_line(mish_shell* s) {
+  if (s == NULL) {
+    /* avoid warning */
+  }
+}
+
+bool shell_stop_world(mish_shell* s) {
+  if (s == NULL) {
+    /* avoid warning */
+  }
+  return false;
+}
+
+void shell_resume_world(mish_shell* s, bool was_active) {
+  if (s == NULL || was_active) {
+    /* avoid warning */
+  }
+}
+
+void shell_add_session(mish_shell* s) {
+  if (s == NULL) {
+    /* avoid warning */
+  }
+}
+
+void shell_remove_session(mish_shell* s) {
+  if (s == NULL) {
+    /* avoid warning */
+  }
+}
+#endif
+
+/* Commands give typed results to the next stage of a pipeline
+ * by emitting them, nothing is formatted or parsed on the way.
+ * Only the argument is copied, strings must live until the line
+ * is done (ie: in the arg arena or in the environment).
+ * Returns false if the arg arena is full.
+ */
+bool mish_shell_emit(mish_shell* s, mish_argument a) {
+  return par_push_arg(s->arg_arena, &s->results, a);
+}
+
+bool mish_shell_emit_atom(mish_shell* s, mish_atom a) {
+  mish_argument arg;
+  arg.kind = mish_ark_atom;
+  arg.contents.atom = a;
+  return mish_shell_emit(s, arg);
+}
+
+/* emits every argument of list after the command (ie: echo
+ * emits its own arguments), list must have been allocated in the
+ * arg arena during this line and must not be modified afterwards.
+ * The arguments aren't copied unless something was emitted before.
+ * Returns false if the arg arena is full.
+ */
+bool mish_shell_emit_list(mish_shell* s, mish_arg_list* list) {
+  mish_arg_list rest;
+  if (list == NULL || list->argc < 2) {
+    return true;
+  }
+  par_init_args(&rest, list->argv + 1, list->argc - 1);
+  if (s->results.argc == 0) {
+    s->results = rest;
+    return true;
+  }
+  return par_append_args(s->arg_arena, &s->results, &rest);
+}
+
+/* sends the output written so far to the sink,
+ * only the last stage of a pipeline streams its output,
+ * the others keep it to be parsed by the next stage
+ */
+void mish_shell_flush(mish_shell* s) {
+  if (s->streaming == false || s->written == 0) {
+    return;
+  }
+  s->sink(s, s->out_buffer, s->written, s->sink_user);
+  s->written = 0;
+  s->out_buffer[0] = '\0';
+}
+
+/* the last byte of the buffer is kept for the terminator,
+ * without a sink the output is truncated once the buffer is full.
+ * Returns the amount of bytes written.
+ */
+size_t shell_write(mish_shell* s, const char* data, size_t size) {
+  size_t done = 0;
+  size_t n;
+
+  if (s->buff_size == 0) {
+    return 0;
+  }
+  while (done < size) {
+    if (s->written + 1 >= s->buff_size) {
+      if (s->streaming == false || s->written == 0) {
+        break;
+      }
+      mish_shell_flush(s);
+    }
+    n = s->buff_size - 1 - s->written;
+    if (n > size - done) {
+      n = size - done;
+    }
+    memcpy(s->out_buffer + s->written, data + done, n);
+    s->written += n;
+    done += n;
+  }
+  if (s->written > s->out_peak) {
+    s->out_peak = s->written;
+  }
+  s->out_buffer[s->written] = '\0';
+  return done;
+}
+
+size_t shell_put(void* ctx, const char* data, size_t size) {
+  return shell_write((mish_shell*)ctx, data, size);
+}
+
+size_t mish_shell_write_atom(mish_shell* s, mish_atom a) {
+  return fmt_atom(shell_put, s, a);
+}
+
+size_t mish_shell_write_pair(mish_shell* s, mish_pair p) {
+  return fmt_pair(shell_put, s, p);
+}
+
+size_t mish_shell_write_arg(mish_shell* s, mish_argument a) {
+  return fmt_arg(shell_put, s, a);
+}
+
+size_t mish_shell_write_strlit(mish_shell* s, char* string) {
+  return shell_write(s, string, strlen(string));
+}
+
+size_t mish_shell_write_char(mish_shell* s, char c) {
+  return shell_write(s, &c, 1);
+}
+
+/* the sink receives the output of commands as the out buffer fills,
+ * and what is left once the line is done. NULL disables it.
+ */
+void mish_shell_set_sink(mish_shell* s, mish_sink sink, void* user) {
+  s->sink = sink;
+  s->sink_user = user;
+}
+
+#ifdef MISH_CFG_STATS
+/* nothing is timed until a clock is set */
+void mish_shell_set_clock(mish_shell* s, mish_clock clock) {
+  s->stats.clock = clock;
+  s->stats.lex_ticks = 0;
+}
+
+void mish_shell_reset_stats(mish_shell* s) {
+  mish_clock clock = s->stats.clock;
+  memset(&s->stats, 0, sizeof(mish_stats));
+  s->stats.clock = clock;
+}
+#endif
+
+size_t mish_shell_available_env_memory(mish_shell* s) {
+	return arena_available(s->env->node_arena) +
+		   arena_available(s->env->str_arena);
+}
+
+/* the environment peaks are those of the shared environment */
+void mish_shell_peaks(mish_shell* s, mish_peaks* out) {
+  size_t i;
+  out->arg_arena = s->arg_arena->peak;
+  out->str_arena = s->env->str_arena->peak;
+  out->node_arena = s->env->node_arena->peak;
+  out->map_count = s->env->peak_count;
+  out->out_buffer = s->out_peak;
+  out->prep_slot = 0;
+  for (i = 0; i < s->num_prep_slots; i++) {
+    if (s->prep_slots[i].arena->peak > out->prep_slot) {
+      out->prep_slot = s->prep_slots[i].arena->peak;
+    }
+  }
+}
+
+/* peaks start again from what is in use now */
+void mish_shell_reset_peaks(mish_shell* s) {
+  size_t i;
+  s->arg_arena->peak = arena_used(s->arg_arena);
+  s->env->str_arena->peak = arena_used(s->env->str_arena);
+  s->env->node_arena->peak = arena_used(s->env->node_arena);
+  s->env->peak_count = s->env->count;
+  s->out_peak = s->written;
+  for (i = 0; i < s->num_prep_slots; i++) {
+    s->prep_slots[i].arena->peak = arena_used(s->prep_slots[i].arena);
+  }
+}
+
+/* hosts reachable from untrusted input should pick a random seed,
+ * the environment is rehashed in place and stays valid
+ */
+void mish_shell_set_seed(mish_shell* s, uint32_t seed) {
+  bool was_active = shell_stop_world(s);
+  map_set_seed(s->env, seed);
+  shell_resume_world(s, was_active);
+}
+
+/* the table is used in place and must outlive the shell */
+void mish_shell_set_static_cmds(mish_shell* s, const mish_static_table* table) {
+  s->static_cmds = table;
+  UTIL_INC(&s->env->generation);
+}
+
+void mish_shell_register_cmds(mish_shell* s, const mish_named_cmd* table, size_t size) {
+  s->cmd_table = table;
+  s->cmd_table_size = size;
+}
+
+/* writes an image of the environment into buffer,
+ * written is set to the size of the image even if the buffer
+ * is too small, so it can be used to size the buffer.
+ * Every command in the environment must be registered.
+ */
+mish_error_code mish_shell_snapshot(mish_shell* s, uint8_t* buffer, size_t size, size_t* written) {
+  mish_error_code err;
+  shell_lock(s);
+  err = snap_write(s, buffer, size, written);
+  shell_unlock(s);
+  return err;
+}
+
+/* replaces the environment with an image written by mish_shell_snapshot,
+ * the commands must be registered in the same order.
+ * The environment is left empty if the image is rejected halfway.
+ */
+mish_error_code mish_shell_restore(mish_shell* s, const uint8_t* buffer, size_t size) {
+  mish_error_code err;
+  bool was_active = shell_stop_world(s);
+  err = snap_read(s, buffer, size);
+  shell_resume_world(s, was_active);
+  return err;
+}
+
+/* reclaims the memory of overwritten variables,
+ * must not be called while atoms of the environment are in use
+ */
+size_t mish_shell_compact(mish_shell* s) {
+  size_t reclaimed;
+  bool was_active = shell_stop_world(s);
+  reclaimed = map_compact(s->env);
+  shell_resume_world(s, was_active);
+  return reclaimed;
+}
+
+bool mish_shell_add_cmd(mish_shell* s, char* name, mish_command cmd) {
+  return mish_shell_add_atom_cmd(s, mish_atom_create_str(name), cmd);
+}
+
+bool mish_shell_add_atom_cmd(mish_shell* s, mish_atom a, mish_command cmd) {
+  bool ok;
+  shell_lock(s);
+  ok = map_insert(s->env, a, mish_atom_create_cmd(cmd));
+  shell_unlock(s);
+  return ok;
+}
+
+bool mish_shell_add_str(mish_shell* s, char* name, char* str) {
+  bool ok;
+  shell_lock(s);
+  ok = map_insert(s->env, mish_atom_create_str(name), mish_atom_create_str(str));
+  shell_unlock(s);
+  return ok;
+}
+
+bool mish_shell_add_exact_num(mish_shell* s, char* name, int64_t num) {
+  bool ok;
+  shell_lock(s);
+  ok = map_insert(s->env, mish_atom_create_str(name), mish_atom_create_num_exact(num));
+  shell_unlock(s);
+  return ok;
+}
+
+bool mish_shell_add_inexact_num(mish_shell* s, char* name, double num) {
+  bool ok;
+  shell_lock(s);
+  ok = map_insert(s->env, mish_atom_create_str(name), mish_atom_create_num_inexact(num));
+  shell_unlock(s);
+  return ok;
+}
+
+bool shell_assert_config() {
+  size_t total = 0;
+  total += MISH_CFG_ARG_ARENA_SIZE;
+  total += MISH_CFG_STR_ARENA_SIZE;
+  total += MISH_CFG_NODE_ARENA_SIZE;
+  total += MISH_CFG_HASHMAP_BUCKET_ARRAY_SIZE;
+  total += MISH_CFG_OUT_BUFFER_SIZE;
+  total += MISH_CFG_PREP_CACHE_SIZE;
+  return total == MISH_CFG_GRANULARITY;
+}
+
+size_t shell_compute_size(size_t total_size, size_t ratio) {
+  size_t region_size = util_align_trim_down((total_size*ratio)/MISH_CFG_GRANULARITY);
+  return region_size;
+}
+
+/* what a shell and a session start with, besides their memory */
+void shell_init_state(mish_shell* s) {
+  s->cmd_table = NULL;
+  s->cmd_table_size = 0;
+  s->static_cmds = NULL;
+  par_init_args(&s->results, NULL, 0);
+  s->sink = NULL;
+  s->sink_user = NULL;
+  s->streaming = false;
+  s->cmd = NULL;
+  s->cmd_size = 0;
+  s->out_peak = 0;
+  feed_reset(&s->feed);
+#ifdef MISH_CFG_STATS
+  memset(&s->stats, 0, sizeof(mish_stats));
+#endif
+}
+
+/* the sizes of the regions of a shell, in the order they are laid out */
+typedef struct {
+  size_t arg_arena;
+  size_t str_arena;
+  size_t node_arena;
+  size_t buckets;
+  size_t out_buffer;
+  size_t prep_cache;
+  size_t prep_slots;
+} shell_layout;
+
+mish_error_code shell_new_layout(uint8_t* buffer, shell_layout* layout, mish_shell* s) {
+  uint8_t* start;
+  arena_RES res;
+  s->err.code = mish_error_none;
+
+  start = buffer;
+  s->arg_arena = arena_new(start, layout->arg_arena, &res);
+  if (res != arena_OK) {
+    return arena_map_res(res);
+  }
+
+  s->env = &s->map;
+  start += layout->arg_arena;
+  s->map.str_arena = arena_new(start, layout->str_arena, &res);
+  if (res != arena_OK) {
+    return arena_map_res(res);
+  }
+
+  start += layout->str_arena;
+  s->map.node_arena = arena_new(start, layout->node_arena, &res);
+  if (res != arena_OK) {
+    return arena_map_res(res);
+  }
+
+  start += layout->node_arena;
+  s->map.slots = (mish_map_slot*)start;
+  s->map.capacity = util_pow2_floor(layout->buckets / sizeof(mish_map_slot));
+
+  start += layout->buckets;
+  s->out_buffer = (char*)start;
+  s->buff_size = layout->out_buffer;
+  s->written = 0;
+
+  start += layout->out_buffer;
+  prep_init(s, start, layout->prep_cache, layout->prep_slots);
+
+  s->map.generation = 0;
+  s->map.seed = 0;
+  s->map.peak_count = 0;
+#ifdef MISH_CFG_THREADS
+  if (pthread_mutex_init(&s->map.lock, NULL) != 0) {
+    return mish_error_internal;
+  }
+  s->map.stopping = 0;
+  s->map.compact_wanted = 0;
+  s->map.sessions = NULL;
+  s->active = 0;
+#endif
+  shell_init_state(s);
+  shell_add_session(s);
+  mish_builtin_hard_clear(s, NULL);
+
+  return mish_error_none;
+}
+
+/* the node arena and the bucket array share their budget,
+ * the bucket array gets the fewest slots that still hold every
+ * entry the rest of it fits
+ */
+void shell_split_map(shell_layout* layout) {
+  size_t total = layout->node_arena + layout->buckets;
+  size_t cap = 1;
+  size_t entries;
+
+  while ((cap * 2) * sizeof(mish_map_slot) <= total) {
+    entries = (total - cap * sizeof(mish_map_slot)) / map_entry_stride();
+    if (cap - cap/8 - 1 >= entries) {
+      break;
+    }
+    cap *= 2;
+  }
+  layout->buckets = cap * sizeof(mish_map_slot);
+  layout->node_arena = total - layout->buckets;
+}
+
+mish_error_code mish_shell_new(uint8_t* buffer, size_t size, mish_shell* s) {
+  shell_layout layout;
+
+  if (shell_assert_config() == false) {
+    return mish_error_bad_memory_config;
+  }
+  layout.arg_arena = shell_compute_size(size, MISH_CFG_ARG_ARENA_SIZE);
+  layout.str_arena = shell_compute_size(size, MISH_CFG_STR_ARENA_SIZE);
+  layout.node_arena = shell_compute_size(size, MISH_CFG_NODE_ARENA_SIZE);
+  layout.buckets = shell_compute_size(size, MISH_CFG_HASHMAP_BUCKET_ARRAY_SIZE);
+  layout.out_buffer = shell_compute_size(size, MISH_CFG_OUT_BUFFER_SIZE);
+  layout.prep_cache = shell_compute_size(size, MISH_CFG_PREP_CACHE_SIZE);
+  layout.prep_slots = MISH_CFG_PREP_CACHE_SLOTS;
+  shell_split_map(&layout);
+  return shell_new_layout(buffer, &layout, s);
+}
+
+/* an arena that can allocate bytes, with its header */
+size_t shell_arena_bytes(size_t bytes) {
+  bytes += sizeof(mish_arena) + 1;
+  return bytes + util_compute_padding(bytes);
+}
+
+size_t shell_config_shares(const mish_shell_config* c) {
+  return c->arg_arena.share + c->str_arena.share + c->node_arena.share +
+         c->out_buffer.share + c->prep_slot.share;
+}
+
+/* the layout with every region at its minimum */
+void shell_config_layout(const mish_shell_config* c, shell_layout* layout) {
+  size_t out = c->out_buffer.bytes + 1; /* and the terminator */
+
+  layout->arg_arena = shell_arena_bytes(c->arg_arena.bytes);
+  layout->str_arena = shell_arena_bytes(c->str_arena.bytes);
+  layout->node_arena = shell_arena_bytes(c->node_arena.bytes);
+  layout->buckets = util_pow2_floor(c->buckets) * sizeof(mish_map_slot);
+  layout->out_buffer = out + util_compute_padding(out);
+  layout->prep_slots = c->prep_slots;
+  layout->prep_cache = c->prep_slots * (sizeof(mish_prepared) + shell_arena_bytes(c->prep_slot.bytes));
+}
+
+/* the smallest buffer mish_shell_new_config accepts for c,
+ * regions that only have a share get nothing with it
+ */
+size_t mish_shell_config_size(const mish_shell_config* c) {
+  shell_layout layout;
+  shell_config_layout(c, &layout);
+  return layout.arg_arena + layout.str_arena + layout.node_arena +
+         layout.buckets + layout.out_buffer + layout.prep_cache;
+}
+
+/* the part of what is left that goes to one region */
+size_t shell_config_extra(size_t left, size_t share, size_t shares) {
+  if (shares == 0) {
+    return 0;
+  }
+  return util_align_trim_down((left * share) / shares);
+}
+
+/* Makes a shell with its own layout instead of the MISH_CFG_* ratios,
+ * so shells of different proportions can live in one binary.
+ * Every region gets its bytes, and the memory beyond
+ * mish_shell_config_size is split between them by their shares.
+ */
+mish_error_code mish_shell_new_config(uint8_t* buffer, size_t size,
+                                      const mish_shell_config* c, mish_shell* s) {
+  shell_layout layout;
+  size_t min_size, left, shares;
+
+  if (c == NULL || s == NULL) {
+    return mish_error_contract_violation;
+  }
+  if (c->buckets == 0) {
+    return mish_error_bad_memory_config;
+  }
+  min_size = mish_shell_config_size(c);
+  if (size < min_size) {
+    return mish_error_arena_too_small;
+  }
+  left = size - min_size;
+  shares = shell_config_shares(c);
+
+  shell_config_layout(c, &layout);
+  layout.arg_arena += shell_config_extra(left, c->arg_arena.share, shares);
+  layout.str_arena += shell_config_extra(left, c->str_arena.share, shares);
+  layout.node_arena += shell_config_extra(left, c->node_arena.share, shares);
+  layout.out_buffer += shell_config_extra(left, c->out_buffer.share, shares);
+  if (c->prep_slots > 0) {
+    layout.prep_cache += c->prep_slots *
+      shell_config_extra(left / c->prep_slots, c->prep_slot.share, shares);
+  }
+  return shell_new_layout(buffer, &layout, s);
+}
+
+/* the ratios of the regions a session keeps for itself */
+#define SHELL_SESSION_GRANULARITY (MISH_CFG_ARG_ARENA_SIZE + \
+                                   MISH_CFG_OUT_BUFFER_SIZE + \
+                                   MISH_CFG_PREP_CACHE_SIZE)
+
+size_t shell_compute_session_size(size_t total_size, size_t ratio) {
+  return util_align_trim_down((total_size*ratio)/SHELL_SESSION_GRANULARITY);
+}
+
+/* A session is a shell that uses the environment of shared,
+ * so buffer only holds its arg arena, out buffer and command cache.
+ * With MISH_CFG_THREADS, each session can be used by its own thread.
+ * Static and registered commands are taken from shared,
+ * they should be set before sessions are made.
+ */
+mish_error_code mish_shell_new_session(uint8_t* buffer, size_t size, mish_shell* shared, mish_shell* s) {
+  uint8_t* start;
+  size_t region_size;
+  arena_RES res;
+
+  if (shared == NULL || s == NULL) {
+    return mish_error_contract_violation;
+  }
+  if (shell_assert_config() == false) {
+    return mish_error_bad_memory_config;
+  }
+  memset(&s->map, 0, sizeof(mish_map));
+  s->env = shared->env;
+  s->err.code = mish_error_none;
+
+  start = buffer;
+  region_size = shell_compute_session_size(size, MISH_CFG_ARG_ARENA_SIZE);
+  s->arg_arena = arena_new(start, region_size, &res);
+  if (res != arena_OK) {
+    return arena_map_res(res);
+  }
+
+  start += region_size;
+  region_size = shell_compute_session_size(size, MISH_CFG_OUT_BUFFER_SIZE);
+  s->out_buffer = (char*)start;
+  s->buff_size = region_size;
+  s->written = 0;
+  if (region_size == 0) {
+    return mish_error_arena_too_small;
+  }
+
+  start += region_size;
+  region_size = shell_compute_session_size(size, MISH_CFG_PREP_CACHE_SIZE);
+  prep_init(s, start, region_size, MISH_CFG_PREP_CACHE_SLOTS);
+
+  shell_init_state(s);
+  s->static_cmds = shared->static_cmds;
+  s->cmd_table = shared->cmd_table;
+  s->cmd_table_size = shared->cmd_table_size;
+#ifdef MISH_CFG_THREADS
+  s->active = 0;
+#endif
+  shell_add_session(s);
+  return mish_error_none;
+}
+
+/* a closed session must not be used again, the environment
+ * stays with the shell it was made from
+ */
+void mish_shell_close_session(mish_shell* s) {
+  if (s == NULL || s->env == &s->map) {
+    return;
+  }
+  shell_remove_session(s);
+}
+
+/* the first argument names the command */
+mish_error_code shell_resolve_cmd(mish_shell* s, mish_arg_list* list, mish_command* cmd) {
+  mish_argument arg;
+  mish_atom at;
+  bool ok;
+
+  if (list->argc == 0) {
+    return mish_error_expected_command;
+  }
+  arg = list->argv[0];
+  if (arg.kind != mish_ark_atom) {
+    return mish_error_internal_exp_atom;
+  }
+  at = arg.contents.atom;
+  ok = par_eval_variable(s, &at);
+  if (!ok) {
+    s->err.code = mish_error_variable_not_found;
+    return s->err.code;
+  }
+  if (at.kind != mish_atk_command) {
+    return mish_error_internal_exp_cmd;
+  }
+  *cmd = at.contents.cmd;
+  return mish_error_none;
+}
+
+/* last tells if this is the last stage of the line,
+ * which is the only one that streams its output
+ */
+mish_error_code shell_run_cmd(mish_shell* s, mish_command cmd, mish_arg_list* list, bool last) {
+  mish_error_code err;
+  uint32_t start;
+  struct mish__args_index index;
+  strcpy(s->out_buffer, "");
+  s->written = 0;
+  par_init_args(&s->results, NULL, 0);
+  s->streaming = last && s->sink != NULL;
+  /* built by the first mish_args_get, if any */
+  index.arena = s->arg_arena;
+  index.built = false;
+  list->index = &index;
+
+  start = stats_dispatched(s);
+  err = cmd(s, list);
+  list->index = NULL;
+  mish_shell_flush(s);
+  stats_ran(s, cmd, start);
+  s->streaming = false;
+  return err;
+}
+
+/* bytes a string of atom takes when it is packed with the results,
+ * 0 if it doesn't live in the arg arena
+ */
+/* all also packs the strings held by the environment */
+size_t shell_packed_str_size(mish_arena* a, mish_atom* atom, bool all) {
+  mish_str str = atom->contents.string;
+  size_t size;
+  if (atom->kind != mish_atk_string ||
+      (all == false && arena_owns(a, str.buffer) == false)) {
+    return 0;
+  }
+  size = str.length + 1; /* and the terminator */
+  return size + util_compute_padding(size);
+}
+
+void shell_pack_str(mish_arena* a, mish_atom* atom, bool all, uint8_t* dest, size_t* offset) {
+  size_t size = shell_packed_str_size(a, atom, all);
+  mish_str* str = &atom->contents.string;
+  if (size == 0) {
+    return;
+  }
+  memcpy(dest + *offset, str->buffer, str->length);
+  dest[*offset + str->length] = '\0';
+  str->buffer = (char*)(a->buffer + *offset);
+  *offset += size;
+}
+
+/* Once a stage ran, all the arg arena holds for the rest of the line
+ * are its results, so they are packed at its start and the stages of
+ * a long pipeline don't pile up. They are first copied to the end of
+ * the free space, since they may overlap where they go, and the copy
+ * is moved down in one go. Results stay where they are if there is
+ * no room for the copy. A fed line that waits for its next stage
+ * must not hold strings of the environment, so it packs them all.
+ */
+bool shell_settle_results(mish_shell* s, bool all) {
+  mish_arena* a = s->arg_arena;
+  mish_arg_list* r = &s->results;
+  size_t total = r->argc * sizeof(mish_argument);
+  size_t offset = total;
+  size_t i;
+  uint8_t* copy;
+  mish_argument arg;
+
+  for (i = 0; i < r->argc; i++) {
+    arg = r->argv[i];
+    if (arg.kind == mish_ark_pair) {
+      total += shell_packed_str_size(a, &arg.contents.pair.key, all);
+      total += shell_packed_str_size(a, &arg.contents.pair.value, all);
+    } else {
+      total += shell_packed_str_size(a, &arg.contents.atom, all);
+    }
+  }
+  if (total >= arena_available(a)) {
+    return false;
+  }
+
+  copy = a->buffer + a->buffsize - a->top - total;
+  for (i = 0; i < r->argc; i++) {
+    arg = r->argv[i];
+    if (arg.kind == mish_ark_pair) {
+      shell_pack_str(a, &arg.contents.pair.key, all, copy, &offset);
+      shell_pack_str(a, &arg.contents.pair.value, all, copy, &offset);
+    } else {
+      shell_pack_str(a, &arg.contents.atom, all, copy, &offset);
+    }
+    memcpy(copy + i * sizeof(mish_argument), &arg, sizeof(mish_argument));
+  }
+  memmove(a->buffer, copy, total);
+  a->allocated = total;
+  a->top = 0;
+  par_init_args(r, r->argc > 0 ? (mish_argument*)a->buffer : NULL, r->argc);
+  return true;
+}
+
+mish_error_code shell_eval_cmd(mish_shell* s, mish_arg_list* list, bool last) {
+  mish_command cmd;
+  mish_error_code err = shell_resolve_cmd(s, list, &cmd);
+  if (err != mish_error_none) {
+    return err;
+  }
+  return shell_run_cmd(s, cmd, list, last);
+}
+
+/* the results emitted by the previous command are appended
+ * to the arguments of the next one as they are. Commands that
+ * only print have their output parsed instead.
+ */
+bool shell_pipe_args(mish_shell* s, mish_arg_list* list) {
+  size_t argc = list->argc;
+  lex piped_lex;
+
+  if (s->results.argc > 0) {
+    if (par_append_args(s->arg_arena, list, &s->results) == false) {
+      s->err.code = mish_error_parser_out_of_memory;
+      return false;
+    }
+    return true;
+  }
+
+  piped_lex = lex_new(s->out_buffer, s->written);
+  if (lex_next(&piped_lex) == false) {
+    return true;
+  }
+  /* output that doesn't parse is not given to the next stage */
+  if (par_parse_pairs(&piped_lex, s, list) == false) {
+    list->argc = argc;
+    s->err.code = mish_error_none;
+  }
+  return true;
+}
+
+/* complete is false when the line goes on after the stages
+ * of p, so none of them is the last one
+ */
+mish_error_code shell_exec_prepared(mish_shell* s, mish_prepared* p, bool complete) {
+  mish_prep_stage* stage;
+  mish_arg_list list;
+  mish_command cmd;
+  mish_error_code err;
+  size_t generation;
+
+  for (stage = p->stages; stage != NULL; stage = stage->next) {
+    /* read before the lookup, a concurrent def only makes it stale */
+    generation = UTIL_LOAD(&s->env->generation);
+    stats_mark(s);
+    par_init_args(&list, NULL, 0);
+    if (prep_build_args(s, stage, &list) == false ||
+        shell_pipe_args(s, &list) == false) {
+      return s->err.code;
+    }
+
+    if (stage->cmd != NULL && stage->generation == generation) {
+      cmd = stage->cmd;
+    } else {
+      err = shell_resolve_cmd(s, &list, &cmd);
+      if (err != mish_error_none) {
+        return err;
+      }
+      if (stage->args->vars == 0) {
+        stage->cmd = cmd;
+        stage->generation = generation;
+      }
+    }
+
+    err = shell_run_cmd(s, cmd, &list, complete && stage->next == NULL);
+    if (err != mish_error_none) {
+      return err;
+    }
+    if (stage->next != NULL || complete == false) {
+      shell_settle_results(s, false);
+    }
+  }
+  return mish_error_none;
+}
+
+/* runs the stages of a line, l must be on its first lexeme */
+mish_error_code shell_eval_lex(mish_shell* s, lex* l) {
+  mish_arg_list cmd_list;
+  mish_error_code err;
+  uint32_t start;
+
+  while (true) {
+    start = stats_start(s);
+    par_init_args(&cmd_list, NULL, 0);
+    if (par_parse_pairs(l, s, &cmd_list) == false) {
+      return s->err.code;
+    }
+    if (cmd_list.argc == 0) {
+      s->err = lex_err(l, mish_error_expected_command);
+      return s->err.code;
+    }
+    stats_parsed(s, start);
+    if (shell_pipe_args(s, &cmd_list) == false) {
+      return s->err.code;
+    }
+
+    err = shell_eval_cmd(s, &cmd_list, l->lexeme.kind != lex_kind_pipe);
+    if (err != mish_error_none) {
+      return err;
+    }
+    if (l->lexeme.kind != lex_kind_pipe) {
+      return mish_error_none;
+    }
+    shell_settle_results(s, false);
+    if (stats_lex_next(s, l) == false) {
+      s->err = l->err;
+      return l->err.code;
+    }
+  }
+}
+
+/* evaluates the line without going through the cache */
+mish_error_code shell_eval_text(mish_shell* s, char* cmd, size_t cmd_size) {
+  lex input_lex;
+
+  input_lex = lex_new(cmd, cmd_size);
+  input_lex.validated = true;
+  if (stats_lex_next(s, &input_lex) == false) {
+    s->err = input_lex.err;
+    return input_lex.err.code;
+  }
+  return shell_eval_lex(s, &input_lex);
+}
+
+/* lines never hold atoms of the environment when they start,
+ * so this is where compaction is safe
+ */
+void shell_maybe_compact(mish_shell* s) {
+#ifdef MISH_CFG_THREADS
+  bool wanted = __atomic_load_n(&s->env->compact_wanted, __ATOMIC_RELAXED) != 0;
+#else
+  bool wanted = shell_compact_wanted(s->env);
+#endif
+  if (wanted) {
+    mish_shell_compact(s);
+  }
+}
+
+/* the arg arena is freed here, within a line it only
+ * keeps the results of the last stage, see shell_settle_results
+ */
+void shell_reset(mish_shell* s, char* cmd, size_t cmd_size) {
+  shell_maybe_compact(s);
+  arena_free_all(s->arg_arena);
+  strcpy(s->out_buffer, "");
+  s->written = 0;
+  par_init_args(&s->results, NULL, 0);
+  s->cmd = cmd;
+  s->cmd_size = cmd_size;
+  s->err.code = mish_error_none;
+  s->err.range.begin = 0;
+  s->err.range.end = 0;
+}
+
+/* Command = Atom {Pair}.
+ * Lines are looked up in the prepared command cache first, and
+ * compiled into a slot when they miss. Lines that can't be cached
+ * (because of syntax errors, or because they are too big for a slot)
+ * run what was compiled and go on from the text.
+ */
+mish_error_code shell_eval_cached(mish_shell* s, char* cmd, size_t cmd_size) {
+  mish_prepared* p;
+  mish_error_code err;
+  mish_error failed;
+  lex rest;
+
+  p = prep_find(s, cmd, cmd_size);
+  if (p != NULL) {
+    p->last_used = ++s->prep_clock;
+    return shell_exec_prepared(s, p, true);
+  }
+
+  if (utf8_validate(cmd, cmd_size, &s->err.range) == false) {
+    s->err.code = mish_error_bad_rune;
+    return s->err.code;
+  }
+
+  p = prep_victim(s);
+  if (p == NULL) {
+    return shell_eval_text(s, cmd, cmd_size);
+  }
+  err = prep_compile(s, p, cmd, cmd_size, &rest);
+  if (err == mish_error_none) {
+    p->last_used = ++s->prep_clock;
+    return shell_exec_prepared(s, p, true);
+  }
+  if (p->line == NULL) {
+    s->err.code = mish_error_none;
+    return shell_eval_text(s, cmd, cmd_size);
+  }
+
+  /* the line is parsed once: the stages that were compiled run
+   * as they would from the text, and the one that didn't fit
+   * in the slot goes on from where it starts
+   */
+  failed = s->err;
+  failed.code = err;
+  if (p->stages != NULL) {
+    err = shell_exec_prepared(s, p, false);
+    if (err != mish_error_none) {
+      return err;
+    }
+  }
+  if (failed.code != mish_error_parser_out_of_memory) {
+    s->err = failed;
+    return failed.code;
+  }
+  s->err.code = mish_error_none;
+  return shell_eval_lex(s, &rest);
+}
+
+mish_error_code mish_shell_eval(mish_shell* s, char* cmd, size_t cmd_size) {
+  mish_error_code err;
+
+  feed_reset(&s->feed);
+  shell_reset(s, cmd, cmd_size);
+  shell_enter_line(s);
+  err = shell_eval_cached(s, cmd, cmd_size);
+  shell_leave_line(s);
+  return err;
+}
+
+/* Runs every line of a script, each with its own lexer that stops
+ * at the newline, so a line can't run into the next one.
+ * Lines are not cached, each one only resets what the previous
+ * one used, and s->cmd is the line being run. cb (if any) gets every
+ * line that is not blank, with s->out_buffer holding its output;
+ * evaluation stops after a line fails if cb is NULL or returns false.
+ * Returns the error of the first line that failed.
+ */
+mish_error_code mish_shell_eval_script(mish_shell* s, char* script, size_t size,
+                                       mish_script_callback cb, void* user) {
+  mish_error_code err;
+  mish_error_code first_err = mish_error_none;
+  size_t line = 0;
+  size_t pos = 0;
+  size_t line_size;
+  char* end;
+  lex l;
+
+  feed_reset(&s->feed);
+  while (pos < size) {
+    line++;
+    end = (char*)memchr(script + pos, '\n', size - pos);
+    line_size = end != NULL ? (size_t)(end - script) + 1 - pos : size - pos;
+    shell_reset(s, script + pos, line_size);
+    pos += line_size;
+
+    if (utf8_validate(s->cmd, line_size, &s->err.range) == false) {
+      s->err.code = mish_error_bad_rune;
+      err = s->err.code;
+    } else {
+      l = lex_new(s->cmd, line_size);
+      l.validated = true;
+      if (stats_lex_next(s, &l) == false) {
+        s->err = l.err;
+        err = l.err.code;
+      } else if (l.lexeme.kind == lex_kind_eof || l.lexeme.kind == lex_kind_newline) {
+        continue;
+      } else {
+        shell_enter_line(s);
+        err = shell_eval_lex(s, &l);
+        shell_leave_line(s);
+      }
+    }
+
+    if (err != mish_error_none && first_err == mish_error_none) {
+      first_err = err;
+    }
+    if (cb == NULL ? err != mish_error_none : cb(s, line, err, user) == false) {
+      return first_err;
+    }
+  }
+  shell_reset(s, NULL, 0);
+  return first_err;
+}
+
+/* parses the line into a pinned slot of the prepared command cache,
+ * the slot is only reused after mish_shell_release_prepared
+ */
+mish_error_code mish_shell_prepare(mish_shell* s, char* cmd, size_t cmd_size, mish_prepared** out) {
+  mish_prepared* p;
+  mish_error_code err;
+  lex rest;
+
+  s->err.code = mish_error_none;
+  if (utf8_validate(cmd, cmd_size, &s->err.range) == false) {
+    s->err.code = mish_error_bad_rune;
+    return s->err.code;
+  }
+
+  p = prep_victim(s);
+  if (p == NULL) {
+    return mish_error_no_prepared_slot;
+  }
+  shell_enter_line(s);
+  err = prep_compile(s, p, cmd, cmd_size, &rest);
+  shell_leave_line(s);
+  if (err != mish_error_none) {
+    return err;
+  }
+  p->pinned = true;
+  *out = p;
+  return mish_error_none;
+}
+
+mish_error_code mish_shell_exec_prepared(mish_shell* s, mish_prepared* p) {
+  mish_error_code err;
+
+  feed_reset(&s->feed);
+  shell_reset(s, p->line, p->line_size);
+  p->last_used = ++s->prep_clock;
+  shell_enter_line(s);
+  err = shell_exec_prepared(s, p, true);
+  shell_leave_line(s);
+  return err;
+}
+
+void mish_shell_release_prepared(mish_shell* s, mish_prepared* p) {
+  if (s == NULL || p == NULL) {
+    return;
+  }
+  p->pinned = false;
+  p->used = false;
+}
+/* END: SHELL NAMESPACE */
+
+/* BEGIN: FEED NAMESPACE */
+/* Lines can also be fed as bytes arrive (ie: from a UART),
+ * so there is no need for a line buffer and most of the work
+ * is done before the newline lands.
+ *
+ * Bytes run through the DFA of the lexer one at a time and are
+ * appended to the line, which is kept right past the head of the
+ * arg arena and is what s->cmd points at. Once a token is complete,
+ * it is lexed again in place (which converts numbers and checks
+ * escapes) and pushed to a parser that mirrors par_parse_pairs.
+ * Strings of atoms are copied to the top of the arena, and the line
+ * is moved out of the way whenever something is allocated from the head.
+ * Each stage runs as soon as its '|' or newline is fed.
+ */
+#define FEED_LEX_STR lex_state_count /* inside a string literal */
+#define FEED_LEX_RUNE (lex_state_count + 1) /* a non-ASCII rune that can't start a token */
+
+typedef enum {
+  feed_par_arg,
+  feed_par_key_var,
+  feed_par_key,
+  feed_par_value,
+  feed_par_value_var
+} feed_par_state;
+
+void feed_reset(mish_feed* f) {
+  par_init_args(&f->args, NULL, 0);
+  f->line_pos = 0;
+  f->token_begin = 0;
+  f->lex_state = lex_state_start;
+  f->par_state = feed_par_arg;
+  f->vars = 0;
+  f->delimiter = '\0';
+  f->escaped = false;
+  f->started = false;
+  f->discard = false;
+  f->ended = false;
+}
+
+void feed_fail(mish_shell* s, mish_error_code code, size_t begin, size_t end) {
+  s->err.code = code;
+  s->err.range.begin = (int)begin;
+  s->err.range.end = (int)end;
+  s->feed.discard = true;
+}
+
+bool feed_push_byte(mish_shell* s, char c) {
+  mish_feed* f = &s->feed;
+  /* the string of the atom needs a terminator, keep a byte for it */
+  if (f->line_pos + 2 >= arena_available(s->arg_arena)) {
+    feed_fail(s, mish_error_parser_out_of_memory, f->token_begin, f->line_pos + 1);
+    return false;
+  }
+  s->cmd[f->line_pos++] = c;
+  s->cmd_size = f->line_pos;
+  return true;
+}
+
+/* the line is moved to the top of the arg arena while something is
+ * allocated from the head, top is what the arena had right after.
+ * Unless more was allocated from the top since, the line gives its
+ * place back as it returns to the head.
+ */
+bool feed_park_line(mish_shell* s, size_t* top) {
+  char* parked;
+  *top = s->arg_arena->top;
+  if (s->feed.line_pos == 0) {
+    return true;
+  }
+  parked = arena_alloc_top(s->arg_arena, s->feed.line_pos);
+  if (parked == NULL) {
+    return false;
+  }
+  memmove(parked, s->cmd, s->feed.line_pos);
+  s->cmd = parked;
+  *top = s->arg_arena->top;
+  return true;
+}
+
+bool feed_unpark_line(mish_shell* s, size_t top) {
+  mish_arena* a = s->arg_arena;
+  size_t size = s->feed.line_pos;
+
+  if (size > 0 && a->top == top) {
+    a->top -= size + util_compute_padding(size);
+  }
+  if (size + 2 >= arena_available(a)) {
+    return false;
+  }
+  memmove(arena_head(a), s->cmd, size);
+  s->cmd = arena_head(a);
+  return true;
+}
+
+/* strings of atoms go to the top of the arg arena, the line is
+ * claimed while they are copied there so the copy can't run over it
+ */
+bool feed_create_atom(mish_shell* s, lex* l, mish_atom* a) {
+  size_t mark = s->arg_arena->allocated;
+  bool ok;
+  if (arena_alloc(s->arg_arena, s->feed.line_pos) == NULL) {
+    s->err = lex_err(l, mish_error_parser_out_of_memory);
+    return false;
+  }
+  ok = par_create_atom(l, s, s->arg_arena, a);
+  s->arg_arena->allocated = mark;
+  return ok;
+}
+
+/* A fed line only runs while its bytes arrive, in between other
+ * sessions may clear or compact the environment. So the strings of
+ * variables are copied to the top of the arg arena, like the ones of
+ * fed atoms, and the line is only active while it reads the map.
+ */
+bool feed_own_atom(mish_shell* s, mish_atom* a) {
+  size_t mark = s->arg_arena->allocated;
+  mish_str str = a->contents.string;
+  char* copy = NULL;
+
+  if (a->kind != mish_atk_string || arena_owns(s->arg_arena, str.buffer)) {
+    return true;
+  }
+  if (arena_alloc(s->arg_arena, s->feed.line_pos) != NULL) {
+    copy = arena_alloc_top(s->arg_arena, str.length + 1);
+  }
+  s->arg_arena->allocated = mark;
+  if (copy == NULL) {
+    return false;
+  }
+  memcpy(copy, str.buffer, str.length);
+  copy[str.length] = '\0';
+  a->contents.string.buffer = copy;
+  return true;
+}
+
+bool feed_resolve_arg(mish_shell* s, mish_argument* arg) {
+  bool ok;
+
+  shell_enter_line(s);
+  if (par_resolve_arg(s, arg, s->feed.vars) == false) {
+    shell_leave_line(s);
+    s->feed.discard = true;
+    return false;
+  }
+  if (arg->kind == mish_ark_pair) {
+    ok = feed_own_atom(s, &arg->contents.pair.key) &&
+         feed_own_atom(s, &arg->contents.pair.value);
+  } else {
+    ok = feed_own_atom(s, &arg->contents.atom);
+  }
+  shell_leave_line(s);
+  if (ok == false) {
+    feed_fail(s, mish_error_parser_out_of_memory, s->feed.token_begin, s->feed.line_pos);
+  }
+  return ok;
 }
 
-bool mish_shell_add_str(mish_shell* s, char* name, char* str) {
-  return map_insert(&s->map, mish_atom_create_str(name), mish_atom_create_str(str));
-}
+bool feed_add_arg(mish_shell* s, mish_argument arg) {
+  mish_feed* f = &s->feed;
 
-bool mish_shell_add_exact_num(mish_shell* s, char* name, int64_t num) {
-  return map_insert(&s->map, mish_atom_create_str(name), mish_atom_create_num_exact(num));
-}
+  size_t top;
+  bool ok;
 
-bool mish_shell_add_inexact_num(mish_shell* s, char* name, double num) {
-  return map_insert(&s->map, mish_atom_create_str(name), mish_atom_create_num_inexact(num));
+  if (f->vars != 0 && feed_resolve_arg(s, &arg) == false) {
+    return false;
+  }
+  ok = feed_park_line(s, &top) &&
+       par_push_arg(s->arg_arena, &f->args, arg);
+  if (feed_unpark_line(s, top) == false || ok == false) {
+    feed_fail(s, mish_error_parser_out_of_memory, f->token_begin, f->line_pos);
+    return false;
+  }
+  return true;
 }
 
-bool shell_assert_config() {
-  size_t total = 0;
-  total += MISH_CFG_ARG_ARENA_SIZE;
-  total += MISH_CFG_STR_ARENA_SIZE;
-  total += MISH_CFG_NODE_ARENA_SIZE;
-  total += MISH_CFG_HASHMAP_BUCKET_ARRAY_SIZE;
-  total += MISH_CFG_OUT_BUFFER_SIZE;
-  return total == MISH_CFG_GRANULARITY;
-}
+void feed_run_stage(mish_shell* s, bool last) {
+  mish_feed* f = &s->feed;
+  mish_error_code err;
+  size_t top;
 
-size_t shell_compute_size(size_t total_size, size_t ratio) {
-  size_t region_size = util_align_trim_down((total_size*ratio)/MISH_CFG_GRANULARITY);
-  return region_size;
+  if (f->args.argc == 0) {
+    feed_fail(s, mish_error_expected_command, f->token_begin, f->line_pos);
+    return;
+  }
+  if (feed_park_line(s, &top) == false) {
+    feed_fail(s, mish_error_parser_out_of_memory, f->token_begin, f->line_pos);
+    return;
+  }
+  /* tokens are lexed as their bytes arrive, only dispatch is timed */
+  shell_enter_line(s);
+  stats_mark(s);
+  if (shell_pipe_args(s, &f->args) == false) {
+    err = s->err.code;
+  } else {
+    err = shell_eval_cmd(s, &f->args, last);
+  }
+  par_init_args(&f->args, NULL, 0);
+  /* the parked line is above anything settling moves */
+  if (last == false && err == mish_error_none && shell_settle_results(s, true) == false) {
+    err = mish_error_parser_out_of_memory;
+  }
+  shell_leave_line(s);
+  if (last == false && feed_unpark_line(s, top) == false && err == mish_error_none) {
+    feed_fail(s, mish_error_parser_out_of_memory, f->token_begin, f->line_pos);
+    return;
+  }
+  if (err != mish_error_none) {
+    s->err.code = err;
+    f->discard = true;
+  }
 }
 
-mish_error_code mish_shell_new(uint8_t* buffer, size_t size, mish_shell* s) {
-  uint8_t* start;
-  size_t region_size;
-  arena_RES res;
-  mish_error_code err = mish_error_none;
-  s->err.code = mish_error_none;
-
-  if (shell_assert_config() == false) {
-    return mish_error_bad_memory_config;
+/* Pairs = {['$'] Atom [':' ['$'] Atom]}, one token at a time */
+void feed_parse(mish_shell* s, lex* l) {
+  mish_feed* f = &s->feed;
+  mish_argument arg;
+  mish_atom at;
+  bool made = false;
+  bool is_atom = l->lexeme.kind == lex_kind_str ||
+                 l->lexeme.kind == lex_kind_id ||
+                 l->lexeme.kind == lex_kind_num;
+
+  if (f->par_state == feed_par_key && l->lexeme.kind != lex_kind_colon) {
+    /* the argument takes the place of the token, so its atom is made first */
+    if (is_atom) {
+      made = feed_create_atom(s, l, &at);
+      is_atom = made;
+    }
+    arg.kind = mish_ark_atom;
+    arg.contents.atom = f->key;
+    f->par_state = feed_par_arg;
+    if (feed_add_arg(s, arg) == false) {
+      return;
+    }
   }
 
-  start = buffer;
-  region_size = shell_compute_size(size, MISH_CFG_ARG_ARENA_SIZE);
-  s->arg_arena = arena_new(start, region_size, &res);
-  if (res != arena_OK) {
-    return arena_map_res(res);
+  switch (f->par_state) {
+    case feed_par_arg:
+      if (l->lexeme.kind == lex_kind_pipe || l->lexeme.kind == lex_kind_newline) {
+        feed_run_stage(s, l->lexeme.kind == lex_kind_newline);
+        return;
+      }
+      if (l->lexeme.kind == lex_kind_dollar) {
+        f->vars = MISH_PREP_VAR_KEY;
+        f->par_state = feed_par_key_var;
+        return;
+      }
+      f->vars = 0;
+      /* fall through */
+    case feed_par_key_var:
+      if (is_atom == false || (made == false && feed_create_atom(s, l, &at) == false)) {
+        break;
+      }
+      f->key = at;
+      f->par_state = feed_par_key;
+      return;
+    case feed_par_key:
+      /* only a colon gets here */
+      f->par_state = feed_par_value;
+      return;
+    case feed_par_value:
+      if (l->lexeme.kind == lex_kind_pipe || l->lexeme.kind == lex_kind_newline) {
+        s->err.code = mish_error_invalid_syntax;
+        break;
+      }
+      if (l->lexeme.kind == lex_kind_dollar) {
+        f->vars |= MISH_PREP_VAR_VALUE;
+        f->par_state = feed_par_value_var;
+        return;
+      }
+      /* fall through */
+    case feed_par_value_var:
+      if (is_atom == false || feed_create_atom(s, l, &at) == false) {
+        break;
+      }
+      arg.kind = mish_ark_pair;
+      arg.contents.pair.key = f->key;
+      arg.contents.pair.value = at;
+      f->par_state = feed_par_arg;
+      feed_add_arg(s, arg);
+      return;
+    default:
+      break;
   }
 
-  start += region_size;
-  region_size = shell_compute_size(size, MISH_CFG_STR_ARENA_SIZE);
-  s->map.str_arena = arena_new(start, region_size, &res);
-  if (res != arena_OK) {
-    return arena_map_res(res);
+  /* same error as the text parser gives */
+  if (s->err.code == mish_error_none) {
+    s->err.code = mish_error_internal_parser;
   }
+  s->err.range.begin = (int)(f->token_begin + l->lexeme.begin);
+  s->err.range.end = (int)(f->token_begin + l->lexeme.end);
+  f->discard = true;
+}
 
-  start += region_size;
-  region_size = shell_compute_size(size, MISH_CFG_NODE_ARENA_SIZE);
-  s->map.node_arena = arena_new(start, region_size, &res);
-  if (res != arena_OK) {
-    return arena_map_res(res);
+void feed_end_line(mish_shell* s, mish_feed_callback cb, void* user) {
+  arena_free_all(s->arg_arena);
+  feed_reset(&s->feed);
+  if (cb != NULL) {
+    cb(s, s->err.code, user);
   }
+}
 
-  start += region_size;
-  region_size = shell_compute_size(size, MISH_CFG_HASHMAP_BUCKET_ARRAY_SIZE);
-  s->map.buckets = (mish_atom_list*)start;
-  s->map.num_buckets = region_size / sizeof(mish_atom_list);
+/* the token is the end of the line */
+void feed_token(mish_shell* s, mish_feed_callback cb, void* user) {
+  mish_feed* f = &s->feed;
+  lex l;
+  mish_range bad;
 
-  start += region_size;
-  region_size = shell_compute_size(size, MISH_CFG_OUT_BUFFER_SIZE);
-  s->out_buffer = (char*)start;
-  s->buff_size = region_size;
-  s->written = 0;
+  l = lex_new(s->cmd + f->token_begin, f->line_pos - f->token_begin);
+  f->lex_state = lex_state_start;
 
-  mish_builtin_hard_clear(s, NULL);
+  if (utf8_validate(l.input, l.input_size, &bad) == false) {
+    feed_fail(s, mish_error_bad_rune, f->token_begin + bad.begin, f->token_begin + bad.end);
+    return;
+  }
+  l.validated = true;
+  if (lex_next(&l) == false) {
+    feed_fail(s, l.err.code, f->token_begin + l.err.range.begin, f->token_begin + l.err.range.end);
+    return;
+  }
 
-  return err;
+  feed_parse(s, &l);
+  if (l.lexeme.kind == lex_kind_newline) {
+    feed_end_line(s, cb, user);
+  }
 }
 
-mish_error_code shell_eval_cmd(mish_shell* s, mish_arg_list* list) {
-  mish_argument arg;
-  mish_atom at;
-  bool ok;
-  
-  arg = list->arg;
-  if (arg.kind != mish_ark_atom) {
-    return mish_error_internal_exp_atom;
-  }
-  at = arg.contents.atom;
-  ok = par_eval_variable(s, &at);
-  if (!ok) {
-    s->err.code = mish_error_variable_not_found;
-    return false;
+/* like the text path, a rune that can't start a token is
+ * only reported once its bytes are in: as a bad rune if they
+ * don't decode, else as an unrecognized one covering all of them
+ */
+void feed_check_rune(mish_shell* s) {
+  mish_feed* f = &s->feed;
+  size_t size = f->line_pos - f->token_begin;
+  utf8_rune r;
+
+  if (size < utf8_lead_size(s->cmd[f->token_begin])) {
+    return;
   }
-  if (at.kind != mish_atk_command) {
-    return mish_error_internal_exp_cmd;
+  if (utf8_decode(s->cmd + f->token_begin, size, &r) == 0) {
+    feed_fail(s, mish_error_bad_rune, f->token_begin, f->token_begin + 1);
+  } else {
+    feed_fail(s, mish_error_unrecognized_rune, f->token_begin, f->line_pos);
   }
+}
 
-  strcpy(s->out_buffer, "");
-  s->written = 0;
-
-  return (at.contents.cmd)(s, list);
+/* single rune tokens are complete as soon as they are fed,
+ * this is what makes a newline run the line right away
+ */
+bool feed_is_single_rune(uint8_t state) {
+  return state == lex_state_colon  ||
+         state == lex_state_dollar ||
+         state == lex_state_pipe   ||
+         state == lex_state_newline;
 }
 
-/* Command = Atom {Pair}.*/
-mish_error_code mish_shell_eval(mish_shell* s, char* cmd, size_t cmd_size) {
-  mish_arg_list* cmd_list;
-  mish_arg_list* piped_list;
-  lex input_lex;
-  lex piped_lex;
-  mish_error_code err;
-  bool ok;
+void feed_byte(mish_shell* s, char c, mish_feed_callback cb, void* user) {
+  mish_feed* f = &s->feed;
+  lex_class cls = (lex_class)lex_char_class[(uint8_t)c];
+  uint8_t next;
 
-  arena_free_all(s->arg_arena);
-  strcpy(s->out_buffer, "");
-  s->written = 0;
-  s->cmd = cmd;
-  s->cmd_size = cmd_size;
+  if (f->ended) {
+    f->ended = cls != lex_class_newline;
+    return;
+  }
+  if (f->started == false) {
+    shell_reset(s, arena_head(s->arg_arena), 0);
+    f->started = true;
+  }
 
-  input_lex = lex_new(cmd, cmd_size);
+  while (true) {
+    if (f->discard) {
+      if (cls == lex_class_newline) {
+        feed_end_line(s, cb, user);
+      }
+      return;
+    }
 
-  do {
-    ok = lex_next(&input_lex);
-    if (!ok) {
-      return input_lex.err.code;
+    if (f->lex_state == FEED_LEX_RUNE) {
+      if ((c & TOP_BITS(2)) != TOP_BITS(1)) {
+        /* the rune ends early, c is read again as the line is skipped */
+        feed_fail(s, mish_error_bad_rune, f->token_begin, f->token_begin + 1);
+        continue;
+      }
+      if (feed_push_byte(s, c)) {
+        feed_check_rune(s);
+      }
+      return;
     }
 
-    cmd_list = par_parse_pairs(&input_lex, s);
-    if (cmd_list == NULL) {
-      if (s->err.code != mish_error_none) {
-        return s->err.code;
+    if (f->lex_state == FEED_LEX_STR) {
+      if (cls == lex_class_newline) {
+        /* a string ends with its line, as it does in scripts,
+         * and c is read again to end the line once it failed
+         */
+        if (feed_push_byte(s, c)) {
+          feed_token(s, cb, user);
+        }
+        continue;
+      }
+      if (feed_push_byte(s, c) == false) {
+        return;
       }
-      return mish_error_expected_command;
+      if (f->escaped) {
+        f->escaped = false;
+      } else if (c == '\\') {
+        f->escaped = true;
+      } else if (c == f->delimiter) {
+        feed_token(s, cb, user);
+      }
+      return;
     }
 
-    piped_lex = lex_new(s->out_buffer, s->written);
-    ok = lex_next(&piped_lex);
-    if (!ok) {
-      return input_lex.err.code;
+    if (f->lex_state == lex_state_start) {
+      if (cls == lex_class_space) {
+        feed_push_byte(s, c);
+        return;
+      }
+      if (cls == lex_class_eof) {
+        /* the text path stops at a '\0' as if the line ended there */
+        feed_byte(s, '\n', cb, user);
+        s->feed.ended = true;
+        return;
+      }
+      f->token_begin = f->line_pos;
+      if (cls == lex_class_dquote || cls == lex_class_squote) {
+        if (feed_push_byte(s, c) == false) {
+          continue;
+        }
+        f->lex_state = FEED_LEX_STR;
+        f->delimiter = c;
+        return;
+      }
     }
-    piped_list = par_parse_pairs(&piped_lex, s);
-    if (piped_list != NULL) {
-      util_append_list(cmd_list, piped_list);
+
+    next = lex_transition[f->lex_state][cls];
+    if (next == lex_state_done) {
+      if (f->lex_state == lex_state_start && cls == lex_class_utf8) {
+        if (feed_push_byte(s, c) == false) {
+          continue;
+        }
+        f->lex_state = FEED_LEX_RUNE;
+        feed_check_rune(s);
+        return;
+      }
+      if (f->lex_state == lex_state_start) {
+        feed_fail(s, mish_error_unrecognized_rune, f->line_pos, f->line_pos + 1);
+        continue;
+      }
+      /* c ends the token, and then starts the next one */
+      feed_token(s, cb, user);
+      continue;
     }
 
-    err = shell_eval_cmd(s, cmd_list);
-    if (err != mish_error_none) {
-      return err;
+    if (feed_push_byte(s, c) == false) {
+      continue;
     }
-    arena_free_all(s->arg_arena);
-  } while (input_lex.lexeme.kind == lex_kind_pipe);
+    f->lex_state = next;
+    if (feed_is_single_rune(next)) {
+      feed_token(s, cb, user);
+    }
+    return;
+  }
+}
 
+/* Feeds bytes of one or more lines, a line may be split across calls.
+ * cb is called once every line has run, with its result.
+ * While a line runs, s->cmd holds the part of it that was fed so far.
+ * A '\0' ends the line, like it does for mish_shell_eval, and the rest
+ * of it up to the newline is ignored. A newline also ends a string.
+ */
+mish_error_code mish_shell_feed(mish_shell* s, const char* bytes, size_t size,
+                                mish_feed_callback cb, void* user) {
+  size_t i;
+  if (s == NULL || (bytes == NULL && size != 0)) {
+    return mish_error_contract_violation;
+  }
+  for (i = 0; i < size; i++) {
+    feed_byte(s, bytes[i], cb, user);
+  }
   return mish_error_none;
 }
-/* END: SHELL NAMESPACE */
+/* END: FEED NAMESPACE */
 
 /* BEGIN: ARGVAL NAMESPACE*/
 /* definition of functions related to argument validation */
@@ -1548,27 +5280,187 @@ mish_error_code mish_shell_eval(mish_shell* s, char* cmd, size_t cmd_size) {
  * command.
  */
 bool mish_argval_only_pairs(mish_arg_list* args) {
-  mish_arg_list* curr;
+  size_t i;
   if (args == NULL) {
     return true; /* if there are no arguments, then all of them are pairs :) */
   }
   /* jumping the command */
-  curr = args->next;
-  while (curr != NULL) {
-    if (curr->arg.kind != mish_ark_pair) {
+  for (i = 1; i < args->argc; i++) {
+    if (args->argv[i].kind != mish_ark_pair) {
       return false;
     }
-    curr = curr->next;
   }
   return true;
 }
 
+/* the first argument after the command, NULL if there is none */
+mish_argument* mish_args_first(mish_arg_list* args) {
+  if (args == NULL || args->argc < 2) {
+    return NULL;
+  }
+  return &args->argv[1];
+}
+
+/* the argument after a, NULL once there are no more */
+mish_argument* mish_args_next(mish_arg_list* args, mish_argument* a) {
+  if (a + 1 >= args->argv + args->argc) {
+    return NULL;
+  }
+  return a + 1;
+}
+
+/* the value of the first pair with the given string key */
+bool mish_args_get(mish_arg_list* args, const char* key, mish_atom* out) {
+  size_t i, length, mask;
+  uint16_t* slots;
+  if (args == NULL || key == NULL) {
+    return false;
+  }
+  length = strlen(key);
+  if (args->index != NULL && args->index->built == false) {
+    par_index_args(args);
+  }
+  if (args->index != NULL && args->index->slots != NULL) {
+    slots = args->index->slots;
+    mask = args->index->mask;
+    for (i = par_hash_key(key, length) & mask; slots[i] != 0; i = (i + 1) & mask) {
+      if (par_is_key(&args->argv[slots[i]], key, length)) {
+        *out = args->argv[slots[i]].contents.pair.value;
+        return true;
+      }
+    }
+    return false;
+  }
+  for (i = 1; i < args->argc; i++) {
+    if (par_is_key(&args->argv[i], key, length)) {
+      *out = args->argv[i].contents.pair.value;
+      return true;
+    }
+  }
+  return false;
+}
+
+/* the keyed field named by key, or num_fields */
+size_t argval_find_field(const mish_schema* schema, mish_atom key) {
+  const mish_field* f;
+  size_t i;
+  if (key.kind != mish_atk_string) {
+    return schema->num_fields;
+  }
+  for (i = 0; i < schema->num_fields; i++) {
+    f = &schema->fields[i];
+    if (f->key.buffer != NULL &&
+        f->key.length == key.contents.string.length &&
+        memcmp(f->key.buffer, key.contents.string.buffer, f->key.length) == 0) {
+      return i;
+    }
+  }
+  return schema->num_fields;
+}
+
+/* the positional field after the ones that were taken */
+size_t argval_next_positional(const mish_schema* schema, size_t from) {
+  while (from < schema->num_fields && schema->fields[from].key.buffer != NULL) {
+    from++;
+  }
+  return from;
+}
+
+bool argval_store(const mish_field* f, mish_atom a, void* out) {
+  uint8_t* dest = (uint8_t*)out + f->offset;
+  double d;
+  switch (f->kind) {
+  case mish_fk_exact:
+    if (a.kind != mish_atk_exact_num) {
+      return false;
+    }
+    memcpy(dest, &a.contents.exact_num, sizeof(uint64_t));
+    return true;
+  case mish_fk_inexact:
+    if (a.kind == mish_atk_exact_num) {
+      d = (double)a.contents.exact_num;
+    } else if (a.kind == mish_atk_inexact_num) {
+      d = a.contents.inexact_num;
+    } else {
+      return false;
+    }
+    memcpy(dest, &d, sizeof(double));
+    return true;
+  case mish_fk_str:
+    if (a.kind != mish_atk_string) {
+      return false;
+    }
+    memcpy(dest, &a.contents.string, sizeof(mish_str));
+    return true;
+  case mish_fk_atom:
+    memcpy(dest, &a, sizeof(mish_atom));
+    return true;
+  }
+  return false;
+}
+
+/* Checks the arguments of a command against schema and fills the
+ * struct out with them in a single pass. Fields that are not given
+ * keep what out had, so defaults are set before the call.
+ * Strings point into the arguments, they only live as long as the line.
+ * where (if not NULL) tells which argument or field failed.
+ */
+mish_error_code mish_args_extract(mish_arg_list* args, const mish_schema* schema,
+                                  void* out, mish_args_error* where) {
+  mish_args_error dummy;
+  mish_argument* arg;
+  mish_atom value;
+  uint32_t seen = 0;
+  size_t positional = 0;
+  size_t i;
+
+  if (where == NULL) {
+    where = &dummy;
+  }
+  where->arg = 0;
+  where->field = NULL;
+  if (schema == NULL || out == NULL || schema->num_fields > 32) {
+    return mish_error_contract_violation;
+  }
+
+  for (arg = mish_args_first(args); arg != NULL; arg = mish_args_next(args, arg)) {
+    where->arg++;
+    if (arg->kind == mish_ark_atom) {
+      positional = argval_next_positional(schema, positional);
+      i = positional++;
+      value = arg->contents.atom;
+    } else {
+      i = argval_find_field(schema, arg->contents.pair.key);
+      value = arg->contents.pair.value;
+    }
+    where->field = i < schema->num_fields ? &schema->fields[i] : NULL;
+    /* a field can only be given once */
+    if (where->field == NULL || (seen & (1u << i)) != 0) {
+      return mish_error_unexpected_arg;
+    }
+    if (argval_store(where->field, value, out) == false) {
+      return mish_error_bad_arg_type;
+    }
+    seen |= 1u << i;
+  }
+
+  where->arg = 0;
+  for (i = 0; i < schema->num_fields; i++) {
+    if (schema->fields[i].required && (seen & (1u << i)) == 0) {
+      where->field = &schema->fields[i];
+      return mish_error_missing_arg;
+    }
+  }
+  where->field = NULL;
+  return mish_error_none;
+}
+
 /* END: ARGVAL NAMESPACE*/
 
 /* BEGIN: BUILTIN NAMESPACE */
 mish_error_code mish_builtin_def(mish_shell* s, mish_arg_list* args) {
-  mish_arg_list* curr;
   mish_pair p;
+  size_t i;
   bool ok;
 
   if (args == NULL) {
@@ -1580,86 +5472,174 @@ mish_error_code mish_builtin_def(mish_shell* s, mish_arg_list* args) {
     return mish_error_contract_violation;
   }
 
-  curr = args->next;
-  while (curr != NULL) {
-    p = curr->arg.contents.pair;
+  for (i = 1; i < args->argc; i++) {
+    p = args->argv[i].contents.pair;
 
-    ok = map_insert(&s->map, p.key, p.value);
+    /* static commands would shadow the new value */
+    if (p.key.kind == mish_atk_string &&
+        map_static_find(s->static_cmds, p.key.contents.string) != NULL) {
+      return mish_error_insert_failed;
+    }
+    shell_lock(s);
+    ok = map_set(s->env, p.key, p.value);
+    shell_unlock(s);
     if (!ok) {
       return mish_error_insert_failed;
     }
-    
-    curr = curr->next;
   }
   return mish_error_none;
 }
 
 mish_error_code mish_builtin_echo(mish_shell* s, mish_arg_list* args) {
-  mish_arg_list* curr;
+  size_t i;
 
   if (args == NULL) {
     return mish_error_internal;
   }
 
-  curr = args->next;
-  while (curr != NULL) {
-    mish_shell_write_arg(s, curr->arg);
+  if (mish_shell_emit_list(s, args) == false) {
+    return mish_error_parser_out_of_memory;
+  }
+  for (i = 1; i < args->argc; i++) {
+    mish_shell_write_arg(s, args->argv[i]);
     mish_shell_write_strlit(s, " ");
-    curr = curr->next;
   }
   mish_shell_write_strlit(s, "\r\n");
-  mish_shell_write_char(s, '\0');
   return mish_error_none;
 }
 
 /* resets the environment to the default state */
 mish_error_code mish_builtin_hard_clear(mish_shell* s, mish_arg_list* args) {
+  bool was_active;
   if (args == NULL) {
     /* avoid warning */
   }
-  map_clear(&s->map);
+  was_active = shell_stop_world(s);
+  map_clear(s->env);
+  shell_resume_world(s, was_active);
   return mish_error_none;
 }
 
-mish_error_code mish_builtin_available_env_memory(mish_shell* s, mish_arg_list* args) {
-  size_t available_mem;
-  size_t cmd_len;
+/* the arguments of the command are not used after compacting,
+ * even if they were resolved from the environment
+ */
+mish_error_code mish_builtin_compact(mish_shell* s, mish_arg_list* args) {
   if (args == NULL) {
     /* avoid warning */
   }
+  mish_shell_compact(s);
+  return mish_error_none;
+}
 
-  available_mem = mish_shell_available_env_memory(s);
-  cmd_len = snprintf(s->out_buffer, s->buff_size, "available env memory: %lu\r\n", (long unsigned int)available_mem);
-
-  if (cmd_len == 0) {
-  	return mish_error_cmd_failure;
+mish_error_code mish_builtin_available_env_memory(mish_shell* s, mish_arg_list* args) {
+  char num[FMT_INT_SIZE];
+  size_t len;
+  if (args == NULL) {
+    /* avoid warning */
   }
-  s->written += cmd_len;
+
+  len = fmt_u64(num, mish_shell_available_env_memory(s), 10);
+  mish_shell_write_strlit(s, "available env memory: ");
+  shell_write(s, num, len);
+  mish_shell_write_strlit(s, "\r\n");
   return mish_error_none;
 }
 
 mish_error_code mish_builtin_print_env(mish_shell* s, mish_arg_list* args) {
   size_t i;
-  mish_atom_list item;
-  mish_list_node* node;
+  mish_map_entry* entry;
   mish_pair p;
   if (args == NULL) {
     /* avoid warning */
   }
-  for (i = 0; i < s->map.num_buckets; i++) {
-	item = s->map.buckets[i];
-	node = item.head;
-	while (node != NULL) {
-	  p.key = node->key;
-	  p.value = node->value;
-	  mish_shell_write_pair(s, p);
-	  mish_shell_write_strlit(s, " ");
-	  node = node->next;
-	}
+  if (s->static_cmds != NULL) {
+    for (i = 0; i < s->static_cmds->size; i++) {
+      if (s->static_cmds->cmds[i].cmd == NULL) {
+        continue;
+      }
+      p.key.kind = mish_atk_string;
+      p.key.contents.string = s->static_cmds->cmds[i].name;
+      p.value = mish_atom_create_cmd(s->static_cmds->cmds[i].cmd);
+      mish_shell_write_pair(s, p);
+      mish_shell_write_strlit(s, " ");
+    }
+  }
+  for (i = 0; i < s->env->capacity; i++) {
+    entry = map_slot_entry(s->env, &s->env->slots[i]);
+    if (entry == NULL) {
+      continue;
+    }
+    p.key = entry->key;
+    p.value = entry->value;
+    mish_shell_write_pair(s, p);
+    mish_shell_write_strlit(s, " ");
+  }
+  mish_shell_write_strlit(s, "\r\n");
+  return mish_error_none;
+}
+
+#ifdef MISH_CFG_STATS
+void builtin_write_u64(mish_shell* s, char* label, uint64_t v) {
+  char num[FMT_INT_SIZE];
+  mish_shell_write_strlit(s, label);
+  shell_write(s, num, fmt_u64(num, v, 10));
+}
+
+/* bucket i is printed as <2^i, the last one as >=2^(i-1) */
+void builtin_write_stat(mish_shell* s, mish_stat* st) {
+  size_t i;
+  builtin_write_u64(s, " calls:", st->calls);
+  builtin_write_u64(s, " total:", st->total);
+  builtin_write_u64(s, " max:", st->max);
+  for (i = 0; i < MISH_CFG_STATS_BUCKETS; i++) {
+    if (st->hist[i] == 0) {
+      continue;
+    }
+    if (i == MISH_CFG_STATS_BUCKETS - 1) {
+      builtin_write_u64(s, " >=", (uint64_t)1 << (i - 1));
+    } else {
+      builtin_write_u64(s, " <", (uint64_t)1 << i);
+    }
+    builtin_write_u64(s, ":", st->hist[i]);
   }
   mish_shell_write_strlit(s, "\r\n");
-  mish_shell_write_char(s, '\0');
+}
+
+/* one line per phase and per command, ticks are those of the clock */
+mish_error_code mish_builtin_stats(mish_shell* s, mish_arg_list* args) {
+  mish_stats* st = &s->stats;
+  mish_atom name;
+  mish_str arg;
+  size_t i;
+
+  if (args != NULL && args->argc > 1) {
+    if (args->argv[1].kind != mish_ark_atom ||
+        args->argv[1].contents.atom.kind != mish_atk_string) {
+      return mish_error_contract_violation;
+    }
+    arg = args->argv[1].contents.atom.contents.string;
+    if (arg.length != 5 || memcmp(arg.buffer, "reset", 5) != 0) {
+      return mish_error_contract_violation;
+    }
+    mish_shell_reset_stats(s);
+    return mish_error_none;
+  }
+  mish_shell_write_strlit(s, "lex");
+  builtin_write_stat(s, &st->lex);
+  mish_shell_write_strlit(s, "parse");
+  builtin_write_stat(s, &st->parse);
+  mish_shell_write_strlit(s, "dispatch");
+  builtin_write_stat(s, &st->dispatch);
+  for (i = 0; i < st->num_cmds; i++) {
+    if (stats_cmd_name(s, st->cmds[i].cmd, &name)) {
+      mish_shell_write_atom(s, name);
+    } else {
+      mish_shell_write_atom(s, mish_atom_create_cmd(st->cmds[i].cmd));
+    }
+    builtin_write_stat(s, &st->cmds[i].stat);
+  }
   return mish_error_none;
 }
+#endif
 /* END: BUILTIN NAMESPACE */
 
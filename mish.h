@@ -2,6 +2,9 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
+#ifdef MISH_CFG_THREADS
+#include <pthread.h>
+#endif
 
 /* All public symbols start with "mish",
  * private names will omit this. */
@@ -20,6 +23,52 @@
 #define MISH_CFG_HASHMAP_BUCKET_ARRAY_SIZE 8
 #define MISH_CFG_OUT_BUFFER_SIZE           24
 #define MISH_CFG_STR_ARENA_SIZE            48
+#define MISH_CFG_PREP_CACHE_SIZE           0
+
+/* The prepared command cache is opt-in: give it a share of
+ * MISH_CFG_GRANULARITY by taking it from the regions above
+ * (tools/tune-cfg prints a split), and it is split evenly
+ * between this many lines. Shells made with mish_shell_new_config
+ * have their own.
+ */
+#define MISH_CFG_PREP_CACHE_SLOTS          2
+
+/* Overwritten variables stay in the environment until it is compacted,
+ * lines compact it when less than this many parts of
+ * MISH_CFG_GRANULARITY of the node or string arena are free.
+ */
+#define MISH_CFG_COMPACT_THRESHOLD         16
+
+/* Commands given more than this many pairs get an index of
+ * their keys in the arg arena, which mish_args_get looks them up in.
+ */
+#define MISH_CFG_ARGS_INDEX_PAIRS          8
+
+/* Hosts with SSE2 scan strings 16 bytes at a time, building
+ * mish.c with -DMISH_CFG_NO_SIMD keeps only the portable
+ * word-at-a-time scanner (tests/run checks both).
+ */
+
+/* Define MISH_CFG_THREADS (and link with pthreads) to let shells
+ * share an environment across threads, see mish_shell_new_session.
+ */
+
+/* Define MISH_CFG_STATS to count the calls and ticks of every command
+ * and of the lex, parse and dispatch phases, see mish_shell_set_clock.
+ * Up to MISH_CFG_STATS_CMDS commands are tracked, each with a histogram
+ * of MISH_CFG_STATS_BUCKETS power of two buckets.
+ */
+#define MISH_CFG_STATS_CMDS                16
+#define MISH_CFG_STATS_BUCKETS             20
+
+/* Inexact numbers are parsed with Eisel-Lemire for exponents near 0,
+ * its table takes 1.5KB. Define MISH_CFG_NO_FAST_FLOAT to leave the
+ * table out and use the slower exact algorithm instead.
+ */
+
+/* Atoms are printed by a small built-in formatter. Define
+ * MISH_CFG_DEBUG to build lex_print_lexeme, the only user of printf.
+ */
 
 /* END: CONFIG*/
 typedef enum {
@@ -41,7 +90,14 @@ typedef enum {
   mish_error_internal_exp_atom,  /* 15 */
   mish_error_internal_exp_cmd,
   mish_error_bad_memory_config,
-  mish_error_cmd_failure
+  mish_error_cmd_failure,
+  mish_error_no_prepared_slot,
+  mish_error_unregistered_cmd, /* 20 */
+  mish_error_snapshot_too_small,
+  mish_error_bad_snapshot,
+  mish_error_missing_arg,
+  mish_error_bad_arg_type, /* 25 */
+  mish_error_unexpected_arg
 } mish_error_code;
 
 
@@ -70,12 +126,59 @@ struct mish__arg_list;
 struct mish__shell;
 typedef mish_error_code (*mish_command)(struct mish__shell* s, struct mish__arg_list* args);
 
+#ifdef MISH_CFG_STATS
+/* returns a free running tick count, such as a cycle counter,
+ * differences are taken modulo 2^32
+ */
+typedef uint32_t (*mish_clock)(void);
+
+/* hist[i] counts the times of bitlength i, the last bucket
+ * also counts every longer time
+ */
+typedef struct {
+  uint32_t calls;
+  uint32_t max;
+  uint64_t total;
+  uint32_t hist[MISH_CFG_STATS_BUCKETS];
+} mish_stat;
+
+typedef struct {
+  mish_command cmd;
+  mish_stat stat;
+} mish_cmd_stat;
+
+typedef struct {
+  mish_clock clock;
+  mish_stat lex;      /* per stage */
+  mish_stat parse;    /* per stage, without lexing */
+  mish_stat dispatch; /* finding the command and piping its arguments */
+  mish_cmd_stat cmds[MISH_CFG_STATS_CMDS];
+  size_t num_cmds;
+  uint32_t lex_ticks; /* lexed since the last stage was parsed */
+  uint32_t mark;      /* when dispatching started */
+} mish_stats;
+#endif
+
 /* TODO: use named commands so that we can properly print them */
 typedef struct {
   mish_str name;
   mish_command cmd;
 } mish_named_cmd;
 
+/* commands known at compile time, built by tools/gen-cmd-table
+ * into a perfect hash that can live in read-only memory:
+ * a name is looked up in cmds[mix(hash ^ disps[hash % num_buckets]) % size].
+ * size and num_buckets are powers of two, so both are masks,
+ * unused entries of cmds have a NULL cmd.
+ */
+typedef struct {
+  const mish_named_cmd* cmds;
+  const uint32_t* disps;
+  uint32_t size;
+  uint32_t num_buckets;
+  uint32_t seed;
+} mish_static_table;
+
 typedef struct {
   union {
     mish_str string;
@@ -104,59 +207,226 @@ typedef struct mish_argument {
   } contents;
 } mish_argument;
 
-/* we use a linked list since we build
- * argument lists dynamically and we can't
- * assume our allocator pads our objects
- * like the C standard requires.
+/* the arguments of a command, argv[0] is the command itself.
+ * Arguments are appended at the bottom of the arg arena one after
+ * the other (strings go to its top), so they are contiguous.
  */
+struct mish__args_index; /* internal, see mish_args_get */
+
 typedef struct mish__arg_list {
-  struct mish_argument arg;
-  struct mish__arg_list* next;
+  mish_argument* argv;
+  size_t argc;
+  struct mish__args_index* index;
 } mish_arg_list;
 
 /* some of these things should be private */
 
-typedef struct _node {
+/* dead entries were overwritten, they are only kept
+ * until the environment is compacted
+ */
+typedef struct {
   mish_atom key;
   mish_atom value;
-  struct _node* next;
-} mish_list_node;
+  bool dead;
+} mish_map_entry;
 
 typedef struct {
   uint8_t* buffer;
   size_t   buffsize;
   size_t   allocated;
+  size_t   top;  /* allocated from the end, see arena_alloc_top */
+  size_t   peak; /* the most that was ever allocated at once */
 } mish_arena;
 
+/* the hash is kept next to the entry,
+ * so most mismatches are rejected without touching the entry.
+ * entries are numbered from one in node arena order, which keeps
+ * a slot at 8 bytes on any host. empty slots hold 0.
+ */
 typedef struct {
-  mish_list_node* head;
-  mish_list_node* tail;
-} mish_atom_list;
+  uint32_t hash;
+  uint32_t entry;
+} mish_map_slot;
 
 typedef struct {
-  mish_atom_list* buckets;
-  size_t num_buckets;
+  mish_map_slot* slots;
+  size_t capacity; /* always a power of two */
+  size_t count;
+  size_t peak_count;
 
   mish_arena* str_arena;
   mish_arena* node_arena;
+
+  size_t generation;
+  size_t dead_bytes;
+  uint32_t seed;
+
+#ifdef MISH_CFG_THREADS
+  /* lookups never lock, inserts take the lock, and clearing
+   * or compacting also waits until no session runs a line
+   */
+  pthread_mutex_t lock;
+  int stopping;
+  int compact_wanted;
+  struct mish__shell* sessions;
+#endif
 } mish_map;
 
+/* prepared commands keep atoms that start with '$' unresolved,
+ * these flags tell which atoms of an argument are variables,
+ * plain atoms use MISH_PREP_VAR_KEY.
+ */
+#define MISH_PREP_VAR_KEY   1
+#define MISH_PREP_VAR_VALUE 2
+
+typedef struct mish__prep_arg {
+  mish_argument arg;
+  uint8_t vars;
+  struct mish__prep_arg* next;
+} mish_prep_arg;
+
+/* one command of a pipeline, cmd is only valid
+ * while generation matches the one of the environment
+ */
+typedef struct mish__prep_stage {
+  mish_prep_arg* args;
+  mish_command cmd;
+  size_t generation;
+  struct mish__prep_stage* next;
+} mish_prep_stage;
+
+typedef struct {
+  mish_arena* arena;
+  mish_prep_stage* stages;
+  char* line;
+  size_t line_size;
+  uint32_t hash;
+  uint32_t last_used;
+  bool used;
+  bool pinned;
+} mish_prepared;
+
+/* receives the output of the shell, see mish_shell_set_sink */
+typedef void (*mish_sink)(struct mish__shell* s, const char* data, size_t size, void* user);
+
+/* state of a line that is being fed byte by byte,
+ * the line is kept right past the head of the arg arena
+ */
+typedef struct {
+  mish_arg_list args;  /* arguments of the current stage */
+  mish_atom key;       /* atom waiting to see if a ':' follows */
+  size_t line_pos;
+  size_t token_begin;
+  uint8_t lex_state;
+  uint8_t par_state;
+  uint8_t vars;
+  char delimiter;
+  bool escaped;
+  bool started;
+  bool discard;        /* the line failed, skip to the next newline */
+  bool ended;          /* the line ended at a '\0', skip to the next newline */
+} mish_feed;
+
 typedef struct mish__shell {
   mish_map map;
+  mish_map* env; /* the map of this shell, or the one it shares */
   mish_arena* arg_arena;
   mish_error err;
 
+  mish_prepared* prep_slots;
+  size_t num_prep_slots;
+  uint32_t prep_clock;
+
+  /* consulted before the environment, its names can't be redefined */
+  const mish_static_table* static_cmds;
+
+  /* commands are stored in snapshots as indices into this table */
+  const mish_named_cmd* cmd_table;
+  size_t cmd_table_size;
+
+  mish_feed feed;
+
+  /* typed output of the running command, given to the next stage */
+  mish_arg_list results;
+
   char* cmd;
   size_t cmd_size;
   
   char* out_buffer;
-  size_t written;
+  size_t written;   /* bytes of output, the '\0' after them isn't counted */
   size_t buff_size;
+  size_t out_peak; /* the most that was written before a flush */
+
+  mish_sink sink;
+  void* sink_user;
+  bool streaming; /* the running command may flush to the sink */
+
+#ifdef MISH_CFG_STATS
+  mish_stats stats;
+#endif
+
+#ifdef MISH_CFG_THREADS
+  int active; /* running a line, the environment must not move */
+  struct mish__shell* next_session;
+#endif
 } mish_shell;
 
+/* the most each region has held since the shell was made
+ * or the peaks were reset, tools/tune-cfg.c sizes regions from these
+ */
+typedef struct {
+  size_t arg_arena;
+  size_t str_arena;
+  size_t node_arena;
+  size_t map_count;  /* keys, the bucket array must hold them */
+  size_t out_buffer; /* without the terminator */
+  size_t prep_slot;  /* the arena of the fullest cache slot */
+} mish_peaks;
+
+/* a region of a shell made with mish_shell_new_config */
+typedef struct {
+  size_t bytes; /* that can always be used */
+  size_t share; /* of the memory beyond mish_shell_config_size */
+} mish_region;
+
+/* the layout of a shell, instead of the MISH_CFG_* ratios */
+typedef struct {
+  mish_region arg_arena;
+  mish_region str_arena;
+  mish_region node_arena;
+  mish_region out_buffer;
+  mish_region prep_slot;  /* each slot of the command cache */
+  size_t buckets;         /* rounded down to a power of two */
+  size_t prep_slots;      /* 0 disables the command cache */
+} mish_shell_config;
+
 mish_error_code mish_shell_new(uint8_t* buffer, size_t size, mish_shell* s);
+mish_error_code mish_shell_new_config(uint8_t* buffer, size_t size,
+                                      const mish_shell_config* c, mish_shell* s);
+size_t mish_shell_config_size(const mish_shell_config* c);
+mish_error_code mish_shell_new_session(uint8_t* buffer, size_t size, mish_shell* shared, mish_shell* s);
+void mish_shell_close_session(mish_shell* s);
 mish_error_code mish_shell_eval(mish_shell* s, char* cmd, size_t cmd_size);
+/* called at the end of every fed line, err is the result of the line */
+typedef void (*mish_feed_callback)(mish_shell* s, mish_error_code err, void* user);
+mish_error_code mish_shell_feed(mish_shell* s, const char* bytes, size_t size,
+                                mish_feed_callback cb, void* user);
+/* called after every line of a script, line counts from 1.
+ * returning false stops the script.
+ */
+typedef bool (*mish_script_callback)(mish_shell* s, size_t line, mish_error_code err, void* user);
+mish_error_code mish_shell_eval_script(mish_shell* s, char* script, size_t size,
+                                       mish_script_callback cb, void* user);
+mish_error_code mish_shell_prepare(mish_shell* s, char* cmd, size_t cmd_size, mish_prepared** out);
+mish_error_code mish_shell_exec_prepared(mish_shell* s, mish_prepared* p);
+void mish_shell_release_prepared(mish_shell* s, mish_prepared* p);
+bool mish_shell_emit(mish_shell* s, mish_argument a);
+bool mish_shell_emit_atom(mish_shell* s, mish_atom a);
+bool mish_shell_emit_list(mish_shell* s, mish_arg_list* list);
+void mish_shell_set_sink(mish_shell* s, mish_sink sink, void* user);
+void mish_shell_flush(mish_shell* s);
 size_t mish_shell_write_atom(mish_shell* s, mish_atom a);
+size_t mish_shell_write_pair(mish_shell* s, mish_pair p);
 size_t mish_shell_write_arg(mish_shell* s, mish_argument a);
 size_t mish_shell_write_strlit(mish_shell* s, char* string);
 size_t mish_shell_write_char(mish_shell* s, char c);
@@ -168,12 +438,29 @@ bool mish_shell_add_exact(mish_shell* s, char* name, int64_t num);
 bool mish_shell_add_inexact_num(mish_shell* s, char* name, double num);
 
 size_t mish_shell_available_env_memory(mish_shell* s);
+void mish_shell_peaks(mish_shell* s, mish_peaks* out);
+void mish_shell_reset_peaks(mish_shell* s);
+void mish_shell_set_seed(mish_shell* s, uint32_t seed);
+size_t mish_shell_compact(mish_shell* s);
+
+void mish_shell_set_static_cmds(mish_shell* s, const mish_static_table* table);
+void mish_shell_register_cmds(mish_shell* s, const mish_named_cmd* table, size_t size);
+mish_error_code mish_shell_snapshot(mish_shell* s, uint8_t* buffer, size_t size, size_t* written);
+mish_error_code mish_shell_restore(mish_shell* s, const uint8_t* buffer, size_t size);
 
 mish_error_code mish_builtin_hard_clear(mish_shell* s, mish_arg_list* list);
 mish_error_code mish_builtin_echo(mish_shell* s, mish_arg_list* list);
 mish_error_code mish_builtin_def(mish_shell* s, mish_arg_list* list);
 mish_error_code mish_builtin_available_env_memory(mish_shell* s, mish_arg_list* list);
 mish_error_code mish_builtin_print_env(mish_shell* s, mish_arg_list* list);
+mish_error_code mish_builtin_compact(mish_shell* s, mish_arg_list* list);
+
+#ifdef MISH_CFG_STATS
+void mish_shell_set_clock(mish_shell* s, mish_clock clock);
+void mish_shell_reset_stats(mish_shell* s);
+/* prints the stats, "stats reset" clears them */
+mish_error_code mish_builtin_stats(mish_shell* s, mish_arg_list* list);
+#endif
 
 mish_atom mish_atom_create_num_exact(uint64_t value);
 mish_atom mish_atom_create_num_inexact(double value);
@@ -191,5 +478,49 @@ size_t mish_snprint_arg(char* buffer, size_t size, mish_argument a);
 size_t mish_snprint_arg_list(char* buffer, size_t size, mish_arg_list* list);
 
 bool mish_argval_only_pairs(mish_arg_list* args);
+/* walks the arguments after the command:
+ *   for (a = mish_args_first(args); a != NULL; a = mish_args_next(args, a))
+ */
+mish_argument* mish_args_first(mish_arg_list* args);
+mish_argument* mish_args_next(mish_arg_list* args, mish_argument* a);
+/* the value of the first pair with the string key, false if there is none */
+bool mish_args_get(mish_arg_list* args, const char* key, mish_atom* out);
+
+/* what a field of a schema is stored as */
+typedef enum {
+  mish_fk_exact,   /* uint64_t */
+  mish_fk_inexact, /* double, exact numbers are converted */
+  mish_fk_str,     /* mish_str */
+  mish_fk_atom     /* mish_atom of any kind */
+} mish_field_kind;
+
+/* a field is given by a pair with its key, or by a plain
+ * atom if key.buffer is NULL, in the order of the schema.
+ * offset is where it goes in the struct, see offsetof.
+ */
+typedef struct {
+  mish_str key;
+  mish_field_kind kind;
+  size_t offset;
+  bool required;
+} mish_field;
+
+/* up to 32 fields */
+typedef struct {
+  const mish_field* fields;
+  size_t num_fields;
+} mish_schema;
+
+/* where mish_args_extract failed: the argument, counting the
+ * command as 0, and its field. A missing field has arg 0,
+ * an argument the schema doesn't take has no field.
+ */
+typedef struct {
+  size_t arg;
+  const mish_field* field;
+} mish_args_error;
+
+mish_error_code mish_args_extract(mish_arg_list* args, const mish_schema* schema,
+                                  void* out, mish_args_error* where);
 
 char* mish_util_error_str(mish_error_code code);
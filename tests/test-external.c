@@ -6,11 +6,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "../mish.h"
+#include "static-cmds.h"
 
 #define SHELL_MEMORY_SIZE 8192
 uint8_t shell_memory[SHELL_MEMORY_SIZE] = {0};
 
+/* the cache of parsed lines is opt-in, this is the default
+ * layout with a share of it
+ */
+mish_error_code new_cached_shell(mish_shell* s) {
+  mish_shell_config c;
+  memset(&c, 0, sizeof(c));
+  c.arg_arena.share = 16;
+  c.str_arena.share = 36;
+  c.node_arena.share = 28;
+  c.out_buffer.share = 24;
+  c.prep_slot.share = 16;
+  c.buckets = 32;
+  c.prep_slots = 2;
+  return mish_shell_new_config(shell_memory, SHELL_MEMORY_SIZE, &c, s);
+}
+
 /* BEGIN: EVAL TEST */
 
 mish_error_code cmd_corrupt_print(mish_shell* s, mish_arg_list* list) {
@@ -34,7 +52,7 @@ mish_error_code cmd_clear(mish_shell* s, mish_arg_list* list) {
   return mish_error_none;
 }
 
-#define NUM_COMMANDS 14
+#define NUM_COMMANDS 16
 char* commands[NUM_COMMANDS] = {
   "def cmd:i2cscan port:8080\r\n",
   "echo $cmd $port\r\n",
@@ -49,7 +67,9 @@ char* commands[NUM_COMMANDS] = {
   "echo $a $b $c\r\n",
   "clear\r\n",
   "echo a:1 b:2 | echo c:3 d:4 e:5 | def f:6\r\n",
-  "echo $a $b $c $d $e $f\r\n"
+  "echo $a $b $c $d $e $f\r\n",
+  "def s:\"a\\\"b\\tc\\\\d\" q:'it\\'s'\r\n",
+  "echo $s $q\r\n"
 };
 char* expected[NUM_COMMANDS] = {
   "",
@@ -66,6 +86,8 @@ char* expected[NUM_COMMANDS] = {
   "",
   "",
   "1 2 3 4 5 6 \r\n",
+  "",
+  "\"a\\\"b\\tc\\\\d\" \"it's\" \r\n",
 };
 
 void eval_once(mish_shell* s, char* cmd) {
@@ -122,7 +144,990 @@ void eval_test() {
 }
 /* END: EVAL TEST */
 
+/* BEGIN: PREPARED TEST */
+void expect_output(mish_shell* s, mish_error_code err, char* exp) {
+  if (err != mish_error_none) {
+    printf("error: %s\n", mish_util_error_str(err));
+    abort();
+  }
+  if (s->written != strlen(exp) || strncmp(s->out_buffer, exp, s->written) != 0) {
+    printf("invalid response: \"%.*s\"\n != \"%s\"\n",
+           (int)s->written, s->out_buffer, exp);
+    abort();
+  }
+}
+
+void prepared_test() {
+  mish_shell s;
+  mish_prepared* p;
+  mish_error_code err;
+  char line[] = "echo $v w:$v\r\n";
+  int i;
+  printf(">>>>>>>>>>>> PREPARED TEST\n");
+  if (new_cached_shell(&s) != mish_error_none ||
+      cmd_clear(&s, NULL) != mish_error_none) {
+    abort();
+  }
+
+  err = mish_shell_prepare(&s, line, strlen(line), &p);
+  if (err != mish_error_none) {
+    printf("prepare: %s\n", mish_util_error_str(err));
+    abort();
+  }
+
+  /* variables are resolved when the command runs */
+  mish_shell_eval(&s, "def v:1\r\n", 9);
+  expect_output(&s, mish_shell_exec_prepared(&s, p), "1 \"w\":1 \r\n");
+  expect_output(&s, mish_shell_exec_prepared(&s, p), "1 \"w\":1 \r\n");
+
+  /* clear registers the commands again, which must be looked up again */
+  mish_shell_eval(&s, "clear\r\n", 7);
+  mish_shell_eval(&s, "def v:two\r\n", 11);
+  expect_output(&s, mish_shell_exec_prepared(&s, p), "\"two\" \"w\":\"two\" \r\n");
+  mish_shell_release_prepared(&s, p);
+
+  /* repeated lines go through the cache */
+  for (i = 0; i < 3; i++) {
+    memcpy(scratch_buff, line, sizeof(line));
+    expect_output(&s, mish_shell_eval(&s, scratch_buff, strlen(line)),
+                  "\"two\" \"w\":\"two\" \r\n");
+  }
+
+  err = mish_shell_eval(&s, "nope\r\n", 6);
+  if (err != mish_error_variable_not_found) {
+    printf("unknown command: %s\n", mish_util_error_str(err));
+    abort();
+  }
+
+  /* a stage too big for a slot goes on from the text,
+   * and a bad one fails after the ones before it ran
+   */
+  strcpy(scratch_buff, "echo x:1 | echo");
+  for (i = 0; i < 8; i++) {
+    strcat(scratch_buff, " abcdefgh");
+  }
+  strcat(scratch_buff, "\r\n");
+  err = mish_shell_eval(&s, scratch_buff, strlen(scratch_buff));
+  if (err != mish_error_none || s.written != 8 * 11 + 8 ||
+      strncmp(s.out_buffer, "\"abcdefgh\" ", 11) != 0 ||
+      strncmp(s.out_buffer + s.written - 8, "\"x\":1 \r\n", 8) != 0) {
+    printf("long line: %s %lu \"%.*s\"\n", mish_util_error_str(err), (unsigned long)s.written, (int)s.written, s.out_buffer);
+    abort();
+  }
+  err = mish_shell_eval(&s, "echo x:1 | echo a:\r\n", 20);
+  if (err != mish_error_invalid_syntax) {
+    printf("bad stage: %s\n", mish_util_error_str(err));
+    abort();
+  }
+  printf("prepared_test: OK\n");
+}
+/* END: PREPARED TEST */
+
+/* BEGIN: COMPACT TEST */
+/* keeps overwriting a few variables, far more times than
+ * the environment could hold without compaction
+ */
+void compact_test() {
+  mish_shell s;
+  mish_error_code err;
+  char line[64];
+  size_t available;
+  int i;
+  printf(">>>>>>>>>>>> COMPACT TEST\n");
+  if (mish_shell_new(shell_memory, SHELL_MEMORY_SIZE, &s) != mish_error_none ||
+      cmd_clear(&s, NULL) != mish_error_none ||
+      mish_shell_add_cmd(&s, "compact", mish_builtin_compact) == false) {
+    abort();
+  }
+
+  for (i = 0; i < 1000; i++) {
+    snprintf(line, sizeof(line), "def rate:%d name:\"dev-%d\"\r\n", i, i);
+    err = mish_shell_eval(&s, line, strlen(line));
+    if (err != mish_error_none) {
+      printf("update %d: %s\n", i, mish_util_error_str(err));
+      abort();
+    }
+  }
+  expect_output(&s, mish_shell_eval(&s, "echo $rate $name\r\n", 18), "999 \"dev-999\" \r\n");
+
+  available = mish_shell_available_env_memory(&s);
+  expect_output(&s, mish_shell_eval(&s, "def rate:0 | compact | echo $rate\r\n", 35), "0 \r\n");
+  if (mish_shell_available_env_memory(&s) <= available) {
+    printf("compact reclaimed nothing\n");
+    abort();
+  }
+  expect_output(&s, mish_shell_eval(&s, "echo $rate $name\r\n", 18), "0 \"dev-999\" \r\n");
+  printf("compact_test: OK\n");
+}
+/* END: COMPACT TEST */
+
+/* BEGIN: SNAPSHOT TEST */
+uint8_t restored_memory[SHELL_MEMORY_SIZE] = {0};
+uint8_t image[SHELL_MEMORY_SIZE] = {0};
+
+mish_named_cmd cmd_table[] = {
+  {{"def", 3}, mish_builtin_def},
+  {{"echo", 4}, mish_builtin_echo},
+  {{"bad-echo", 8}, cmd_corrupt_print},
+  {{"clear", 5}, cmd_clear}
+};
+#define CMD_TABLE_SIZE (sizeof(cmd_table)/sizeof(cmd_table[0]))
+
+void snapshot_test() {
+  mish_shell s, r;
+  mish_error_code err;
+  size_t size, small;
+  char line[] = "def name:\"dev\" rate:9600 | def rate:115200 gain:0.5\r\n";
+  printf(">>>>>>>>>>>> SNAPSHOT TEST\n");
+  if (mish_shell_new(shell_memory, SHELL_MEMORY_SIZE, &s) != mish_error_none ||
+      mish_shell_new(restored_memory, SHELL_MEMORY_SIZE, &r) != mish_error_none ||
+      cmd_clear(&s, NULL) != mish_error_none) {
+    abort();
+  }
+  mish_shell_register_cmds(&s, cmd_table, CMD_TABLE_SIZE);
+  mish_shell_register_cmds(&r, cmd_table, CMD_TABLE_SIZE);
+  mish_shell_set_seed(&s, 0x5eed);
+  mish_shell_set_seed(&r, 0xbeef);
+  if (mish_shell_eval(&s, line, strlen(line)) != mish_error_none) {
+    abort();
+  }
+
+  err = mish_shell_snapshot(&s, image, 16, &small);
+  if (err != mish_error_snapshot_too_small) {
+    printf("small snapshot: %s\n", mish_util_error_str(err));
+    abort();
+  }
+  err = mish_shell_snapshot(&s, image, sizeof(image), &size);
+  if (err != mish_error_none || size != small) {
+    printf("snapshot: %s\n", mish_util_error_str(err));
+    abort();
+  }
+
+  err = mish_shell_restore(&r, image, size);
+  if (err != mish_error_none) {
+    printf("restore: %s\n", mish_util_error_str(err));
+    abort();
+  }
+  expect_output(&r, mish_shell_eval(&r, "echo $name $rate $gain\r\n", 24), "\"dev\" 115200 0.500000 \r\n");
+  if (r.map.seed != 0xbeef) {
+    printf("restore replaced the seed\n");
+    abort();
+  }
+
+  /* corrupted images are rejected */
+  image[size - 1] ^= 1;
+  if (mish_shell_restore(&r, image, size) != mish_error_bad_snapshot) {
+    printf("corrupted image restored\n");
+    abort();
+  }
+  printf("snapshot_test: OK\n");
+}
+/* END: SNAPSHOT TEST */
+
+/* BEGIN: STATIC TEST */
+void static_test() {
+  mish_shell s;
+  size_t available;
+  printf(">>>>>>>>>>>> STATIC TEST\n");
+  if (mish_shell_new(shell_memory, SHELL_MEMORY_SIZE, &s) != mish_error_none) {
+    abort();
+  }
+  mish_shell_set_static_cmds(&s, &static_cmds);
+
+  /* commands take no environment memory */
+  available = mish_shell_available_env_memory(&s);
+  expect_output(&s, mish_shell_eval(&s, "secho 1 2\r\n", 11), "1 2 \r\n");
+  if (mish_shell_available_env_memory(&s) != available) {
+    printf("static command used env memory\n");
+    abort();
+  }
+
+  if (mish_shell_eval(&s, "sdef x:42\r\n", 11) != mish_error_none ||
+      mish_shell_eval(&s, "sdef secho:1\r\n", 14) != mish_error_insert_failed) {
+    printf("sdef failed\n");
+    abort();
+  }
+  expect_output(&s, mish_shell_eval(&s, "secho $x\r\n", 10), "42 \r\n");
+  if (mish_shell_eval(&s, "secho-not\r\n", 11) != mish_error_variable_not_found) {
+    printf("unknown static command found\n");
+    abort();
+  }
+  printf("static_test: OK\n");
+}
+/* END: STATIC TEST */
+
+/* BEGIN: SESSION TEST */
+#define SESSION_MEMORY_SIZE 4096
+uint8_t session_memory[2][SESSION_MEMORY_SIZE];
+
+/* sessions have their own output but share the environment */
+void session_test() {
+  mish_shell s, a, b;
+  size_t available;
+  printf(">>>>>>>>>>>> SESSION TEST\n");
+  if (mish_shell_new(shell_memory, SHELL_MEMORY_SIZE, &s) != mish_error_none ||
+      cmd_clear(&s, NULL) != mish_error_none) {
+    abort();
+  }
+  mish_shell_set_static_cmds(&s, &static_cmds);
+  if (mish_shell_new_session(session_memory[0], SESSION_MEMORY_SIZE, &s, &a) != mish_error_none ||
+      mish_shell_new_session(session_memory[1], SESSION_MEMORY_SIZE, &s, &b) != mish_error_none) {
+    printf("session setup failed\n");
+    abort();
+  }
+
+  expect_output(&a, mish_shell_eval(&a, "def x:1 y:\"two\"\r\n", 17), "");
+  expect_output(&b, mish_shell_eval(&b, "echo $x $y\r\n", 12), "1 \"two\" \r\n");
+  expect_output(&a, mish_shell_eval(&a, "secho $y\r\n", 10), "\"two\" \r\n");
+  if (strncmp(b.out_buffer, "1 \"two\" \r\n", b.written) != 0) {
+    printf("session output was overwritten\n");
+    abort();
+  }
+
+  /* the arg arena and command cache take no environment memory */
+  available = mish_shell_available_env_memory(&s);
+  expect_output(&a, mish_shell_eval(&a, "echo a b c\r\n", 12), "\"a\" \"b\" \"c\" \r\n");
+  if (mish_shell_available_env_memory(&b) != available) {
+    printf("session used env memory\n");
+    abort();
+  }
+
+  /* clearing from one session clears it for all */
+  expect_output(&b, mish_shell_eval(&b, "hard-clear\r\n", 12), "");
+  if (mish_shell_eval(&s, "echo $x\r\n", 9) != mish_error_variable_not_found) {
+    printf("cleared variable still found\n");
+    abort();
+  }
+  mish_shell_close_session(&a);
+  mish_shell_close_session(&b);
+  printf("session_test: OK\n");
+}
+/* END: SESSION TEST */
+
+/* BEGIN: FEED TEST */
+typedef struct {
+  int lines;
+  mish_error_code err;
+  char out[256];
+  size_t written;
+} feed_result;
+
+void feed_done(mish_shell* s, mish_error_code err, void* user) {
+  feed_result* r = (feed_result*)user;
+  r->lines++;
+  r->err = err;
+  r->written = s->written;
+  memcpy(r->out, s->out_buffer, s->written);
+}
+
+/* the whole reply, an empty or cut one doesn't match */
+bool feed_output_is(feed_result* r, char* exp) {
+  return r->written == strlen(exp) && memcmp(r->out, exp, r->written) == 0;
+}
+
+/* feeds the line in chunks of the given size */
+void feed_line(mish_shell* s, char* line, size_t chunk, feed_result* r) {
+  size_t size = strlen(line);
+  size_t i, n;
+  r->lines = 0;
+  for (i = 0; i < size; i += n) {
+    n = size - i < chunk ? size - i : chunk;
+    if (mish_shell_feed(s, line + i, n, feed_done, r) != mish_error_none) {
+      abort();
+    }
+  }
+  if (r->lines != 1) {
+    printf("fed \"%s\" ran %d lines\n", line, r->lines);
+    abort();
+  }
+}
+
+char* bad_lines[] = {
+  "echo $nope\r\n",
+  "echo a:\r\n",
+  "echo \"\\q\"\r\n",
+  "echo a:b:c\r\n",
+  "echo .5\r\n",
+  "echo ;\r\n",
+  "nope | echo\r\n",
+  "\r\n",
+  "echo a:1 | | echo\r\n",
+  "echo \xff\r\n",
+  ";\r\n",
+  "echo \xc3\xa9\r\n",
+  "echo \xc3\r\n",
+  "echo \"abc\r\n"
+};
+#define NUM_BAD_LINES (sizeof(bad_lines)/sizeof(bad_lines[0]))
+
+void feed_test() {
+  mish_shell s;
+  feed_result r;
+  mish_error_code err;
+  mish_range range;
+  size_t chunk;
+  int i;
+  printf(">>>>>>>>>>>> FEED TEST\n");
+  if (mish_shell_new(shell_memory, SHELL_MEMORY_SIZE, &s) != mish_error_none ||
+      cmd_clear(&s, NULL) != mish_error_none) {
+    abort();
+  }
+
+  /* same results as mish_shell_eval, whatever the chunk size */
+  for (chunk = 1; chunk <= 7; chunk += 3) {
+    for (i = 0; i < NUM_COMMANDS; i++) {
+      feed_line(&s, commands[i], chunk, &r);
+      if (r.err != mish_error_none ||
+          feed_output_is(&r, expected[i]) == false) {
+        printf("fed \"%s\": %s \"%.*s\"\n", commands[i],
+               mish_util_error_str(r.err), (int)r.written, r.out);
+        abort();
+      }
+    }
+  }
+
+  for (i = 0; i < (int)NUM_BAD_LINES; i++) {
+    memcpy(scratch_buff, bad_lines[i], strlen(bad_lines[i])+1);
+    err = mish_shell_eval(&s, scratch_buff, strlen(bad_lines[i]));
+    range = s.err.range;
+    feed_line(&s, bad_lines[i], 2, &r);
+    if (err == mish_error_none || r.err != err ||
+        s.err.range.begin != range.begin || s.err.range.end != range.end) {
+      printf("fed \"%s\": %s at %d:%d, eval: %s at %d:%d\n", bad_lines[i],
+             mish_util_error_str(r.err), s.err.range.begin, s.err.range.end,
+             mish_util_error_str(err), range.begin, range.end);
+      abort();
+    }
+  }
+
+  /* lines after a bad one are not affected */
+  feed_line(&s, "echo 1 2\r\n", 1, &r);
+  if (r.err != mish_error_none || feed_output_is(&r, "1 2 \r\n") == false) {
+    abort();
+  }
+  /* a '\0' ends the line like it does for eval, and the rest is skipped */
+  r.lines = 0;
+  mish_shell_feed(&s, "echo 1\0 2\r\n", 11, feed_done, &r);
+  if (r.lines != 1 || r.err != mish_error_none ||
+      feed_output_is(&r, "1 \r\n") == false) {
+    abort();
+  }
+  /* errors cover the offending byte */
+  feed_line(&s, "echo ;\r\n", 1, &r);
+  if (r.err != mish_error_unrecognized_rune ||
+      s.err.range.begin != 5 || s.err.range.end != 6) {
+    abort();
+  }
+  /* an argument is stored where the next token was fed */
+  feed_line(&s, "echo ab \"cd\" ef:gh\r\n", 3, &r);
+  if (r.err != mish_error_none ||
+      feed_output_is(&r, "\"ab\" \"cd\" \"ef\":\"gh\" \r\n") == false) {
+    printf("fed: %s \"%.*s\"\n", mish_util_error_str(r.err), (int)r.written, r.out);
+    abort();
+  }
+  printf("feed_test: OK\n");
+}
+/* END: FEED TEST */
+
+/* BEGIN: THREADS TEST */
+#ifdef MISH_CFG_THREADS
+#include <pthread.h>
+#include <sched.h>
+
+typedef struct {
+  pthread_t thread;
+  mish_shell* s;
+  mish_error_code err;
+  int done;
+} clear_job;
+
+/* hard-clear frees the strings of the environment, the new
+ * definitions then take their place
+ */
+void* run_clear(void* user) {
+  clear_job* j = (clear_job*)user;
+  char* redef = "sdef x:\"other\" y:\"overwritten\"\r\n";
+  j->err = mish_shell_eval(j->s, "hard-clear\r\n", 12);
+  if (j->err == mish_error_none) {
+    j->err = mish_shell_eval(j->s, redef, strlen(redef));
+  }
+  __atomic_store_n(&j->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/* the other thread must not wait for a line that is still being fed */
+void clear_from_thread(mish_shell* s) {
+  clear_job j;
+  clock_t start = clock();
+  j.s = s;
+  j.err = mish_error_none;
+  j.done = 0;
+  if (pthread_create(&j.thread, NULL, run_clear, &j) != 0) {
+    abort();
+  }
+  while (__atomic_load_n(&j.done, __ATOMIC_ACQUIRE) == 0) {
+    if (clock() - start > 2 * CLOCKS_PER_SEC) {
+      printf("threads: clear waited for a fed line\n");
+      abort();
+    }
+    sched_yield();
+  }
+  pthread_join(j.thread, NULL);
+  if (j.err != mish_error_none) {
+    printf("threads: clear gave %s\n", mish_util_error_str(j.err));
+    abort();
+  }
+}
+
+/* a fed line keeps what it read from the environment, even if
+ * another session clears it before the line ends
+ */
+void threads_test() {
+  mish_shell s, a, b;
+  feed_result r;
+  char* def = "sdef x:\"value\"\r\n";
+  /* $x is read once the token after it arrives */
+  char* lines[] = {"secho $x y ", "secho $x | "};
+  char* ends[] = {"\r\n", "secho\r\n"};
+  char* expected[] = {"\"value\" \"y\" \r\n", "\"value\" \r\n"};
+  size_t i;
+  printf(">>>>>>>>>>>> THREADS TEST\n");
+  if (mish_shell_new(shell_memory, SHELL_MEMORY_SIZE, &s) != mish_error_none) {
+    abort();
+  }
+  mish_shell_set_static_cmds(&s, &static_cmds);
+  if (mish_shell_new_session(session_memory[0], SESSION_MEMORY_SIZE, &s, &a) != mish_error_none ||
+      mish_shell_new_session(session_memory[1], SESSION_MEMORY_SIZE, &s, &b) != mish_error_none) {
+    abort();
+  }
+
+  for (i = 0; i < sizeof(lines)/sizeof(lines[0]); i++) {
+    expect_output(&a, mish_shell_eval(&a, def, strlen(def)), "");
+    r.lines = 0;
+    mish_shell_feed(&a, lines[i], strlen(lines[i]), feed_done, &r);
+    clear_from_thread(&b);
+    mish_shell_feed(&a, ends[i], strlen(ends[i]), feed_done, &r);
+    if (r.lines != 1 || r.err != mish_error_none ||
+        feed_output_is(&r, expected[i]) == false) {
+      printf("threads: \"%s%s\" gave %s \"%.*s\"\n", lines[i], ends[i],
+             mish_util_error_str(r.err), (int)r.written, r.out);
+      abort();
+    }
+  }
+  mish_shell_close_session(&a);
+  mish_shell_close_session(&b);
+  printf("threads_test: OK\n");
+}
+#endif
+/* END: THREADS TEST */
+
+/* BEGIN: SCRIPT TEST */
+#define SCRIPT_MAX_LINES 32
+
+typedef struct {
+  size_t lines; /* the last line seen */
+  mish_error_code errs[SCRIPT_MAX_LINES];
+  char outs[SCRIPT_MAX_LINES][64];
+  bool stop_on_error;
+} script_result;
+
+bool script_line(mish_shell* s, size_t line, mish_error_code err, void* user) {
+  script_result* r = (script_result*)user;
+  if (line <= r->lines || line > SCRIPT_MAX_LINES) {
+    printf("script: line %lu after %lu\n", (unsigned long)line, (unsigned long)r->lines);
+    abort();
+  }
+  if (err == mish_error_none && (s->err.range.begin != 0 || s->err.range.end != 0)) {
+    printf("script: line %lu kept the range of an error\n", (unsigned long)line);
+    abort();
+  }
+  r->lines = line;
+  r->errs[line - 1] = err;
+  snprintf(r->outs[line - 1], sizeof(r->outs[0]), "%.*s", (int)s->written, s->out_buffer);
+  return err == mish_error_none || r->stop_on_error == false;
+}
+
+/* every line of the script gives what mish_shell_eval gives it,
+ * the bad lines go before bad-echo (which overwrites its own line)
+ * and there is a blank line between them
+ */
+void script_test() {
+  char script[1024] = "";
+  mish_shell s;
+  script_result r;
+  mish_error_code err;
+  int i, line;
+  printf(">>>>>>>>>>>> SCRIPT TEST\n");
+  if (mish_shell_new(shell_memory, SHELL_MEMORY_SIZE, &s) != mish_error_none ||
+      cmd_clear(&s, NULL) != mish_error_none) {
+    abort();
+  }
+
+  for (i = 0; i < NUM_COMMANDS; i++) {
+    if (i == 7) {
+      strcat(script, "echo $nope\r\n\r\necho a:\r\necho \"a\r\n");
+    }
+    strcat(script, commands[i]);
+  }
+
+  memset(&r, 0, sizeof(r));
+  err = mish_shell_eval_script(&s, script, strlen(script), script_line, &r);
+  if (err != mish_error_variable_not_found || r.lines != NUM_COMMANDS + 4 ||
+      r.errs[7] != mish_error_variable_not_found ||
+      r.errs[9] != mish_error_invalid_syntax ||
+      r.errs[10] != mish_error_unexpected_EOF) {
+    printf("script: %s after %lu lines\n", mish_util_error_str(err), (unsigned long)r.lines);
+    abort();
+  }
+  for (i = 0; i < NUM_COMMANDS; i++) {
+    line = i < 7 ? i : i + 4;
+    if (r.errs[line] != mish_error_none || strcmp(r.outs[line], expected[i]) != 0) {
+      printf("script: line %d gave %s \"%s\"\n", line + 1,
+             mish_util_error_str(r.errs[line]), r.outs[line]);
+      abort();
+    }
+  }
+
+  memset(&r, 0, sizeof(r));
+  r.stop_on_error = true;
+  cmd_clear(&s, NULL);
+  err = mish_shell_eval_script(&s, script, strlen(script), script_line, &r);
+  if (err != mish_error_variable_not_found || r.lines != 8) {
+    printf("script: didn't stop, %lu lines\n", (unsigned long)r.lines);
+    abort();
+  }
+  printf("script_test: OK\n");
+}
+/* END: SCRIPT TEST */
+
+/* BEGIN: RESULTS TEST */
+double stored = 0;
+
+mish_error_code cmd_third(mish_shell* s, mish_arg_list* list) {
+  if (list == NULL) {
+    return mish_error_internal;
+  }
+  if (mish_shell_emit_atom(s, mish_atom_create_num_inexact(1.0 / 3.0)) == false) {
+    return mish_error_cmd_failure;
+  }
+  return mish_error_none;
+}
+
+mish_error_code cmd_store(mish_shell* s, mish_arg_list* list) {
+  if (s == NULL || list->argc < 2 ||
+      mish_atom_is_inexact(list->argv[1].contents.atom) == false) {
+    return mish_error_contract_violation;
+  }
+  stored = list->argv[1].contents.atom.contents.inexact_num;
+  return mish_error_none;
+}
+
+/* typed results go through pipes without being printed */
+/* emits before echo, so echo has to copy its arguments after it */
+mish_error_code cmd_emit_echo(mish_shell* s, mish_arg_list* list) {
+  if (mish_shell_emit_atom(s, mish_atom_create_num_exact(0)) == false) {
+    return mish_error_cmd_failure;
+  }
+  return mish_builtin_echo(s, list);
+}
+
+void results_test() {
+  mish_shell s;
+  char line[] = "third | echo | store\r\n";
+  char long_line[256];
+  char full_line[512];
+  mish_error_code err = mish_error_none;
+  char exp[] = "\"a\\tb\" \"c\":\"d\" \r\n";
+  feed_result r;
+  int i;
+  printf(">>>>>>>>>>>> RESULTS TEST\n");
+  if (mish_shell_new(shell_memory, SHELL_MEMORY_SIZE, &s) != mish_error_none ||
+      cmd_clear(&s, NULL) != mish_error_none ||
+      mish_shell_add_cmd(&s, "third", cmd_third) == false ||
+      mish_shell_add_cmd(&s, "store", cmd_store) == false) {
+    abort();
+  }
+  if (mish_shell_eval(&s, line, strlen(line)) != mish_error_none || stored != 1.0 / 3.0) {
+    printf("lost precision: %.17g\n", stored);
+    abort();
+  }
+
+  /* only the results of the last stage are kept, so long
+   * pipelines fit in the arg arena, whichever way they are run
+   */
+  strcpy(long_line, "echo \"a\\tb\" c:'d'");
+  for (i = 0; i < 32; i++) {
+    strcat(long_line, " | echo");
+  }
+  strcat(long_line, "\r\n");
+  expect_output(&s, mish_shell_eval(&s, long_line, strlen(long_line)), exp);
+  feed_line(&s, long_line, 5, &r);
+  if (r.err != mish_error_none || feed_output_is(&r, exp) == false) {
+    printf("fed pipeline: %s \"%.*s\"\n", mish_util_error_str(r.err), (int)r.written, r.out);
+    abort();
+  }
+
+  /* echo fails once its arguments don't fit twice in the arg arena */
+  mish_shell_add_cmd(&s, "emit-echo", cmd_emit_echo);
+  strcpy(full_line, "emit-echo");
+  for (i = 0; i < 200 && err == mish_error_none; i++) {
+    strcat(full_line, " 1");
+    err = mish_shell_eval(&s, full_line + 5, strlen(full_line + 5));
+    if (err == mish_error_none) {
+      err = mish_shell_eval(&s, full_line, strlen(full_line));
+    }
+  }
+  if (err != mish_error_parser_out_of_memory) {
+    printf("echo gave %s after %d arguments\n", mish_util_error_str(err), i);
+    abort();
+  }
+  if (new_cached_shell(&s) != mish_error_none || cmd_clear(&s, NULL) != mish_error_none) {
+    abort();
+  }
+  for (i = 0; i < 2; i++) {
+    expect_output(&s, mish_shell_eval(&s, long_line, strlen(long_line)), exp);
+  }
+  printf("results_test: OK\n");
+}
+/* END: RESULTS TEST */
+
+/* BEGIN: SINK TEST */
+char sunk[SHELL_MEMORY_SIZE * 2];
+size_t sunk_size = 0;
+int flushes = 0;
+
+void sink(mish_shell* s, const char* data, size_t size, void* user) {
+  if (s == NULL || user != sunk || sunk_size + size > sizeof(sunk)) {
+    abort();
+  }
+  memcpy(sunk + sunk_size, data, size);
+  sunk_size += size;
+  flushes++;
+}
+
+/* output larger than the out buffer is streamed whole */
+void sink_test() {
+  mish_shell s;
+  char line[128];
+  char name[16];
+  int i;
+  printf(">>>>>>>>>>>> SINK TEST\n");
+  if (mish_shell_new(shell_memory, SHELL_MEMORY_SIZE, &s) != mish_error_none ||
+      cmd_clear(&s, NULL) != mish_error_none ||
+      mish_shell_add_cmd(&s, "print-env", mish_builtin_print_env) == false) {
+    abort();
+  }
+  for (i = 0; i < 20; i++) {
+    snprintf(line, sizeof(line),
+             "def variable_%d:\"value number %d, long enough to fill the out buffer of the shell twice over\"\r\n", i, i);
+    if (mish_shell_eval(&s, line, strlen(line)) != mish_error_none) {
+      abort();
+    }
+  }
+
+  mish_shell_set_sink(&s, sink, sunk);
+  expect_output(&s, mish_shell_eval(&s, "print-env\r\n", 11), "");
+  if (sunk_size <= s.buff_size || flushes < 2) {
+    printf("output was not streamed: %lu bytes\n", (unsigned long)sunk_size);
+    abort();
+  }
+  for (i = 0; i < 20; i++) {
+    snprintf(name, sizeof(name), "\"variable_%d\"", i);
+    sunk[sunk_size] = '\0';
+    if (strstr(sunk, name) == NULL) {
+      printf("lost %s\n", name);
+      abort();
+    }
+  }
+
+  /* only the last stage goes to the sink */
+  sunk_size = 0;
+  expect_output(&s, mish_shell_eval(&s, "echo 1 | echo 2\r\n", 17), "");
+  if (sunk_size != 6 || strncmp(sunk, "2 1 \r\n", 6) != 0) {
+    printf("sunk \"%.*s\"\n", (int)sunk_size, sunk);
+    abort();
+  }
+  printf("sink_test: OK\n");
+}
+/* END: SINK TEST */
+
+/* BEGIN: CONFIG TEST */
+/* a shell with a small output and an environment that gets the rest */
+void config_test() {
+  mish_shell_config c;
+  mish_shell s;
+  size_t size;
+  printf(">>>>>>>>>>>> CONFIG TEST\n");
+  memset(&c, 0, sizeof(c));
+  c.arg_arena.bytes = 512;
+  c.str_arena.bytes = 256;
+  c.node_arena.bytes = 512;
+  c.str_arena.share = 1;
+  c.node_arena.share = 1;
+  c.out_buffer.bytes = 16;
+  c.prep_slot.bytes = 256;
+  c.prep_slots = 1;
+  c.buckets = 20;
+
+  size = mish_shell_config_size(&c);
+  if (size > SHELL_MEMORY_SIZE ||
+      mish_shell_new_config(shell_memory, size - 1, &c, &s) != mish_error_arena_too_small ||
+      mish_shell_new_config(shell_memory, size, &c, &s) != mish_error_none ||
+      cmd_clear(&s, NULL) != mish_error_none) {
+    printf("config of %lu bytes failed\n", (unsigned long)size);
+    abort();
+  }
+  if (s.buff_size < 17 || s.buff_size >= 32 || s.map.capacity != 16 ||
+      s.num_prep_slots != 1 || s.map.str_arena->buffsize <= 256 ||
+      s.map.node_arena->buffsize <= 512) {
+    printf("layout: out %lu buckets %lu\n", (unsigned long)s.buff_size, (unsigned long)s.map.capacity);
+    abort();
+  }
+  expect_output(&s, mish_shell_eval(&s, "def x:1\r\n", 9), "");
+  expect_output(&s, mish_shell_eval(&s, "echo $x 2 3 4 5 6\r\n", 19), "1 2 3 4 5 6 \r\n");
+
+  /* the memory beyond the minimum only goes to the environment */
+  if (mish_shell_new_config(shell_memory, size + 1024, &c, &s) != mish_error_none ||
+      s.buff_size >= 32 || s.arg_arena->buffsize >= 1024 ||
+      s.map.str_arena->buffsize + s.map.node_arena->buffsize < 768 + 1000) {
+    printf("shares were not given\n");
+    abort();
+  }
+  c.buckets = 0;
+  if (mish_shell_new_config(shell_memory, SHELL_MEMORY_SIZE, &c, &s) != mish_error_bad_memory_config) {
+    abort();
+  }
+  printf("config_test: OK\n");
+}
+/* END: CONFIG TEST */
+
+/* BEGIN: SCHEMA TEST */
+/* move <target> [speed:<number>] steps:<exact> */
+typedef struct {
+  mish_str target;
+  double speed;
+  uint64_t steps;
+} move_args;
+
+const mish_field move_fields[] = {
+  {{NULL, 0}, mish_fk_str, offsetof(move_args, target), true},
+  {{"speed", 5}, mish_fk_inexact, offsetof(move_args, speed), false},
+  {{"steps", 5}, mish_fk_exact, offsetof(move_args, steps), true}
+};
+const mish_schema move_schema = {move_fields, 3};
+
+move_args moved;
+mish_args_error move_error;
+
+mish_error_code cmd_move(mish_shell* s, mish_arg_list* args) {
+  if (s == NULL) { /* avoid warning */ }
+  moved.speed = 1.0;
+  return mish_args_extract(args, &move_schema, &moved, &move_error);
+}
+
+void expect_move(mish_shell* s, char* line, mish_error_code exp, size_t arg, int field) {
+  mish_error_code err = mish_shell_eval(s, line, strlen(line));
+  const mish_field* exp_field = field < 0 ? NULL : &move_fields[field];
+  if (err != exp || move_error.arg != arg || move_error.field != exp_field) {
+    printf("%s: %s at %lu\n", line, mish_util_error_str(err), (unsigned long)move_error.arg);
+    abort();
+  }
+}
+
+void schema_test() {
+  mish_shell s;
+  printf(">>>>>>>>>>>> SCHEMA TEST\n");
+  if (mish_shell_new(shell_memory, SHELL_MEMORY_SIZE, &s) != mish_error_none ||
+      cmd_clear(&s, NULL) != mish_error_none ||
+      mish_shell_add_cmd(&s, "move", cmd_move) == false) {
+    abort();
+  }
+  expect_move(&s, "move arm steps:20\r\n", mish_error_none, 0, -1);
+  if (moved.target.length != 3 || strncmp(moved.target.buffer, "arm", 3) != 0 ||
+      moved.speed != 1.0 || moved.steps != 20) {
+    printf("move was not extracted\n");
+    abort();
+  }
+  /* keys in any order, exact numbers are taken as inexact */
+  expect_move(&s, "def n:7\r\n", mish_error_none, 0, -1);
+  expect_move(&s, "move steps:$n 'leg' speed:2\r\n", mish_error_none, 0, -1);
+  if (moved.speed != 2.0 || moved.steps != 7) {
+    abort();
+  }
+  expect_move(&s, "move arm\r\n", mish_error_missing_arg, 0, 2);
+  expect_move(&s, "move arm steps:1.5\r\n", mish_error_bad_arg_type, 2, 2);
+  expect_move(&s, "move arm steps:1 steps:2\r\n", mish_error_unexpected_arg, 3, 2);
+  expect_move(&s, "move arm leg steps:1\r\n", mish_error_unexpected_arg, 2, -1);
+  expect_move(&s, "move arm force:1 steps:1\r\n", mish_error_unexpected_arg, 2, -1);
+  printf("schema_test: OK\n");
+}
+/* END: SCHEMA TEST */
+
+/* BEGIN: ARGS GET TEST */
+mish_atom got_ssid;
+mish_atom got_retries;
+bool got_nope;
+
+mish_error_code cmd_wifi(mish_shell* s, mish_arg_list* args) {
+  mish_atom nope;
+  if (s == NULL) { /* avoid warning */ }
+  got_nope = mish_args_get(args, "nope", &nope);
+  if (mish_args_get(args, "ssid", &got_ssid) == false ||
+      mish_args_get(args, "retries", &got_retries) == false) {
+    return mish_error_missing_arg;
+  }
+  return mish_error_none;
+}
+
+void expect_wifi(mish_shell* s, char* line) {
+  feed_result r;
+  mish_error_code err;
+  int i;
+  for (i = 0; i < 2; i++) {
+    if (i == 0) {
+      err = mish_shell_eval(s, line, strlen(line));
+    } else {
+      feed_line(s, line, 5, &r);
+      err = r.err;
+    }
+    if (err != mish_error_none || got_nope ||
+        got_ssid.kind != mish_atk_string ||
+        strncmp(got_ssid.contents.string.buffer, "home", 4) != 0 ||
+        got_retries.kind != mish_atk_exact_num || got_retries.contents.exact_num != 3) {
+      printf("%s: %s\n", line, mish_util_error_str(err));
+      abort();
+    }
+  }
+}
+
+void args_get_test() {
+  mish_shell s;
+  printf(">>>>>>>>>>>> ARGS GET TEST\n");
+  if (mish_shell_new(shell_memory, SHELL_MEMORY_SIZE, &s) != mish_error_none ||
+      cmd_clear(&s, NULL) != mish_error_none ||
+      mish_shell_add_cmd(&s, "wifi", cmd_wifi) == false) {
+    abort();
+  }
+  /* few pairs are scanned */
+  expect_wifi(&s, "wifi ssid:home retries:3\r\n");
+  /* the first pair of a key wins, with or without the index */
+  expect_wifi(&s, "wifi ssid:home retries:3 retries:4\r\n");
+  expect_wifi(&s, "wifi a:1 b:2 c:3 d:4 e:5 f:6 g:7 2:h ssid:home retries:3 retries:4\r\n");
+  /* piped pairs are in the index too */
+  expect_wifi(&s, "echo ssid:home retries:3 | wifi a:1 b:2 c:3 d:4 e:5 f:6 g:7\r\n");
+  printf("args_get_test: OK\n");
+}
+/* END: ARGS GET TEST */
+
+/* BEGIN: STATS TEST */
+#ifdef MISH_CFG_STATS
+uint32_t ticks = 0;
+
+uint32_t fake_clock(void) {
+  return ticks++;
+}
+
+#define STATS_SPACES (1 << 18)
+char spaced[2 * STATS_SPACES + 9 + 6];
+
+uint32_t cpu_clock(void) {
+  return (uint32_t)clock();
+}
+
+mish_cmd_stat* find_stat(mish_shell* s, mish_command cmd) {
+  size_t i;
+  for (i = 0; i < s->stats.num_cmds; i++) {
+    if (s->stats.cmds[i].cmd == cmd) {
+      return &s->stats.cmds[i];
+    }
+  }
+  return NULL;
+}
+
+void stats_test() {
+  mish_shell s;
+  mish_cmd_stat* echo;
+  char out[512];
+  printf(">>>>>>>>>>>> STATS TEST\n");
+  if (new_cached_shell(&s) != mish_error_none ||
+      cmd_clear(&s, NULL) != mish_error_none ||
+      mish_shell_add_cmd(&s, "stats", mish_builtin_stats) == false) {
+    abort();
+  }
+  /* nothing is counted without a clock */
+  expect_output(&s, mish_shell_eval(&s, "echo 1\r\n", 8), "1 \r\n");
+  if (s.stats.num_cmds != 0 || s.stats.dispatch.calls != 0) {
+    printf("stats counted without a clock\n");
+    abort();
+  }
+
+  mish_shell_set_clock(&s, fake_clock);
+  expect_output(&s, mish_shell_eval(&s, "def x:1\r\n", 9), "");
+  expect_output(&s, mish_shell_eval(&s, "echo $x | echo\r\n", 16), "1 \r\n");
+  expect_output(&s, mish_shell_eval(&s, "echo $x | echo\r\n", 16), "1 \r\n");
+  echo = find_stat(&s, mish_builtin_echo);
+  if (echo == NULL || echo->stat.calls != 4 || s.stats.dispatch.calls != 5 ||
+      echo->stat.total == 0 || echo->stat.max == 0) {
+    printf("commands were not counted\n");
+    abort();
+  }
+  /* the repeated line comes from the cache, it isn't parsed again */
+  if (s.stats.parse.calls != 3 || s.stats.lex.calls != 3) {
+    printf("parsed %u stages\n", (unsigned)s.stats.parse.calls);
+    abort();
+  }
+  if (mish_shell_eval(&s, "stats\r\n", 7) != mish_error_none) {
+    abort();
+  }
+  snprintf(out, sizeof(out), "%.*s", (int)s.written, s.out_buffer);
+  if (strstr(out, "\"echo\" calls:4 ") == NULL || strstr(out, "dispatch calls:6 ") == NULL) {
+    printf("stats printed \"%s\"\n", out);
+    abort();
+  }
+  expect_output(&s, mish_shell_eval(&s, "stats reset\r\n", 13), "");
+  if (find_stat(&s, mish_builtin_echo) != NULL || s.stats.clock != fake_clock) {
+    printf("stats were not reset\n");
+    abort();
+  }
+
+  /* the first lexeme of a stage is lexed before the stage is timed,
+   * here it is slow to lex and parsing the rest of the stage is not
+   */
+  memset(spaced, ' ', sizeof(spaced));
+  memcpy(spaced + STATS_SPACES, "echo $x |", 9);
+  memcpy(spaced + sizeof(spaced) - 6, "echo\r\n", 6);
+  mish_shell_set_clock(&s, cpu_clock);
+  if (mish_shell_eval_script(&s, spaced, sizeof(spaced), NULL, NULL) != mish_error_none ||
+      s.stats.parse.calls != 2 || s.stats.parse.max > UINT32_MAX / 2 ||
+      s.stats.parse.total > UINT32_MAX) {
+    printf("parse max:%lu total:%lu\n", (unsigned long)s.stats.parse.max,
+           (unsigned long)s.stats.parse.total);
+    abort();
+  }
+  printf("stats_test: OK\n");
+}
+#endif
+/* END: STATS TEST */
+
 int main() {
   eval_test();
+  prepared_test();
+  compact_test();
+  snapshot_test();
+  static_test();
+  session_test();
+  feed_test();
+#ifdef MISH_CFG_THREADS
+  threads_test();
+#endif
+  script_test();
+  results_test();
+  sink_test();
+  config_test();
+  schema_test();
+  args_get_test();
+#ifdef MISH_CFG_STATS
+  stats_test();
+#endif
   return 0;
 }
@@ -1,6 +1,10 @@
+#include <float.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+
+size_t decode_count = 0;
+#define UTF8_DECODE_HOOK() (decode_count++)
 #include "../mish.c"
 
 /* BEGIN: SHARED */
@@ -11,6 +15,22 @@ char print_buffer[PRINT_BUFFER_SIZE] = {0};
 #define SHELL_MEMORY_SIZE 8192
 uint8_t shell_memory[SHELL_MEMORY_SIZE] = {0};
 
+/* the cache of parsed lines is opt-in, this is the default
+ * layout with a share of it
+ */
+mish_error_code new_cached_shell(mish_shell* s) {
+  mish_shell_config c;
+  memset(&c, 0, sizeof(c));
+  c.arg_arena.share = 16;
+  c.str_arena.share = 36;
+  c.node_arena.share = 28;
+  c.out_buffer.share = 24;
+  c.prep_slot.share = 16;
+  c.buckets = 32;
+  c.prep_slots = 2;
+  return mish_shell_new_config(shell_memory, SHELL_MEMORY_SIZE, &c, s);
+}
+
 char cmd1[] = "def cmd:i2cscan port:8080\n";
 char cmd2[] = "echo a:abcde b:123 c:0b101 d:0xCAFE e:123.001 f:\"\x68\U00000393\U000030AC\U000101FA\"\n";
 char cmd3[] = "echo $cmd $port\n";
@@ -51,6 +71,47 @@ void check_rune(char** curr_char, utf8_rune expected) {
   }
 }
 
+char* utf8_invalid_data[] = {
+  "\xC0\x80",         /* overlong NUL */
+  "\xC1\xBF",         /* overlong '\x7F' */
+  "\xE0\x80\xAF",     /* overlong '/' */
+  "\xED\xA0\x80",     /* surrogate U+D800 */
+  "\xED\xBF\xBF",     /* surrogate U+DFFF */
+  "\xF0\x8F\xBF\xBF", /* overlong U+FFFF */
+  "\xF4\x90\x80\x80", /* U+110000 */
+  "\xF5\x80\x80\x80",
+  "\x80",
+  "\xE3\x82",
+};
+
+void utf8_invalid_test() {
+  utf8_rune r;
+  mish_range bad;
+  char line[64];
+  size_t i;
+  size_t len;
+
+  for (i = 0; i < sizeof(utf8_invalid_data)/sizeof(char*); i++) {
+    len = strlen(utf8_invalid_data[i]);
+    if (utf8_decode(utf8_invalid_data[i], len, &r) != 0) {
+      printf("accepted invalid sequence %lu\n", (unsigned long)i);
+      abort();
+    }
+    /* put it after enough ASCII to go through the fast path */
+    len = snprintf(line, sizeof(line), "echo \"abcdefghijklmnopqrstuvwxyz%s\"\n",
+                   utf8_invalid_data[i]);
+    if (utf8_validate(line, len, &bad) || bad.begin != 32) {
+      printf("validated invalid sequence %lu\n", (unsigned long)i);
+      abort();
+    }
+  }
+
+  if (utf8_validate(utf8_test_data, strlen(utf8_test_data), &bad) == false) {
+    printf("rejected valid UTF-8\n");
+    abort();
+  }
+}
+
 /* very weak test, but can be improved later */
 void utf8_test() {
   char* curr_char;
@@ -61,6 +122,7 @@ void utf8_test() {
   check_rune(&curr_char, 0x0393);
   check_rune(&curr_char, 0x30AC);
   check_rune(&curr_char, 0x101FA);
+  utf8_invalid_test();
   printf("utf8_test: OK\n");
 }
 /* END: UTF8 TEST */
@@ -98,8 +160,282 @@ void lex_test() {
   lex_test_once(cmd2);
   lex_test_once(cmd3);
 }
+
+/* each rune must be decoded at most once,
+ * peeking and then advancing used to decode it twice
+ */
+size_t count_runes(char* s) {
+  size_t runes = 0;
+  while (*s != '\0') {
+    if ((*s & 0xC0) != 0x80) {
+      runes++;
+    }
+    s++;
+  }
+  return runes;
+}
+
+/* the lexer decodes what wasn't validated, bad and overlong
+ * sequences must fail at their position inside a string,
+ * right after an identifier and at the start of a token
+ */
+void decode_bad_test() {
+  const char* formats[] = {"echo \"ab%s\"", "echo ab%s", "echo %s"};
+  size_t offsets[] = {8, 7, 5};
+  char line[64];
+  size_t i, j, len;
+  lex l;
+
+  for (i = 0; i < sizeof(utf8_invalid_data)/sizeof(char*); i++) {
+    for (j = 0; j < sizeof(formats)/sizeof(formats[0]); j++) {
+      len = snprintf(line, sizeof(line), formats[j], utf8_invalid_data[i]);
+      decode_count = 0;
+      l = lex_new(line, len);
+      while (lex_next(&l) && l.lexeme.kind != lex_kind_eof) {}
+      if (l.err.code != mish_error_bad_rune ||
+          l.err.range.end != (int)offsets[j] || decode_count > 2) {
+        printf("sequence %lu in \"%s\": error %d at %d, %lu decodes\n",
+               (unsigned long)i, formats[j], l.err.code, l.err.range.end,
+               (unsigned long)decode_count);
+        abort();
+      }
+    }
+  }
+
+  /* the largest rune of each length, decoded once each */
+  decode_count = 0;
+  l = lex_new("echo \"\x7F\xDF\xBF\xEF\xBF\xBF\xF4\x8F\xBF\xBF\"", 17);
+  if (lex_next(&l) == false || lex_next(&l) == false ||
+      l.lexeme.kind != lex_kind_str || decode_count > 3) {
+    printf("rejected the largest runes, %lu decodes\n", (unsigned long)decode_count);
+    abort();
+  }
+}
+
+void decode_test() {
+  char* corpus[] = {cmd1, cmd2, cmd3, cmd4};
+  size_t runes = 0;
+  size_t i;
+  lex l;
+  printf(">>>>>>>>>>>> DECODE TEST\n");
+
+  decode_count = 0;
+  for (i = 0; i < sizeof(corpus)/sizeof(corpus[0]); i++) {
+    runes += count_runes(corpus[i]);
+    l = lex_new(corpus[i], strlen(corpus[i]));
+    while (lex_next(&l) && l.lexeme.kind != lex_kind_eof) {}
+    if (l.lexeme.kind != lex_kind_eof) {
+      printf("lex error: %d\n", l.err.code);
+      abort();
+    }
+  }
+
+  printf("runes: %lu, decodes: %lu (peek+next per rune: %lu)\n",
+         (unsigned long)runes,
+         (unsigned long)decode_count,
+         (unsigned long)runes*2);
+  if (decode_count > runes) {
+    printf("fail: runes decoded more than once\n");
+    abort();
+  }
+
+  decode_bad_test();
+  printf("decode_test: OK\n");
+}
+
+/* builds long literals with escapes and runes at every
+ * offset so that both the word scanner and its tail are exercised
+ */
+void strlit_test_once(mish_shell* s, char delim, size_t len, size_t esc_at) {
+  char source[256];
+  char expected[256];
+  size_t src_len = 0;
+  size_t exp_len = 0;
+  size_t i;
+  mish_str out;
+  lex l;
+
+  source[src_len++] = delim;
+  for (i = 0; i < len; i++) {
+    if (i == esc_at) {
+      source[src_len++] = '\\';
+      source[src_len++] = 't';
+      expected[exp_len++] = '\t';
+    } else if (i == esc_at + 3) {
+      source[src_len++] = '\\';
+      source[src_len++] = delim;
+      expected[exp_len++] = delim;
+    } else if (i == esc_at + 5) {
+      memcpy(source + src_len, "\u0393", 2);
+      memcpy(expected + exp_len, "\u0393", 2);
+      src_len += 2;
+      exp_len += 2;
+    } else {
+      source[src_len++] = 'a' + (i % 26);
+      expected[exp_len++] = 'a' + (i % 26);
+    }
+  }
+  source[src_len++] = delim;
+  source[src_len++] = ' ';
+
+  arena_free_all(s->arg_arena);
+  l = lex_new(source, src_len);
+  if (lex_next(&l) == false || l.lexeme.kind != lex_kind_str) {
+    printf("strlit: lex error %d on \"%.*s\"\n", l.err.code, (int)src_len, source);
+    abort();
+  }
+  out = par_create_string(s->arg_arena, &l);
+  if (out.length != exp_len || memcmp(out.buffer, expected, exp_len) != 0) {
+    printf("strlit: \"%.*s\" decoded to \"%.*s\"\n",
+           (int)src_len, source, (int)out.length, out.buffer);
+    abort();
+  }
+}
+
+void strlit_test() {
+  mish_shell s;
+  size_t len;
+  size_t esc_at;
+  lex l;
+  printf(">>>>>>>>>>>> STRLIT TEST\n");
+  if (mish_shell_new(shell_memory, SHELL_MEMORY_SIZE, &s) != mish_error_none) {
+    abort();
+  }
+
+  for (len = 0; len < 72; len++) {
+    for (esc_at = 0; esc_at <= len; esc_at++) {
+      strlit_test_once(&s, '"', len, esc_at);
+      strlit_test_once(&s, '\'', len, esc_at);
+    }
+  }
+
+  l = lex_new("\"abc\\qdef\"", 10);
+  if (lex_next(&l) || l.err.code != mish_error_invalid_syntax) {
+    printf("strlit: unknown escape was accepted\n");
+    abort();
+  }
+  l = lex_new("\"abcdefghijklmnopq", 18);
+  if (lex_next(&l) || l.err.code != mish_error_unexpected_EOF) {
+    printf("strlit: unterminated string was accepted\n");
+    abort();
+  }
+  printf("strlit_test: OK\n");
+}
 /* END: LEX TEST */
 
+/* BEGIN: INEXACT TEST */
+uint64_t inexact_rand_state = 0x9E3779B97F4A7C15;
+
+uint64_t inexact_rand() {
+  inexact_rand_state ^= inexact_rand_state << 13;
+  inexact_rand_state ^= inexact_rand_state >> 7;
+  inexact_rand_state ^= inexact_rand_state << 17;
+  return inexact_rand_state;
+}
+
+/* the lexer must give the same bits as strtod */
+void inexact_test_once(char* text) {
+  lex l = lex_new(text, strlen(text));
+  double expected = strtod(text, NULL);
+  if (lex_next(&l) == false || l.lexeme.vkind != lex_valkind_inexact_num ||
+      memcmp(&l.lexeme.value.inexact_num, &expected, sizeof(double)) != 0) {
+    printf("inexact: %s gave %.17g instead of %.17g\n",
+           text, l.lexeme.value.inexact_num, expected);
+    abort();
+  }
+}
+
+void inexact_test() {
+  char* fixed[] = {
+    "0.1", "1e-6", "2.5E+3", "1.e2", "0e0", "123.001",
+    "9007199254740993.0", "1.5e30", "4.9e-324", "2.4703282292062327e-324",
+    "2.4703282292062328e-324", "1.7976931348623157e308", "1.7976931348623159e308",
+    "1e400", "1e-400", "0.000000000000000000000000000000000000000000001",
+    "2.2250738585072011e-308", "2.2250738585072012e-308",
+    "179769313486231580793728971405303415079934132710037826936173778980444968292764750946649017977587207096330286416692887910946555547851940402630657488671505820681908902000708383676273854845817711531764475730270069855571366959622842914819860834936475292719074168444365510704342711559699508093042880177904174497791.9999999999999999999999999999999999999999999999999999999999999999999999",
+    "9007199254740992.00000000000000000000000000000000000000000000000000000000000000000000000001",
+    /* the tie between 1 and the next double, on it and just past it */
+    "1.00000000000000011102230246251565404236316680908203125",
+    "1.000000000000000111022302462515654042363166809082031250000000000000000000000000001",
+    "1.0000000000000001110223024625156540423631668090820312499999999999999999999999999"
+  };
+  char text[64];
+  char tie_text[832];
+  long double tie;
+  int exp2;
+  double d;
+  uint64_t bits;
+  size_t i;
+  lex l;
+  printf(">>>>>>>>>>>> INEXACT TEST\n");
+
+  for (i = 0; i < sizeof(fixed)/sizeof(fixed[0]); i++) {
+    inexact_test_once(fixed[i]);
+  }
+
+  for (i = 0; i < 200000; i++) {
+    /* any positive double, printed with a random amount of digits */
+    bits = inexact_rand() & ~(UINT64_C(1) << 63);
+    memcpy(&d, &bits, sizeof(double));
+    if (d != d || d > 1.7976931348623157e308) {
+      continue;
+    }
+    snprintf(text, sizeof(text), "%.*e", (int)(inexact_rand() % 25), d);
+    inexact_test_once(text);
+
+    /* round trips of doubles near 1, where Eisel-Lemire is used */
+    bits = (inexact_rand() >> 12) | ((UINT64_C(1023) + inexact_rand() % 201 - 100) << 52);
+    memcpy(&d, &bits, sizeof(double));
+    snprintf(text, sizeof(text), "%.*e", (int)(inexact_rand() % 25), d);
+    inexact_test_once(text);
+
+    /* plain decimals around the magnitudes people type */
+    snprintf(text, sizeof(text), "%lu.%lue%d",
+             (unsigned long)(inexact_rand() % 100000),
+             (unsigned long)(inexact_rand() % 1000000000),
+             (int)(inexact_rand() % 60) - 30);
+    inexact_test_once(text);
+  }
+
+  /* ties between two doubles, printed exactly or with a few digits
+   * less, need more than the 64 bits of x87 long doubles
+   */
+  for (i = 0; LDBL_MANT_DIG >= 64 && i < 5000; i++) {
+    bits = inexact_rand();
+    tie = (long double)(((bits >> 11) | (UINT64_C(1) << 52)) * 2 + 1);
+    if (i % 4 == 0) {
+      /* a subnormal */
+      tie = (long double)((bits >> (12 + bits % 52)) * 2 + 1);
+      exp2 = -1075;
+    } else {
+      exp2 = (int)(inexact_rand() % 2045) - 1075;
+    }
+    for (; exp2 > 0; exp2--) {
+      tie *= 2;
+    }
+    for (; exp2 < 0; exp2++) {
+      tie /= 2;
+    }
+    snprintf(tie_text, sizeof(tie_text), "%.*Le",
+             i % 3 == 0 ? 800 : 30 + (int)(inexact_rand() % 40), tie);
+    inexact_test_once(tie_text);
+  }
+
+
+  l = lex_new("1_000.000_1e1_0", 15);
+  if (lex_next(&l) == false || l.lexeme.value.inexact_num != 1000.0001e10) {
+    printf("inexact: underscores changed the value\n");
+    abort();
+  }
+  l = lex_new("1e+ ", 4);
+  if (lex_next(&l) || l.err.code != mish_error_invalid_syntax) {
+    printf("inexact: exponent without digits was accepted\n");
+    abort();
+  }
+  printf("inexact_test: OK\n");
+}
+/* END: INEXACT TEST */
+
 /* BEGIN: MAP TEST */
 void print_atom(mish_atom a) {
   size_t offset = 0;
@@ -188,6 +524,43 @@ void map_test_once(mish_shell* s) {
   }
 }
 
+/* fills the table until it refuses more keys,
+ * every key inserted must still be found
+ */
+void map_fill_test(mish_shell* s) {
+  uint64_t i;
+  uint64_t inserted = 0;
+  mish_atom out;
+
+  map_clear(&s->map);
+  for (i = 0; i < 4 * s->map.capacity; i++) {
+    if (map_insert(&s->map, mish_atom_create_num_exact(i * 7919), mish_atom_create_num_exact(i)) == false) {
+      break;
+    }
+    inserted++;
+  }
+  if (inserted == 0 || inserted > map_max_count(&s->map)) {
+    printf("fail: inserted %lu keys in %lu slots\n",
+           (unsigned long)inserted, (unsigned long)s->map.capacity);
+    abort();
+  }
+  /* changing the seed rehashes the environment in place */
+  mish_shell_set_seed(s, 0x9747b28c);
+  for (i = 0; i < inserted; i++) {
+    if (map_find(&s->map, mish_atom_create_num_exact(i * 7919), &out) == false ||
+        out.contents.exact_num != i) {
+      printf("fail: lost key %lu\n", (unsigned long)i);
+      abort();
+    }
+  }
+  if (map_find(&s->map, mish_atom_create_num_exact(1), &out)) {
+    printf("fail: found key that was never inserted\n");
+    abort();
+  }
+  mish_shell_set_seed(s, 0);
+  map_clear(&s->map);
+}
+
 void map_test() {
   mish_shell s;
   mish_error_code err;
@@ -212,6 +585,7 @@ void map_test() {
     }
   }
 
+  map_fill_test(&s);
   printf("success!");
   printf("\n");
 }
@@ -247,8 +621,9 @@ void eval_once(mish_shell* s, char* cmd) {
 void eval_test() {
   mish_shell s;
   mish_error_code err;
+  mish_peaks peaks;
   printf(">>>>>>>>>>>> EVAL TEST\n");
-  err = mish_shell_new(shell_memory, SHELL_MEMORY_SIZE, &s);
+  err = new_cached_shell(&s);
   if (err != mish_error_none) {
     printf("error: %d\n", err);
     abort();
@@ -260,13 +635,151 @@ void eval_test() {
   eval_once(&s, cmd1);
   eval_once(&s, cmd3);
   eval_once(&s, cmd4);
+  eval_once(&s, cmd3);
+
+  if (prep_find(&s, cmd3, strlen(cmd3)) == NULL) {
+    printf("repeated line is not in the prepared command cache\n");
+    abort();
+  }
+
+  /* arenas are freed after every line, their peaks stay */
+  mish_shell_peaks(&s, &peaks);
+  if (peaks.arg_arena == 0 || peaks.arg_arena < arena_used(s.arg_arena) ||
+      peaks.out_buffer < 20 || peaks.map_count != 4 || peaks.prep_slot == 0) {
+    printf("peaks: arg %lu out %lu keys %lu slot %lu\n",
+           (unsigned long)peaks.arg_arena, (unsigned long)peaks.out_buffer,
+           (unsigned long)peaks.map_count, (unsigned long)peaks.prep_slot);
+    abort();
+  }
+  mish_shell_reset_peaks(&s);
+  mish_shell_peaks(&s, &peaks);
+  if (peaks.arg_arena != arena_used(s.arg_arena) || peaks.out_buffer != s.written) {
+    printf("peaks are not reset\n");
+    abort();
+  }
+
+  err = mish_shell_eval(&s, "echo \"\xED\xA0\x80\"\n", 10);
+  if (err != mish_error_bad_rune || s.err.range.begin != 6 || s.err.range.end != 7) {
+    printf("surrogate: error %d at %d:%d\n", err, s.err.range.begin, s.err.range.end);
+    abort();
+  }
 }
 /* END: EVAL TEST */
 
+/* BEGIN: FMT TEST */
+void fmt_check(char* got, size_t got_len, char* exp) {
+  if (got_len != strlen(exp) || memcmp(got, exp, got_len) != 0) {
+    printf("expected %s, got %.*s\n", exp, (int)got_len, got);
+    abort();
+  }
+}
+
+size_t fmt_double_str(char* got, double d) {
+  fmt_buffer b = fmt_buffer_new(got, FMT_DOUBLE_SIZE + 1);
+  fmt_double(fmt_buffer_put, &b, d);
+  return fmt_buffer_end(&b);
+}
+
+void fmt_test() {
+  double doubles[] = {
+    0.0, -0.0, 0.5, 1.0, 0.0000005, 0.0000015, 0.0000025, 2.5e-7,
+    123.001, 1e15, 1e22, 1.7976931348623157e308, 4.9e-324, -3.25,
+    0.1, 1.0/3.0, 1e6 + 0.5
+  };
+  int64_t ints[] = {0, 1, -1, 9, 10, 1000000000, INT64_MAX, INT64_MIN};
+  char got[FMT_DOUBLE_SIZE + 1], exp[FMT_DOUBLE_SIZE + 1];
+  uint64_t bits = 0x9E3779B97F4A7C15;
+  double d;
+  size_t i;
+  printf(">>>>>>>>>>>> FMT TEST\n");
+
+  for (i = 0; i < sizeof(doubles)/sizeof(double); i++) {
+    snprintf(exp, sizeof(exp), "%f", doubles[i]);
+    fmt_check(got, fmt_double_str(got, doubles[i]), exp);
+  }
+  /* random bit patterns, most of them far from 1 */
+  for (i = 0; i < 20000; i++) {
+    bits ^= bits << 13;
+    bits ^= bits >> 7;
+    bits ^= bits << 17;
+    memcpy(&d, &bits, sizeof(double));
+    if (d != d) {
+      continue;
+    }
+    snprintf(exp, sizeof(exp), "%f", d);
+    fmt_check(got, fmt_double_str(got, d), exp);
+    snprintf(exp, sizeof(exp), "%f", (double)(int64_t)bits / 1e9);
+    fmt_check(got, fmt_double_str(got, (double)(int64_t)bits / 1e9), exp);
+  }
+  for (i = 0; i < sizeof(ints)/sizeof(int64_t); i++) {
+    snprintf(exp, sizeof(exp), "%lld", (long long)ints[i]);
+    fmt_check(got, fmt_i64(got, ints[i]), exp);
+    snprintf(exp, sizeof(exp), "%llx", (unsigned long long)ints[i]);
+    fmt_check(got, fmt_u64(got, (uint64_t)ints[i], 16), exp);
+  }
+  fmt_check(got, fmt_u64(got, 5, 2), "101");
+  fmt_check(got, fmt_u64(got, UINT64_MAX, 2),
+            "1111111111111111111111111111111111111111111111111111111111111111");
+
+  /* truncation works like snprintf */
+  i = mish_snprint_atom(got, 4, mish_atom_create_num_exact(123456));
+  fmt_check(got, strlen(got), "123");
+  if (i != 6) {
+    abort();
+  }
+  i = mish_snprint_atom(got, sizeof(got), mish_atom_create_str("a\"b\\"));
+  fmt_check(got, i, "\"a\\\"b\\\\\"");
+}
+/* END: FMT TEST */
+
+/* BEGIN: ARGS INDEX TEST */
+bool index_built_before;
+bool index_built_after;
+
+mish_error_code cmd_lookup(mish_shell* s, mish_arg_list* args) {
+  mish_atom v;
+  if (s == NULL) { /* avoid warning */ }
+  index_built_before = args->index->built;
+  if (mish_args_get(args, "ssid", &v) == false) {
+    return mish_error_missing_arg;
+  }
+  index_built_after = args->index->slots != NULL;
+  return mish_error_none;
+}
+
+void expect_index(mish_shell* s, char* line, bool indexed) {
+  mish_error_code err = mish_shell_eval(s, line, strlen(line));
+  if (err != mish_error_none || index_built_before || index_built_after != indexed) {
+    printf("%s: %s, built %d then %d\n", line, mish_util_error_str(err),
+           index_built_before, index_built_after);
+    abort();
+  }
+}
+
+void args_index_test() {
+  mish_shell s;
+  printf(">>>>>>>>>>>> ARGS INDEX TEST\n");
+  if (mish_shell_new(shell_memory, SHELL_MEMORY_SIZE, &s) != mish_error_none ||
+      cmd_clear(&s, NULL) != mish_error_none ||
+      mish_shell_add_cmd(&s, "lookup", cmd_lookup) == false) {
+    abort();
+  }
+  /* the index is only built by the first lookup, and only for many pairs */
+  expect_index(&s, "lookup ssid:home\r\n", false);
+  expect_index(&s, "lookup a:1 b:2 c:3 d:4 e:5 f:6 g:7 h:8 ssid:home\r\n", true);
+  expect_index(&s, "echo a:1 | lookup b:2 c:3 d:4 e:5 f:6 g:7 h:8 ssid:home\r\n", true);
+}
+/* END: ARGS INDEX TEST */
+
 int main() {
   utf8_test();
   lex_test();
+  decode_test();
+  strlit_test();
+  inexact_test();
   map_test();
   eval_test();
+  fmt_test();
+  args_index_test();
   return 0;
 }
@@ -0,0 +1,196 @@
+/*
+  Generates a static command table (see mish_static_table) from a list
+  of commands, one per line:
+
+    <name> <function>
+
+  usage: gen-cmd-table <table name> < commands.txt > commands.h
+
+  The output defines the table and declares the functions,
+  it can be included by a single translation unit.
+  Hashing is done with the functions of the shell itself,
+  so this has to be rebuilt when they change.
+*/
+
+#include <stdio.h>
+#include "../mish.c"
+
+#define GEN_MAX_CMDS    1024 /* a power of two */
+#define GEN_MAX_NAME    64   /* including the terminator */
+#define GEN_MAX_TRIES   (1u << 20)
+#define GEN_MAX_SEEDS   64
+
+typedef struct {
+  char name[GEN_MAX_NAME + 1]; /* one more to tell too long names */
+  char func[GEN_MAX_NAME + 1];
+  uint32_t hash;
+} gen_cmd;
+
+gen_cmd cmds[GEN_MAX_CMDS];
+size_t num_cmds = 0;
+size_t num_slots = 0;
+
+uint32_t disps[GEN_MAX_CMDS];
+int slot_of[GEN_MAX_CMDS]; /* command in each slot, -1 if free */
+size_t order[GEN_MAX_CMDS]; /* buckets, biggest first */
+size_t bucket_size[GEN_MAX_CMDS];
+
+size_t gen_pow2_ceil(size_t n) {
+  size_t p = 1;
+  while (p < n) {
+    p *= 2;
+  }
+  return p;
+}
+
+bool gen_read(void) {
+  size_t i;
+  while (num_cmds < GEN_MAX_CMDS &&
+         scanf("%64s %64s", cmds[num_cmds].name, cmds[num_cmds].func) == 2) {
+    if (strlen(cmds[num_cmds].name) >= GEN_MAX_NAME ||
+        strlen(cmds[num_cmds].func) >= GEN_MAX_NAME) {
+      fprintf(stderr, "name too long: %s\n", cmds[num_cmds].name);
+      return false;
+    }
+    for (i = 0; i < num_cmds; i++) {
+      if (strcmp(cmds[i].name, cmds[num_cmds].name) == 0) {
+        fprintf(stderr, "duplicated command: %s\n", cmds[i].name);
+        return false;
+      }
+    }
+    num_cmds++;
+  }
+  if (!feof(stdin)) {
+    fprintf(stderr, "too many commands or bad line\n");
+    return false;
+  }
+  return true;
+}
+
+/* tries to place every command of the bucket with the displacement */
+bool gen_place(size_t bucket, size_t num_buckets, uint32_t disp) {
+  size_t i, j;
+  uint32_t slot;
+  for (i = 0; i < num_cmds; i++) {
+    if ((cmds[i].hash & (num_buckets - 1)) != bucket) {
+      continue;
+    }
+    slot = map_static_slot(cmds[i].hash, disp, (uint32_t)num_slots);
+    if (slot_of[slot] != -1) {
+      /* undo this bucket */
+      for (j = 0; j < num_slots; j++) {
+        if (slot_of[j] != -1 && (cmds[slot_of[j]].hash & (num_buckets - 1)) == bucket) {
+          slot_of[j] = -1;
+        }
+      }
+      return false;
+    }
+    slot_of[slot] = (int)i;
+  }
+  return true;
+}
+
+/* hash and displace: buckets are placed biggest first,
+ * each one gets the first displacement that sends its
+ * commands to free slots
+ */
+bool gen_build(uint32_t seed, size_t num_buckets) {
+  size_t i, j, tmp;
+  uint32_t disp;
+
+  for (i = 0; i < num_cmds; i++) {
+    cmds[i].hash = map_murmur_hash(cmds[i].name, strlen(cmds[i].name), seed);
+  }
+  for (i = 0; i < num_slots; i++) {
+    slot_of[i] = -1;
+  }
+  for (i = 0; i < num_buckets; i++) {
+    bucket_size[i] = 0;
+    order[i] = i;
+  }
+  for (i = 0; i < num_cmds; i++) {
+    bucket_size[cmds[i].hash & (num_buckets - 1)]++;
+  }
+  for (i = 0; i < num_buckets; i++) {
+    for (j = i + 1; j < num_buckets; j++) {
+      if (bucket_size[order[j]] > bucket_size[order[i]]) {
+        tmp = order[i]; order[i] = order[j]; order[j] = tmp;
+      }
+    }
+  }
+
+  for (i = 0; i < num_buckets; i++) {
+    disps[order[i]] = 0;
+    if (bucket_size[order[i]] == 0) {
+      continue;
+    }
+    for (disp = 0; disp < GEN_MAX_TRIES; disp++) {
+      if (gen_place(order[i], num_buckets, disp)) {
+        disps[order[i]] = disp;
+        break;
+      }
+    }
+    if (disp == GEN_MAX_TRIES) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void gen_print(char* table, uint32_t seed, size_t num_buckets) {
+  size_t i;
+  gen_cmd* c;
+
+  printf("/* generated by tools/gen-cmd-table, do not edit */\n");
+  for (i = 0; i < num_cmds; i++) {
+    printf("mish_error_code %s(mish_shell* s, mish_arg_list* args);\n", cmds[i].func);
+  }
+  printf("\nconst mish_named_cmd %s_cmds[%lu] = {\n", table, (unsigned long)num_slots);
+  for (i = 0; i < num_slots; i++) {
+    if (slot_of[i] == -1) {
+      printf("  {{NULL, 0}, NULL}%s\n", i + 1 < num_slots ? "," : "");
+      continue;
+    }
+    c = &cmds[slot_of[i]];
+    printf("  {{\"%s\", %lu}, %s}%s\n", c->name, (unsigned long)strlen(c->name),
+           c->func, i + 1 < num_slots ? "," : "");
+  }
+  printf("};\n\nconst uint32_t %s_disps[%lu] = {", table, (unsigned long)num_buckets);
+  for (i = 0; i < num_buckets; i++) {
+    printf("%s%lu", i == 0 ? "" : ", ", (unsigned long)disps[i]);
+  }
+  printf("};\n\nconst mish_static_table %s = {\n", table);
+  printf("  %s_cmds, %s_disps, %lu, %lu, %lu\n};\n", table, table,
+         (unsigned long)num_slots, (unsigned long)num_buckets, (unsigned long)seed);
+}
+
+int main(int argc, char** argv) {
+  uint32_t seed;
+  size_t num_buckets;
+
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <table name> < commands.txt\n", argv[0]);
+    return 1;
+  }
+  if (gen_read() == false) {
+    return 1;
+  }
+  if (num_cmds == 0) {
+    fprintf(stderr, "no commands\n");
+    return 1;
+  }
+
+  /* about 4 commands per bucket keeps the table of displacements small,
+   * both sizes are rounded up to powers of two so lookups mask instead of dividing
+   */
+  num_slots = gen_pow2_ceil(num_cmds);
+  num_buckets = gen_pow2_ceil((num_cmds + 3) / 4);
+  for (seed = 0; seed < GEN_MAX_SEEDS; seed++) {
+    if (gen_build(seed, num_buckets)) {
+      gen_print(argv[1], seed, num_buckets);
+      return 0;
+    }
+  }
+  fprintf(stderr, "failed to build a perfect hash\n");
+  return 1;
+}
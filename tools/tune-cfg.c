@@ -0,0 +1,425 @@
+/*
+  Sizes the memory of a shell from a log of the lines it runs,
+  one per line:
+
+    def ssid:meuwifi pwd:"12345678"
+    wifi-connect $ssid $pwd
+
+  usage: tune-cfg [-o min out bytes] [-m margin percent] [-x] < commands.log
+
+  Every line is replayed on a shell with plenty of memory, once through
+  mish_shell_eval and once without the command cache, and the peaks of
+  its regions (see mish_shell_peaks) give the smallest total memory and
+  split of MISH_CFG_GRANULARITY that runs the whole log without running
+  out of memory. The output is a config block for mish.h.
+
+  def, echo, clear, compact, mem and env are the builtins, any other
+  command does nothing, so the out buffer only has to hold what echo
+  prints; -o asks for a bigger one. -m adds a margin to every peak, and
+  -x leaves the command cache out. Peaks include overwritten variables,
+  since the replay never compacts the environment.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "../mish.c"
+
+#define TUNE_MEMORY    (1 << 22)
+#define TUNE_MAX_CMDS  1024
+#define TUNE_MAX_NAME  64
+#define TUNE_MAX_TOTAL (1 << 26)
+
+enum {
+  TUNE_ARG,
+  TUNE_STR,
+  TUNE_NODE,
+  TUNE_BUCKET,
+  TUNE_OUT,
+  TUNE_PREP,
+  TUNE_REGIONS
+};
+
+const char* region_names[TUNE_REGIONS] = {
+  "MISH_CFG_ARG_ARENA_SIZE",
+  "MISH_CFG_STR_ARENA_SIZE",
+  "MISH_CFG_NODE_ARENA_SIZE",
+  "MISH_CFG_HASHMAP_BUCKET_ARRAY_SIZE",
+  "MISH_CFG_OUT_BUFFER_SIZE",
+  "MISH_CFG_PREP_CACHE_SIZE"
+};
+
+/* commands of the log that aren't builtins */
+char cmd_names[TUNE_MAX_CMDS][TUNE_MAX_NAME];
+size_t num_cmds = 0;
+
+mish_peaks peaks;
+size_t min_out = 0;
+size_t margin = 0;
+bool use_cache = true;
+
+mish_error_code tune_stub(mish_shell* s, mish_arg_list* list) {
+  if (s == NULL || list == NULL) { /* avoid warning */ }
+  return mish_error_none;
+}
+
+mish_error_code tune_clear(mish_shell* s, mish_arg_list* list) {
+  bool ok = true;
+  size_t i;
+  mish_builtin_hard_clear(s, list);
+
+  ok = ok && mish_shell_add_cmd(s, "def", mish_builtin_def);
+  ok = ok && mish_shell_add_cmd(s, "echo", mish_builtin_echo);
+  ok = ok && mish_shell_add_cmd(s, "compact", mish_builtin_compact);
+  ok = ok && mish_shell_add_cmd(s, "mem", mish_builtin_available_env_memory);
+  ok = ok && mish_shell_add_cmd(s, "env", mish_builtin_print_env);
+  ok = ok && mish_shell_add_cmd(s, "clear", tune_clear);
+  for (i = 0; i < num_cmds; i++) {
+    ok = ok && mish_shell_add_cmd(s, cmd_names[i], tune_stub);
+  }
+  if (ok == false) {
+    return mish_error_insert_failed;
+  }
+  return mish_error_none;
+}
+
+/* BEGIN: LOG */
+bool tune_is_builtin(const char* name) {
+  return strcmp(name, "def") == 0 || strcmp(name, "echo") == 0 ||
+         strcmp(name, "clear") == 0 || strcmp(name, "compact") == 0 ||
+         strcmp(name, "mem") == 0 || strcmp(name, "env") == 0;
+}
+
+void tune_add_name(const char* name, size_t size) {
+  char buffer[TUNE_MAX_NAME];
+  size_t i;
+  if (size == 0 || size >= TUNE_MAX_NAME || name[0] == '$') {
+    return;
+  }
+  memcpy(buffer, name, size);
+  buffer[size] = '\0';
+  if (tune_is_builtin(buffer)) {
+    return;
+  }
+  for (i = 0; i < num_cmds; i++) {
+    if (strcmp(cmd_names[i], buffer) == 0) {
+      return;
+    }
+  }
+  if (num_cmds == TUNE_MAX_CMDS) {
+    fprintf(stderr, "too many commands, %s is left unknown\n", buffer);
+    return;
+  }
+  memcpy(cmd_names[num_cmds++], buffer, size + 1);
+}
+
+/* the first word of the line and of every stage after a '|' */
+void tune_scan_names(const char* line, size_t size) {
+  size_t i = 0, begin;
+  char quote;
+  for (;;) {
+    while (i < size && (line[i] == ' ' || line[i] == '\t' || line[i] == '\r')) {
+      i++;
+    }
+    begin = i;
+    while (i < size && line[i] != ' ' && line[i] != '\t' &&
+           line[i] != '\r' && line[i] != '|') {
+      i++;
+    }
+    tune_add_name(line + begin, i - begin);
+    /* the rest of the stage, strings may hold a '|' */
+    while (i < size && line[i] != '|') {
+      if (line[i] == '"' || line[i] == '\'') {
+        quote = line[i++];
+        while (i < size && line[i] != quote) {
+          i += line[i] == '\\' ? 2 : 1;
+        }
+      }
+      i++;
+    }
+    if (i >= size) {
+      return;
+    }
+    i++;
+  }
+}
+
+/* lines end at '\n', which stays with them, blank lines are dropped.
+ * Returns the number of lines.
+ */
+size_t tune_split(char* log, size_t size, char** lines, size_t* sizes) {
+  size_t n = 0, begin = 0, i, j;
+  for (i = 0; i < size; i++) {
+    if (log[i] != '\n') {
+      continue;
+    }
+    for (j = begin; j < i && (log[j] == ' ' || log[j] == '\t' || log[j] == '\r'); j++);
+    if (j < i) {
+      lines[n] = log + begin;
+      sizes[n] = i + 1 - begin;
+      n++;
+    }
+    begin = i + 1;
+  }
+  return n;
+}
+
+char* tune_read(size_t* size) {
+  size_t cap = 4096, n;
+  char* log = (char*)malloc(cap);
+  *size = 0;
+  while (log != NULL) {
+    n = fread(log + *size, 1, cap - *size - 1, stdin);
+    *size += n;
+    if (n == 0) {
+      break;
+    }
+    if (*size + 1 == cap) {
+      cap *= 2;
+      log = (char*)realloc(log, cap);
+    }
+  }
+  /* the last line may miss its newline */
+  if (log != NULL && *size > 0 && log[*size - 1] != '\n') {
+    log[(*size)++] = '\n';
+  }
+  return log;
+}
+/* END: LOG */
+
+/* BEGIN: REPLAY */
+void tune_max(size_t* peak, size_t value) {
+  if (value > *peak) {
+    *peak = value;
+  }
+}
+
+void tune_add_peaks(mish_shell* s) {
+  mish_peaks p;
+  mish_shell_peaks(s, &p);
+  tune_max(&peaks.arg_arena, p.arg_arena);
+  tune_max(&peaks.str_arena, p.str_arena);
+  tune_max(&peaks.node_arena, p.node_arena);
+  tune_max(&peaks.map_count, p.map_count);
+  tune_max(&peaks.out_buffer, p.out_buffer);
+  tune_max(&peaks.prep_slot, p.prep_slot);
+}
+
+/* every region gets plenty, the cache is opt-in in mish.h */
+mish_error_code tune_new_shell(uint8_t* memory, mish_shell* s) {
+  mish_shell_config c;
+  memset(&c, 0, sizeof(c));
+  c.arg_arena.share = 1;
+  c.str_arena.share = 1;
+  c.node_arena.share = 1;
+  c.out_buffer.share = 1;
+  c.prep_slot.share = 1;
+  c.buckets = TUNE_MEMORY / 64;
+  c.prep_slots = MISH_CFG_PREP_CACHE_SLOTS;
+  return mish_shell_new_config(memory, TUNE_MEMORY, &c, s);
+}
+
+/* returns the number of lines that failed, report prints them */
+size_t tune_replay(char** lines, size_t* sizes, size_t n, bool cached, bool report) {
+  uint8_t* memory = (uint8_t*)malloc(TUNE_MEMORY);
+  mish_shell s;
+  mish_error_code err;
+  size_t i, failed = 0;
+
+  if (memory == NULL ||
+      tune_new_shell(memory, &s) != mish_error_none ||
+      tune_clear(&s, NULL) != mish_error_none) {
+    fprintf(stderr, "shell setup failed\n");
+    exit(1);
+  }
+  mish_shell_reset_peaks(&s);
+  for (i = 0; i < n; i++) {
+    if (cached) {
+      err = mish_shell_eval(&s, lines[i], sizes[i]);
+    } else {
+      err = mish_shell_eval_script(&s, lines[i], sizes[i], NULL, NULL);
+    }
+    if (err != mish_error_none) {
+      if (report) {
+        fprintf(stderr, "line %lu: %s\n", (unsigned long)i + 1, mish_util_error_str(err));
+      }
+      failed++;
+    }
+  }
+  tune_add_peaks(&s);
+  free(memory);
+  return failed;
+}
+/* END: REPLAY */
+
+/* BEGIN: SIZING */
+size_t tune_with_margin(size_t peak) {
+  return peak + (peak * margin + 99) / 100;
+}
+
+bool tune_arena_fits(size_t region, size_t peak) {
+  return region > sizeof(mish_arena) && region - sizeof(mish_arena) > tune_with_margin(peak);
+}
+
+/* whether a region of this size holds what the log needs,
+ * following what mish_shell_new does with it
+ */
+bool tune_fits(int region, size_t size) {
+  size_t n = MISH_CFG_PREP_CACHE_SLOTS;
+  size_t cap;
+  switch (region) {
+  case TUNE_ARG:
+    return tune_arena_fits(size, peaks.arg_arena);
+  case TUNE_STR:
+    return tune_arena_fits(size, peaks.str_arena);
+  case TUNE_NODE:
+    return tune_arena_fits(size, peaks.node_arena);
+  case TUNE_BUCKET:
+    cap = util_pow2_floor(size / sizeof(mish_map_slot));
+    return cap > 0 && cap - cap / 8 - 1 >= tune_with_margin(peaks.map_count);
+  case TUNE_OUT:
+    return size > tune_with_margin(peaks.out_buffer) && size >= min_out;
+  case TUNE_PREP:
+    if (use_cache == false || n == 0) {
+      return true;
+    }
+    if (size < n * sizeof(mish_prepared)) {
+      return false;
+    }
+    return tune_arena_fits(util_align_trim_down((size - n * sizeof(mish_prepared)) / n),
+                           peaks.prep_slot);
+  }
+  return false;
+}
+
+/* the smallest ratio of the region that fits with this total,
+ * MISH_CFG_GRANULARITY + 1 if none does
+ */
+size_t tune_ratio(int region, size_t total) {
+  size_t ratio;
+  if (region == TUNE_PREP && tune_fits(region, 0)) {
+    return 0;
+  }
+  for (ratio = 1; ratio <= MISH_CFG_GRANULARITY; ratio++) {
+    if (tune_fits(region, shell_compute_size(total, ratio))) {
+      return ratio;
+    }
+  }
+  return MISH_CFG_GRANULARITY + 1;
+}
+
+/* fills ratios for the smallest total that fits, returns 0 if none does */
+size_t tune_search(size_t* ratios) {
+  size_t total, sum;
+  int i;
+  for (total = 1; total <= TUNE_MAX_TOTAL; total++) {
+    sum = 0;
+    for (i = 0; i < TUNE_REGIONS && sum <= MISH_CFG_GRANULARITY; i++) {
+      ratios[i] = tune_ratio(i, total);
+      sum += ratios[i];
+    }
+    if (sum <= MISH_CFG_GRANULARITY) {
+      /* the rest goes to the strings of the environment, the region that grows the most */
+      ratios[TUNE_STR] += MISH_CFG_GRANULARITY - sum;
+      return total;
+    }
+  }
+  return 0;
+}
+/* END: SIZING */
+
+void tune_print(size_t total, size_t* ratios, size_t num_lines, size_t failed) {
+  size_t sizes[TUNE_REGIONS];
+  size_t needs[TUNE_REGIONS];
+  int i;
+
+  needs[TUNE_ARG] = peaks.arg_arena;
+  needs[TUNE_STR] = peaks.str_arena;
+  needs[TUNE_NODE] = peaks.node_arena;
+  needs[TUNE_BUCKET] = peaks.map_count;
+  needs[TUNE_OUT] = peaks.out_buffer;
+  needs[TUNE_PREP] = use_cache ? peaks.prep_slot : 0;
+  for (i = 0; i < TUNE_REGIONS; i++) {
+    sizes[i] = shell_compute_size(total, ratios[i]);
+  }
+
+  printf("/* tools/tune-cfg: %lu lines (%lu failed), margin %lu%%\n",
+         (unsigned long)num_lines, (unsigned long)failed, (unsigned long)margin);
+  printf(" * mish_shell_new needs %lu bytes\n", (unsigned long)total);
+  printf(" *\n");
+  printf(" *   region                              peak   bytes\n");
+  for (i = 0; i < TUNE_REGIONS; i++) {
+    printf(" *   %-34s %6lu %7lu%s\n", region_names[i],
+           (unsigned long)needs[i], (unsigned long)sizes[i],
+           i == TUNE_BUCKET ? " (peak in keys)" :
+           i == TUNE_PREP && use_cache ? " (peak of a slot)" : "");
+  }
+  printf(" */\n");
+  printf("#define MISH_CFG_GRANULARITY               %d\n", MISH_CFG_GRANULARITY);
+  printf("#define MISH_CFG_ARG_ARENA_SIZE            %lu\n", (unsigned long)ratios[TUNE_ARG]);
+  printf("#define MISH_CFG_NODE_ARENA_SIZE           %lu\n", (unsigned long)ratios[TUNE_NODE]);
+  printf("#define MISH_CFG_HASHMAP_BUCKET_ARRAY_SIZE %lu\n", (unsigned long)ratios[TUNE_BUCKET]);
+  printf("#define MISH_CFG_OUT_BUFFER_SIZE           %lu\n", (unsigned long)ratios[TUNE_OUT]);
+  printf("#define MISH_CFG_STR_ARENA_SIZE            %lu\n", (unsigned long)ratios[TUNE_STR]);
+  printf("#define MISH_CFG_PREP_CACHE_SIZE           %lu\n", (unsigned long)ratios[TUNE_PREP]);
+  printf("#define MISH_CFG_PREP_CACHE_SLOTS          %d\n", use_cache ? MISH_CFG_PREP_CACHE_SLOTS : 0);
+}
+
+void usage(void) {
+  fprintf(stderr, "usage: tune-cfg [-o min out bytes] [-m margin percent] [-x] < commands.log\n");
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  size_t ratios[TUNE_REGIONS];
+  size_t size, num_lines, failed, total, i;
+  char** lines;
+  size_t* sizes;
+  char* log;
+  int arg;
+
+  for (arg = 1; arg < argc; arg++) {
+    if (strcmp(argv[arg], "-o") == 0 && arg + 1 < argc) {
+      min_out = (size_t)atol(argv[++arg]);
+    } else if (strcmp(argv[arg], "-m") == 0 && arg + 1 < argc) {
+      margin = (size_t)atol(argv[++arg]);
+    } else if (strcmp(argv[arg], "-x") == 0) {
+      use_cache = false;
+    } else {
+      usage();
+    }
+  }
+
+  log = tune_read(&size);
+  lines = (char**)malloc((size / 2 + 1) * sizeof(char*));
+  sizes = (size_t*)malloc((size / 2 + 1) * sizeof(size_t));
+  if (log == NULL || lines == NULL || sizes == NULL) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  num_lines = tune_split(log, size, lines, sizes);
+  if (num_lines == 0) {
+    fprintf(stderr, "no lines\n");
+    return 1;
+  }
+  for (i = 0; i < num_lines; i++) {
+    tune_scan_names(lines[i], sizes[i] - 1);
+  }
+
+  memset(&peaks, 0, sizeof(mish_peaks));
+  failed = tune_replay(lines, sizes, num_lines, use_cache, true);
+  if (use_cache) {
+    /* lines that don't fit in a cache slot are parsed in the arg arena */
+    tune_replay(lines, sizes, num_lines, false, false);
+  }
+
+  total = tune_search(ratios);
+  if (total == 0) {
+    fprintf(stderr, "no split of MISH_CFG_GRANULARITY fits the log\n");
+    return 1;
+  }
+  tune_print(total, ratios, num_lines, failed);
+  free(lines);
+  free(sizes);
+  free(log);
+  return 0;
+}